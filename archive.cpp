@@ -0,0 +1,159 @@
+#include "precomp.h"
+#include "bvh.h"
+#include "texture.h"
+#include "archive.h"
+#include "cl/skymap.h"
+
+#define ARCHIVE_MAGIC 0x48435241 // "ARCH"
+#define ARCHIVE_VERSION 1
+
+static void Layout( uint* layout )
+{
+	// an archive from a build with other struct sizes or constants is rejected
+	const uint values[8] = { sizeof( Tri ), sizeof( TriEx ), sizeof( BVHNode ), sizeof( TriBlock ), sizeof( TLASNode ), sizeof( mat4 ), BLOCKSIZE, SKYMAP_SIZE };
+	memcpy( layout, values, sizeof( values ) );
+}
+
+static void Sections( Mesh& mesh, TLAS& tlas, const mat4* transform, const uint* skyMap, const void** data, uint64_t* bytes )
+{
+	// the arrays that go into the archive, in section order, and their used sizes
+	const BVH& bvh = *mesh.bvh;
+	const void* d[SECTION_COUNT] = {
+		mesh.tri, mesh.triEx, bvh.bvhNode, bvh.triIdx, bvh.leafBlock, bvh.triBlock, tlas.tlasNode, transform,
+		mesh.texture->pixels, mesh.mipTexture->texels, skyMap
+	};
+	const uint64_t b[SECTION_COUNT] = {
+		sizeof( Tri ) * mesh.triCount, sizeof( TriEx ) * mesh.triCount, sizeof( BVHNode ) * bvh.nodesUsed,
+		sizeof( uint ) * mesh.triCount, sizeof( uint ) * bvh.nodesUsed, sizeof( TriBlock ) * bvh.blocksUsed,
+		sizeof( TLASNode ) * tlas.nodesUsed, sizeof( mat4 ) * tlas.blasCount,
+		sizeof( uint ) * mesh.texture->width * mesh.texture->height, mesh.mipTexture->bytes,
+		sizeof( uint ) * SKYMAP_SIZE * SKYMAP_SIZE
+	};
+	memcpy( data, d, sizeof( d ) );
+	memcpy( bytes, b, sizeof( b ) );
+}
+
+SceneArchive::SceneArchive( const char* file ) : map( file, true )
+{
+	header = (ArchiveHeader*)map.data;
+	uint layout[8];
+	Layout( layout );
+	if (!header || map.size < sizeof( ArchiveHeader ) || header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION) return;
+	if (memcmp( header->layout, layout, sizeof( layout ) )) return;
+	uchar* section[SECTION_COUNT];
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		if (header->section[i].offset + header->section[i].bytes > map.size) return;
+		section[i] = map.data + header->section[i].offset;
+	}
+	// wrap the sections; nothing is copied
+	mesh = new Mesh();
+	mesh->tri = (Tri*)section[SECTION_TRI];
+	mesh->triEx = (TriEx*)section[SECTION_TRIEX];
+	mesh->triCount = header->triCount;
+	BVH* bvh = mesh->bvh = new BVH();
+	bvh->mesh = mesh;
+	bvh->bvhNode = (BVHNode*)section[SECTION_BVHNODE];
+	bvh->triIdx = (uint*)section[SECTION_TRIIDX];
+	bvh->nodesUsed = header->nodesUsed;
+	bvh->leafBlock = (uint*)section[SECTION_LEAFBLOCK];
+	bvh->triBlock = (TriBlock*)section[SECTION_TRIBLOCK];
+	bvh->blocksUsed = bvh->blockCapacity = header->blocksUsed;
+	mesh->texture = new Surface( header->texWidth, header->texHeight, (uint*)section[SECTION_TEXTURE] );
+	mesh->mipTexture = new MipTexture( header->texWidth, header->texHeight, (uint*)section[SECTION_MIPTEXTURE] );
+	tlasNode = (TLASNode*)section[SECTION_TLASNODE];
+	transform = (mat4*)section[SECTION_TRANSFORM];
+	skyMap = (uint*)section[SECTION_SKYMAP];
+	valid = mesh->mipTexture->bytes == header->section[SECTION_MIPTEXTURE].bytes;
+}
+
+SceneArchive::~SceneArchive()
+{
+	if (!mesh) return;
+	delete mesh->mipTexture;
+	delete mesh->texture;
+	delete mesh->bvh;
+	delete mesh;
+}
+
+bool SceneArchive::Save( const char* file, Mesh& mesh, TLAS& tlas, const uint* skyMap, const char* meshFile, const char* textureFile )
+{
+	vector<mat4> transform( tlas.blasCount );
+	for (uint i = 0; i < tlas.blasCount; i++) transform[i] = tlas.blas[i].GetTransform();
+	const void* data[SECTION_COUNT];
+	uint64_t bytes[SECTION_COUNT];
+	Sections( mesh, tlas, transform.data(), skyMap, data, bytes );
+	ArchiveHeader header = {};
+	header.magic = ARCHIVE_MAGIC, header.version = ARCHIVE_VERSION;
+	Layout( header.layout );
+	strncpy( header.meshFile, meshFile, sizeof( header.meshFile ) - 1 );
+	strncpy( header.textureFile, textureFile, sizeof( header.textureFile ) - 1 );
+	header.triCount = mesh.triCount, header.nodesUsed = mesh.bvh->nodesUsed, header.blocksUsed = mesh.bvh->blocksUsed;
+	header.tlasNodesUsed = tlas.nodesUsed, header.instCount = tlas.blasCount;
+	header.texWidth = mesh.texture->width, header.texHeight = mesh.texture->height;
+	// sections are cacheline aligned; the TLAS section has room for every node
+	// the builder may create, so BuildQuick can run on it in place
+	uint64_t offset = (sizeof( ArchiveHeader ) + 63) & ~(uint64_t)63;
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		header.section[i].offset = offset;
+		header.section[i].bytes = i == SECTION_TLASNODE ? sizeof( TLASNode ) * 2 * (tlas.blasCount + 64) : bytes[i];
+		offset = (offset + header.section[i].bytes + 63) & ~(uint64_t)63;
+	}
+	FILE* f = fopen( file, "wb" );
+	if (!f) return false;
+	static const uchar zeros[4096] = {};
+	bool written = fwrite( &header, sizeof( header ), 1, f ) == 1;
+	uint64_t pos = sizeof( header );
+	auto pad = [&]( uint64_t n ) { for (size_t c; written && n > 0; n -= c) c = (size_t)min( n, (uint64_t)sizeof( zeros ) ), written = fwrite( zeros, 1, c, f ) == c; };
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		pad( header.section[i].offset - pos );
+		if (written && bytes[i]) written = fwrite( data[i], bytes[i], 1, f ) == 1;
+		pad( header.section[i].bytes - bytes[i] );
+		pos = header.section[i].offset + header.section[i].bytes;
+	}
+	fclose( f );
+	return written;
+}
+
+bool SceneArchive::Verify( Mesh& built, TLAS& tlas, const uint* builtSky )
+{
+	// every section must equal the array it was written from, and the mapped
+	// BVH, with its SoA leaf blocks, must find the same hits as the built one
+	if (!valid) { printf( "archive could not be mapped\n" ); return false; }
+	static const char* name[SECTION_COUNT] = { "Tri", "TriEx", "BVHNode", "triIdx", "leafBlock", "TriBlock", "TLASNode", "transform", "texture", "mipTexture", "sky" };
+	vector<mat4> transforms( tlas.blasCount );
+	for (uint i = 0; i < tlas.blasCount; i++) transforms[i] = tlas.blas[i].GetTransform();
+	const void* data[SECTION_COUNT];
+	uint64_t bytes[SECTION_COUNT];
+	Sections( built, tlas, transforms.data(), builtSky, data, bytes );
+	bool identical = true;
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		const bool same = header->section[i].bytes >= bytes[i] && memcmp( map.data + header->section[i].offset, data[i], bytes[i] ) == 0;
+		printf( "  %-10s at %10llu, %10.1fKB: %s\n", name[i], (unsigned long long)header->section[i].offset, bytes[i] / 1024.0f, same ? "identical" : "DIFFERENT" );
+		identical &= same;
+	}
+	const BVHNode& root = built.bvh->bvhNode[0];
+	const int N = 1 << 16;
+	uint seed = 0x2545f491, mismatches = 0, hits = 0;
+	for (int i = 0; i < N; i++)
+	{
+		// random rays from inside the mesh bounds
+		const float3 O = root.aabbMin + (root.aabbMax - root.aabbMin) * float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) );
+		const float3 D = normalize( float3( RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f ) );
+		Ray ray[2];
+		for (int j = 0; j < 2; j++)
+			ray[j].O = O, ray[j].D = D, ray[j].rD = float3( 1 / D.x, 1 / D.y, 1 / D.z ), ray[j].hit.t = 1e30f;
+		RayCounter counter0( ray[0] ), counter1( ray[1] );
+		built.bvh->Intersect( ray[0], 0, &counter0 );
+		mesh->bvh->Intersect( ray[1], 0, &counter1 );
+		mismatches += ray[0].hit.t != ray[1].hit.t || ray[0].hit.instPrim != ray[1].hit.instPrim;
+		hits += ray[0].hit.t < 1e30f;
+	}
+	printf( "  %i rays, %i hits: %i differ\n", N, hits, mismatches );
+	return identical && mismatches == 0;
+}
+
+// EOF
@@ -0,0 +1,50 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// binary scene archive: everything startup derives from the OBJ, PNG and HDR
+// sources, in one file that is mapped instead of parsed. Every section starts
+// on a 64-byte boundary, so the arrays keep the alignment the kernels expect,
+// and Mesh, BVH, Surface and MipTexture point straight into the mapping. It is
+// mapped copy-on-write: code that writes to a section, like BuildQuick for the
+// TLAS nodes, gets private copies of the pages it touches. Sections hold the
+// used part of each array only, so an archived BVH can be refitted, but not
+// rebuilt. Write one with whitted --archive.
+enum
+{
+	SECTION_TRI = 0, SECTION_TRIEX, SECTION_BVHNODE, SECTION_TRIIDX, SECTION_LEAFBLOCK, SECTION_TRIBLOCK,
+	SECTION_TLASNODE, SECTION_TRANSFORM, SECTION_TEXTURE, SECTION_MIPTEXTURE, SECTION_SKYMAP, SECTION_COUNT
+};
+
+struct ArchiveHeader
+{
+	uint magic, version;
+	uint layout[8];			// struct sizes and build constants; must match the executable
+	char meshFile[64], textureFile[64]; // sources, to detect a stale archive
+	uint triCount, nodesUsed, blocksUsed, tlasNodesUsed, instCount, texWidth, texHeight;
+	struct { uint64_t offset, bytes; } section[SECTION_COUNT];
+};
+
+class SceneArchive
+{
+public:
+	SceneArchive( const char* file );
+	~SceneArchive();
+	SceneArchive( const SceneArchive& ) = delete;
+	SceneArchive& operator=( const SceneArchive& ) = delete;
+	static bool Save( const char* file, Mesh& mesh, TLAS& tlas, const uint* skyMap, const char* meshFile, const char* textureFile );
+	bool Verify( Mesh& mesh, TLAS& tlas, const uint* skyMap );
+	// data; all pointers are into the mapping
+	MappedFile map;
+	ArchiveHeader* header = 0;
+	bool valid = false;		// false if the file is missing, truncated or from another build
+	Mesh* mesh = 0;			// with its BVH and textures
+	TLASNode* tlasNode = 0;	// room for the nodes BuildQuick creates, like the TLAS constructor allocates
+	mat4* transform = 0;	// one per instance
+	uint* skyMap = 0;
+};
+
+} // namespace Tmpl8
+
+// EOF
@@ -0,0 +1,40 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// linear allocator for transient build data. Every allocation is rounded
+// up to a full cacheline, so all returned pointers are 64-byte aligned.
+// Memory is claimed once, up front; Reset releases everything at once, so
+// code that rebuilds each frame never touches the heap after startup.
+class Arena
+{
+public:
+	Arena() = default;
+	Arena( const size_t bytes )
+	{
+		capacity = (bytes + 63) & ~(size_t)63;
+		buffer = (uchar*)MALLOC64( capacity );
+	}
+	~Arena() { FREE64( buffer ); }
+	Arena( const Arena& ) = delete;
+	Arena& operator=( const Arena& ) = delete;
+	void* Alloc( size_t bytes )
+	{
+		bytes = (bytes + 63) & ~(size_t)63;
+		FATALERROR_IF( used + bytes > capacity, "arena exhausted: %zu of %zu bytes requested.", used + bytes, capacity );
+		void* p = buffer + used;
+		used += bytes;
+		if (used > peak) peak = used;
+		return p;
+	}
+	template <class T> T* Alloc( const size_t count ) { return (T*)Alloc( count * sizeof( T ) ); }
+	void Reset() { used = 0; } // note: does not call destructors
+	// data
+	uchar* buffer = 0;
+	size_t capacity = 0, used = 0, peak = 0; // peak: high water mark, in bytes
+};
+
+} // namespace Tmpl8
+
+// EOF
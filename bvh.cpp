@@ -1,5 +1,6 @@
 #include "precomp.h"
 #include "bvh.h"
+#include "texture.h"
 
 /*
 Performance: 1858ms without kD-tree
@@ -35,6 +36,28 @@ void IntersectTri( Ray& ray, const Tri& tri, const uint instPrim )
 		ray.hit.v = v, ray.hit.instPrim = instPrim;
 }
 
+// select the BVH kernels for this CPU; see isa.h
+static const ISAKernels* SelectISA()
+{
+	// construct our own CPUCaps: the global one in template.cpp may not be initialized yet
+	CPUCaps caps;
+	// wide registers are only usable if the OS saves them on a context switch
+	int info[4];
+	cpuid( info, 1 );
+	const unsigned long long xcr0 = (info[2] & (1 << 27)) ? _xgetbv( 0 ) : 0;
+	const bool osYMM = (xcr0 & 0x06) == 0x06, osZMM = (xcr0 & 0xe6) == 0xe6;
+	int level = ISA_SSE2;
+	if (caps.HW_SSE41) level = ISA_SSE41;
+	if (caps.HW_AVX2 && caps.HW_FMA3 && osYMM) level = ISA_AVX2;
+	if (caps.HW_AVX512F && caps.HW_AVX512CD && caps.HW_AVX512BW && caps.HW_AVX512DQ && caps.HW_AVX512VL && osZMM) level = ISA_AVX512;
+#ifdef FORCE_ISA
+	level = FORCE_ISA;
+#endif
+	const ISAKernels* table[4] = { &isaSSE2, &isaSSE41, &isaAVX2, &isaAVX512 };
+	return table[level];
+}
+const ISAKernels* Tmpl8::activeISA = SelectISA();
+
 inline float IntersectAABB( const Ray& ray, const float3 bmin, const float3 bmax )
 {
 	// "slab test" ray/AABB intersection
@@ -47,26 +70,18 @@ inline float IntersectAABB( const Ray& ray, const float3 bmin, const float3 bmax
 	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
 }
 
-float IntersectAABB_SSE( const Ray& ray, const __m128& bmin4, const __m128& bmax4 )
-{
-	// "slab test" ray/AABB intersection, using SIMD instructions
-	static __m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
-	__m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmin4, mask4 ), ray.O4 ), ray.rD4 );
-	__m128 t2 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmax4, mask4 ), ray.O4 ), ray.rD4 );
-	__m128 vmax4 = _mm_max_ps( t1, t2 ), vmin4 = _mm_min_ps( t1, t2 );
-	float tmax = min( vmax4.m128_f32[0], min( vmax4.m128_f32[1], vmax4.m128_f32[2] ) );
-	float tmin = max( vmin4.m128_f32[0], max( vmin4.m128_f32[1], vmin4.m128_f32[2] ) );
-	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
-}
-
 // Mesh class implementation
 
-Mesh::Mesh( const uint primCount )
+Mesh::Mesh( const uint primCount, Arena* arena )
 {
 	// basic constructor, for top-down TLAS construction
-	tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 );
+	if (arena)
+		tri = arena->Alloc<Tri>( primCount ),
+		triEx = arena->Alloc<TriEx>( primCount );
+	else
+		tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 ),
+		triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
 	memset( tri, 0, primCount * sizeof( Tri ) );
-	triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
 	memset( triEx, 0, primCount * sizeof( TriEx ) );
 	triCount = primCount;
 }
@@ -118,20 +133,31 @@ Mesh::Mesh( const char* objFile, const char* texFile, const float scale )
 	fclose( file );
 	bvh = new BVH( this );
 	texture = new Surface( texFile );
+	mipTexture = new MipTexture( texture );
 }
 
 // BVH class implementation
 
-BVH::BVH( Mesh* triMesh )
+BVH::BVH( Mesh* triMesh, Arena* arena, bool onePrimLeaves, bool build )
 {
 	mesh = triMesh;
-	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * mesh->triCount * 2 + 64, 64 );
-	triIdx = new uint[mesh->triCount];
-	Build();
+	subdivToOnePrim = onePrimLeaves;
+	if (arena)
+		bvhNode = (BVHNode*)arena->Alloc( sizeof( BVHNode ) * mesh->triCount * 2 + 64 ),
+		triIdx = arena->Alloc<uint>( mesh->triCount );
+	else
+		bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * mesh->triCount * 2 + 64, 64 ),
+		triIdx = new uint[mesh->triCount],
+		leafBlock = new uint[mesh->triCount * 2 + 64]; // only BLASes get SoA leaf blocks
+	if (build) Build(); // else the caller fills the nodes, e.g. from a file
 }
 
 void BVH::Intersect( Ray& ray, uint instanceIdx, RayCounter* counter )
 {
+#ifdef USE_SSE
+	// SIMD traversal, compiled for several instruction sets; see bvh_isa.h
+	activeISA->Intersect( *this, ray, instanceIdx, counter );
+#else
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint stackPtr = 0;
 	while (1)
@@ -140,8 +166,8 @@ void BVH::Intersect( Ray& ray, uint instanceIdx, RayCounter* counter )
 		{	
 			for (uint i = 0; i < node->triCount; i++)
 			{
-				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
-				IntersectTri( ray, mesh->tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+				const uint prim = triIdx[node->leftFirst + i];
+				IntersectTri( ray, mesh->tri[prim], (instanceIdx << 20) + prim );
 #ifdef TRACK
 				counter->incrementTriangleTests();
 #endif
@@ -155,20 +181,11 @@ void BVH::Intersect( Ray& ray, uint instanceIdx, RayCounter* counter )
 		}
 		BVHNode* child1 = &bvhNode[node->leftFirst];
 		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
-#ifdef USE_SSE
-		float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
-		float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
-#ifdef TRACK
-		counter->incrementBoxTests();
-		counter->incrementBoxTests();
-#endif
-#else
 		float dist1 = IntersectAABB( ray, child1->aabbMin, child1->aabbMax );
 		float dist2 = IntersectAABB( ray, child2->aabbMin, child2->aabbMax );
 #ifdef TRACK
 		counter->incrementBoxTests();
 		counter->incrementBoxTests();
-#endif
 #endif
 		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
 		if (dist1 == 1e30f)
@@ -185,6 +202,7 @@ void BVH::Intersect( Ray& ray, uint instanceIdx, RayCounter* counter )
 			if (dist2 != 1e30f) stack[stackPtr++] = child2;
 		}
 	}
+#endif
 }
 
 void BVH::Refit()
@@ -206,6 +224,7 @@ void BVH::Refit()
 		node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
 		node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
 	}
+	if (leafBlock) PackLeaves(); // vertices moved: refresh the SoA copies
 	printf( "BVH itted in %.2fms\n", t.elapsed() * 1000 );
 }
 
@@ -228,6 +247,49 @@ void BVH::Build()
 	// subdivide recursively
 	buildStackPtr = 0;
 	Subdivide( 0, 0, nodesUsed, centroidMin, centroidMax );
+	if (leafBlock) PackLeaves();
+}
+
+size_t BVH::Bytes() const
+{
+	// memory claimed for the triangles, BVH nodes and SoA leaf blocks
+	const size_t tris = mesh->triCount;
+	return tris * (sizeof( Tri ) + sizeof( uint )) + sizeof( BVHNode ) * tris * 2 + 64 +
+		(leafBlock ? (tris * 2 + 64) * sizeof( uint ) : 0) + blockCapacity * sizeof( TriBlock );
+}
+
+void BVH::PackLeaves()
+{
+	// each leaf starts a fresh block; count how many we need
+	uint needed = 0;
+	for (uint i = 0; i < nodesUsed; i++) if (i != 1 && bvhNode[i].isLeaf())
+		needed += (bvhNode[i].triCount + BLOCKSIZE - 1) / BLOCKSIZE;
+	if (needed > blockCapacity)
+	{
+		FREE64( triBlock );
+		triBlock = (TriBlock*)MALLOC64( needed * sizeof( TriBlock ) );
+		blockCapacity = needed;
+	}
+	// zeroed edges make the unused lanes fail the parallel test
+	memset( triBlock, 0, needed * sizeof( TriBlock ) );
+	blocksUsed = 0;
+	for (uint i = 0; i < nodesUsed; i++) if (i != 1 && bvhNode[i].isLeaf())
+	{
+		const BVHNode& node = bvhNode[i];
+		leafBlock[i] = blocksUsed;
+		for (uint j = 0; j < node.triCount; j++)
+		{
+			TriBlock& block = triBlock[blocksUsed + j / BLOCKSIZE];
+			const uint lane = j % BLOCKSIZE, idx = triIdx[node.leftFirst + j];
+			const Tri& tri = mesh->tri[idx];
+			const float3 e1 = tri.vertex1 - tri.vertex0, e2 = tri.vertex2 - tri.vertex0;
+			block.v0x[lane] = tri.vertex0.x, block.v0y[lane] = tri.vertex0.y, block.v0z[lane] = tri.vertex0.z;
+			block.e1x[lane] = e1.x, block.e1y[lane] = e1.y, block.e1z[lane] = e1.z;
+			block.e2x[lane] = e2.x, block.e2y[lane] = e2.y, block.e2z[lane] = e2.z;
+			block.primIdx[lane] = idx;
+		}
+		blocksUsed += (node.triCount + BLOCKSIZE - 1) / BLOCKSIZE;
+	}
 }
 
 void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax )
@@ -277,6 +339,10 @@ void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMi
 
 float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax )
 {
+#ifdef USE_SSE
+	// SIMD binning, compiled for several instruction sets; see bvh_isa.h
+	return activeISA->FindBestSplitPlane( *this, node, axis, splitPos, centroidMin, centroidMax );
+#else
 	float bestCost = 1e30f;
 	for (int a = 0; a < 3; a++)
 	{
@@ -286,47 +352,6 @@ float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3&
 		float scale = BINS / (boundsMax - boundsMin);
 		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
 		int leftSum = 0, rightSum = 0;
-#ifdef USE_SSE
-		__m128 min4[BINS], max4[BINS];
-		uint count[BINS];
-		for (uint i = 0; i < BINS; i++)
-			min4[i] = _mm_set_ps1( 1e30f ),
-			max4[i] = _mm_set_ps1( -1e30f ),
-			count[i] = 0;
-		for (uint i = 0; i < node.triCount; i++)
-		{
-			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
-			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
-			count[binIdx]++;
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v0 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v0 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v1 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v1 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v2 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v2 );
-		}
-		// gather data for the 7 planes between the 8 bins
-		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
-		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
-		const __m128 tmp4 = _mm_setr_ps( -1, -1, -1, 1 );
-		const __m128 xyzMask4 = _mm_cmple_ps( tmp4, _mm_setzero_ps() );
-
-		for (int i = 0; i < BINS - 1; i++)
-		{
-			leftSum += count[i];
-			rightSum += count[BINS - 1 - i];
-			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
-			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 2 - i] );
-			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
-			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 2 - i] );
-			__m128 le = _mm_sub_ps( leftMax4, leftMin4 );
-			__m128 re = _mm_sub_ps( rightMax4, rightMin4 );
-			
-			const int yzxShuffle = 9;
-			leftCountArea[i] = leftSum * _mm_cvtss_f32( _mm_dp_ps( le, _mm_shuffle_ps( le, le, yzxShuffle ), 0x7f ) );
-			rightCountArea[BINS - 2 - i] = rightSum * _mm_cvtss_f32( _mm_dp_ps( re, _mm_shuffle_ps( re, re, yzxShuffle ), 0x7f ) );
-		}
-#else
 		struct Bin { aabb bounds; int triCount = 0; } bin[BINS];
 		for (uint i = 0; i < node.triCount; i++)
 		{
@@ -348,7 +373,6 @@ float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3&
 			rightBox.grow( bin[BINS - 1 - i].bounds );
 			rightCountArea[BINS - 2 - i] = rightSum * rightBox.area();
 		}
-#endif
 		// calculate SAH cost for the 7 planes
 		scale = (boundsMax - boundsMin) / BINS;
 		for (int i = 0; i < BINS - 1; i++)
@@ -359,29 +383,16 @@ float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3&
 		}
 	}
 	return bestCost;
+#endif
 }
 
 void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax )
 {
-	BVHNode& node = bvhNode[nodeIdx];
 #ifdef USE_SSE
-	__m128 min4 = _mm_set_ps1( 1e30f ), max4 = _mm_set_ps1( -1e30f );
-	__m128 cmin4 = _mm_set_ps1( 1e30f ), cmax4 = _mm_set_ps1( -1e30f );
-	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
-	{
-		Tri& leafTri = mesh->tri[triIdx[first + i]];
-		min4 = _mm_min_ps( min4, leafTri.v0 ), max4 = _mm_max_ps( max4, leafTri.v0 );
-		min4 = _mm_min_ps( min4, leafTri.v1 ), max4 = _mm_max_ps( max4, leafTri.v1 );
-		min4 = _mm_min_ps( min4, leafTri.v2 ), max4 = _mm_max_ps( max4, leafTri.v2 );
-		cmin4 = _mm_min_ps( cmin4, leafTri.centroid4 );
-		cmax4 = _mm_max_ps( cmax4, leafTri.centroid4 );
-	}
-	__m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
-	node.aabbMin4 = _mm_blendv_ps( node.aabbMin4, min4, mask4 );
-	node.aabbMax4 = _mm_blendv_ps( node.aabbMax4, max4, mask4 );
-	centroidMin = *(float3*)&cmin4;
-	centroidMax = *(float3*)&cmax4;
+	// SIMD bounds, compiled for several instruction sets; see bvh_isa.h
+	activeISA->UpdateNodeBounds( *this, nodeIdx, centroidMin, centroidMax );
 #else
+	BVHNode& node = bvhNode[nodeIdx];
 	node.aabbMin = float3( 1e30f );
 	node.aabbMax = float3( -1e30f );
 	centroidMin = float3( 1e30f );
@@ -402,6 +413,123 @@ void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidM
 #endif
 }
 
+// KDTree implementation
+
+int KDTree::FindNearest( uint A, uint& startB, float& startSA )
+{
+	// SIMD search, compiled for several instruction sets; see bvh_isa.h
+	return activeISA->FindNearest( *this, A, startB, startSA );
+}
+
+void KDTree::FindNearest( uint* A, const uint count, uint* bestB, float* bestSA, const bool threaded )
+{
+	// the lanes of a group share one traversal, so they should be neighbours:
+	// take the queries in the order of their kD-tree leaves, which is close to
+	// spatial order, since subdivide numbers the nodes depth-first. A counting
+	// sort on the leaf index, in place, with the tree's own scratch arrays
+	memset( bucket, 0, (nodePtr + 1) * sizeof( uint ) );
+	for (uint i = 0; i < count; i++) bucket[leaf[A[i] - offset] + 1]++;
+	for (uint i = 0; i < nodePtr; i++) bucket[i + 1] += bucket[i];
+	for (uint i = 0; i < count; i++) sorted[bucket[leaf[A[i] - offset]]++] = A[i];
+	for (uint i = 0; i < count; i++) A[i] = bestB[i] = sorted[i], bestSA[i] = 1e30f;
+	// batches of 64 queries per thread; a batch goes four at a time, see bvh_isa.h
+	const int batches = (count + 63) / 64;
+#pragma omp parallel for schedule(dynamic) if (threaded && batches > 1)
+	for (int i = 0; i < batches; i++)
+	{
+		const uint first = i * 64;
+		activeISA->FindNearestBatch( *this, A + first, min( 64u, count - first ), bestB + first, bestSA + first );
+	}
+}
+
+void Tmpl8::BenchmarkKDTree()
+{
+	// whitted --kdbench: nearest neighbour queries for agglomerative clustering,
+	// one for every node of a set of random instance boxes. The scalar search
+	// runs one query at a time; the batch search four per traversal, on one
+	// thread and on all. Results are checked against a brute force search, for
+	// a sample of the queries in the larger sets.
+	printf( "kD-tree nearest neighbour search, %s kernels\n", activeISA->name );
+	uint seed = 0x2545f491;
+	for (uint N = 1024; N <= 65536; N *= 4)
+	{
+		Arena arena( sizeof( TLASNode ) * N + 64 + KDTree::ArenaBytes( N ) );
+		TLASNode* nodes = arena.Alloc<TLASNode>( N );
+		// boxes of 0.5 to 2 units, at a density that does not depend on N
+		const float side = 4 * cbrtf( (float)N );
+		for (uint i = 0; i < N; i++)
+		{
+			const float3 P( RandomFloat( seed ) * side, RandomFloat( seed ) * side, RandomFloat( seed ) * side );
+			const float3 E( 0.25f + 0.75f * RandomFloat( seed ), 0.25f + 0.75f * RandomFloat( seed ), 0.25f + 0.75f * RandomFloat( seed ) );
+			nodes[i].aabbMin = P - E, nodes[i].aabbMax = P + E, nodes[i].leftRight = 0, nodes[i].BLAS = i;
+		}
+		KDTree tree( nodes, N, 0, &arena );
+		tree.rebuild();
+		vector<uint> A( N ), scalarB( N ), batchB( N );
+		vector<float> scalarSA( N ), batchSA( N ), nodeSA( N );
+		for (uint i = 0; i < N; i++) A[i] = i;
+		// one query at a time
+		Timer timer;
+		for (uint i = 0; i < N; i++) scalarB[i] = i, scalarSA[i] = 1e30f, tree.FindNearest( i, scalarB[i], scalarSA[i] );
+		const float scalarTime = timer.elapsed();
+		// batch, on this thread only, then on all threads
+		float batchTime[2];
+		for (int threaded = 0; threaded < 2; threaded++)
+		{
+			timer.reset();
+			tree.FindNearest( A.data(), N, batchB.data(), batchSA.data(), threaded == 1 );
+			batchTime[threaded] = timer.elapsed();
+		}
+		for (uint i = 0; i < N; i++) nodeSA[A[i]] = batchSA[i]; // the results are in leaf order
+		// brute force reference
+		const uint step = N <= 4096 ? 1 : N / 4096;
+		int scalarWrong = 0, batchWrong = 0, checked = 0;
+		for (uint a = 0; a < N; a += step, checked++)
+		{
+			float smallest = 1e30f;
+			for (uint b = 0; b < N; b++) if (b != a)
+			{
+				const float3 e = fmaxf( nodes[a].aabbMax, nodes[b].aabbMax ) - fminf( nodes[a].aabbMin, nodes[b].aabbMin );
+				smallest = min( smallest, e.x * e.y + e.y * e.z + e.z * e.x );
+			}
+			scalarWrong += scalarSA[a] > smallest * 1.000001f, batchWrong += nodeSA[a] > smallest * 1.000001f;
+		}
+		printf( "%6i nodes: scalar %.2fms, batch %.2fms (%.2fx), batch on all threads %.2fms; %.1f Mqueries/s; misses: scalar %i, batch %i of %i\n",
+			N, scalarTime * 1000, batchTime[0] * 1000, scalarTime / batchTime[0], batchTime[1] * 1000, N / (batchTime[1] * 1e6f),
+			scalarWrong, batchWrong, checked );
+	}
+}
+
+void Tmpl8::BenchmarkTLAS( uint N )
+{
+	// whitted --tlasbench [instances]: the top-down BuildQuick and the clustering
+	// Build, on random instance boxes: build time, and the quality of the result.
+	// Below 256 instances Build falls back to BuildQuick, so that is the minimum
+	if (N < 256) printf( "the clustering builder needs at least 256 instances; using 256\n" ), N = 256;
+	printf( "TLAS builders, %i instances\n", N );
+	BVHInstance* instance = new BVHInstance[N];
+	uint seed = 0x2545f491;
+	const float side = 4 * cbrtf( (float)N );
+	for (uint i = 0; i < N; i++)
+	{
+		const float3 P( RandomFloat( seed ) * side, RandomFloat( seed ) * side, RandomFloat( seed ) * side );
+		const float3 E( 0.25f + 0.75f * RandomFloat( seed ), 0.25f + 0.75f * RandomFloat( seed ), 0.25f + 0.75f * RandomFloat( seed ) );
+		instance[i].bounds.bmin = P - E, instance[i].bounds.bmax = P + E;
+	}
+	TLAS tlas( instance, N );
+	for (int builder = 0; builder < 2; builder++)
+	{
+		const int runs = 10;
+		Timer timer;
+		for (int i = 0; i < runs; i++) if (builder) tlas.Build(); else tlas.BuildQuick();
+		const float buildTime = timer.elapsed() / runs;
+		BVHStats stats = Analyze( tlas );
+		printf( "%-22s %7.2fms per build; SAH cost %.2f, EPO %.2f\n", builder ? "clustering (Build):" : "top-down (BuildQuick):",
+			buildTime * 1000, stats.sah, stats.epo );
+	}
+	delete[] instance;
+}
+
 // BVHInstance implementation
 
 void BVHInstance::SetTransform( mat4& T )
@@ -409,6 +537,9 @@ void BVHInstance::SetTransform( mat4& T )
 	transform = T;
 	transform = T;
 	invTransform = transform.Inverted();
+	// store the inverse as four columns for the SIMD ray transform; the bottom row of an affine matrix is implied
+	const float* m = invTransform.cell;
+	for (int i = 0; i < 4; i++) invCol[i] = _mm_setr_ps( m[i], m[4 + i], m[8 + i], 0 );
 	// calculate world-space bounds using the new matrix
 	float3 bmin = bvh->bvhNode[0].aabbMin, bmax = bvh->bvhNode[0].aabbMax;
 	bounds = aabb();
@@ -419,16 +550,33 @@ void BVHInstance::SetTransform( mat4& T )
 
 void BVHInstance::Intersect( Ray& ray, RayCounter* counter )
 {
-	// backup ray and transform original
-	Ray backupRay = ray;
-	ray.O = TransformPosition( ray.O, invTransform );
-	ray.D = TransformVector( ray.D, invTransform );
-	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	InstanceRayCache cache;
+	Intersect( ray, counter, cache );
+}
+
+void BVHInstance::Intersect( Ray& ray, RayCounter* counter, InstanceRayCache& cache )
+{
+	// backup world space origin and direction; the hit record is shared
+	const __m128 O4 = ray.O4, D4 = ray.D4, rD4 = ray.rD4;
+	// transform the origin: O' = c0 * O.x + c1 * O.y + c2 * O.z + c3
+	ray.O4 = _mm_add_ps(
+		_mm_add_ps( _mm_mul_ps( invCol[0], _mm_shuffle_ps( O4, O4, 0x00 ) ), _mm_mul_ps( invCol[1], _mm_shuffle_ps( O4, O4, 0x55 ) ) ),
+		_mm_add_ps( _mm_mul_ps( invCol[2], _mm_shuffle_ps( O4, O4, 0xaa ) ), invCol[3] ) );
+	// transform the direction, unless the previous instance had the same rotation and scale
+	if (!cache.valid || (_mm_movemask_ps( _mm_and_ps( _mm_and_ps( _mm_cmpeq_ps( cache.col[0], invCol[0] ),
+		_mm_cmpeq_ps( cache.col[1], invCol[1] ) ), _mm_cmpeq_ps( cache.col[2], invCol[2] ) ) ) != 15))
+	{
+		cache.D4 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( invCol[0], _mm_shuffle_ps( D4, D4, 0x00 ) ),
+			_mm_mul_ps( invCol[1], _mm_shuffle_ps( D4, D4, 0x55 ) ) ), _mm_mul_ps( invCol[2], _mm_shuffle_ps( D4, D4, 0xaa ) ) );
+		cache.rD4 = _mm_div_ps( _mm_set1_ps( 1 ), cache.D4 ); // w lane is ignored by the traversal
+		cache.col[0] = invCol[0], cache.col[1] = invCol[1], cache.col[2] = invCol[2];
+		cache.valid = true;
+	}
+	ray.D4 = cache.D4, ray.rD4 = cache.rD4;
 	// trace ray through BVH
 	bvh->Intersect( ray, idx, counter );
 	// restore ray origin and direction
-	backupRay.hit = ray.hit;
-	ray = backupRay;
+	ray.O4 = O4, ray.D4 = D4, ray.rD4 = rD4;
 }
 
 // TLAS implementation
@@ -439,10 +587,45 @@ TLAS::TLAS( BVHInstance* bvhList, int N )
 	// copy a pointer to the array of bottom level accstruc instances
 	blas = bvhList;
 	blasCount = N;
+	// until Flatten bakes some of them, all instances are in the TLAS
+	instList = new uint[N];
+	for (int i = 0; i < N; i++) instList[i] = i;
+	instCount = N;
 	// allocate TLAS nodes
 	tlasNode = (TLASNode*)_aligned_malloc( sizeof( TLASNode ) * 2 * (N + 64), 64 );
 	nodeIdx = new uint[N];
 	nodesUsed = 2;
+	// claim build memory once: sort items, up to 16 kD-trees and clustering data
+	// persist; the temporary mesh and BVH used by BuildQuick are per frame
+	buildArena = new Arena( sizeof( SortItem ) * N + 64 + 16 * (sizeof( KDTree ) + 64 + KDTree::ArenaBytes( (N + 15) / 16 )) +
+		4 * (sizeof( uint ) * N + 64) );
+	frameArena = new Arena( (sizeof( Tri ) + sizeof( TriEx ) + sizeof( BVHNode ) * 2 + sizeof( uint )) * N + 5 * 64 );
+}
+
+TLAS::~TLAS()
+{
+	// the kD-trees and sort items live in buildArena and need no destructors
+	if (ownNodes) _aligned_free( tlasNode );
+	delete[] nodeIdx;
+	delete[] instList;
+	delete[] flatInstPrim;
+	delete flatBVH;
+	delete flatMesh;
+	delete buildArena;
+	delete frameArena;
+}
+
+TLAS& TLAS::operator=( TLAS&& t ) noexcept
+{
+	// swap everything; t releases what this TLAS held
+	swap( tlasNode, t.tlasNode ), swap( ownNodes, t.ownNodes ), swap( blas, t.blas );
+	swap( nodesUsed, t.nodesUsed ), swap( blasCount, t.blasCount ), swap( nodeIdx, t.nodeIdx );
+	swap( tree, t.tree ), swap( treeSize, t.treeSize ), swap( item, t.item ), swap( treeIdx, t.treeIdx );
+	swap( clusterIdx, t.clusterIdx ), swap( clusterB, t.clusterB ), swap( clusterMatch, t.clusterMatch ), swap( clusterSA, t.clusterSA );
+	swap( buildArena, t.buildArena ), swap( frameArena, t.frameArena );
+	swap( instList, t.instList ), swap( instCount, t.instCount );
+	swap( flatMesh, t.flatMesh ), swap( flatBVH, t.flatBVH ), swap( flatInstPrim, t.flatInstPrim );
+	return *this;
 }
 
 int TLAS::FindBestMatch( int N, int A )
@@ -451,15 +634,15 @@ int TLAS::FindBestMatch( int N, int A )
 	float smallest = 1e30f;
 	int bestB = -1;
 
-	const __m128 tmp4 = _mm_setr_ps( -1, -1, -1, 1 );
-	const __m128 xyzMask4 = _mm_cmple_ps( tmp4, _mm_setzero_ps() );
-
 	for (int B = 0; B < N; B++) if (B != A)
 	{
 		__m128 bmax = _mm_max_ps( tlasNode[nodeIdx[A]].aabbMax4, tlasNode[nodeIdx[B]].aabbMax4 );
 		__m128 bmin = _mm_min_ps( tlasNode[nodeIdx[A]].aabbMin4, tlasNode[nodeIdx[B]].aabbMin4 );
 		__m128 e = _mm_sub_ps( bmax, bmin );
-		float surfaceArea = _mm_cvtss_f32( _mm_dp_ps( e, _mm_shuffle_ps( e, e, 9 ), 0x7f ) );
+		// ex*ey + ey*ez + ez*ex; plain SSE2, host code has no SSE4.1 dot product
+		__m128 p = _mm_mul_ps( e, _mm_shuffle_ps( e, e, 9 ) );
+		p = _mm_add_ss( _mm_add_ss( p, _mm_shuffle_ps( p, p, 1 ) ), _mm_shuffle_ps( p, p, 2 ) );
+		float surfaceArea = _mm_cvtss_f32( p );
 		if (surfaceArea < smallest) smallest = surfaceArea, bestB = B;
 	}
 	return bestB;
@@ -467,35 +650,96 @@ int TLAS::FindBestMatch( int N, int A )
 
 void TLAS::Build()
 {
-	// assign a TLASleaf node to each BLAS
-	nodesUsed = 1;
-	for (uint i = 0; i < blasCount; i++)
+	// agglomerative clustering (Walter et al., 2008). SortAndSplit deals the
+	// instances over 16 chunks, each with its own kD-tree, free list and range
+	// of the leaf array, so the chunks cluster in parallel without locks
+	if (instCount < 256) { BuildQuick(); return; } // chunks of less than 16 instances
+	if (!clusterIdx)
+		clusterIdx = buildArena->Alloc<uint>( blasCount ), clusterB = buildArena->Alloc<uint>( blasCount ),
+		clusterMatch = buildArena->Alloc<uint>( blasCount ), clusterSA = buildArena->Alloc<float>( blasCount );
+	nodesUsed = 32; // the chunk leaves start here; 1..15 join the chunk roots
+	SortAndSplit( 0, instCount - 1, 0 );
+	// the nodes a chunk moves go after all leaves, from the chunk's own offset
+	uint root[16];
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < 16; i++) root[i] = Cluster( *tree[i], treeSize[i], tree[i]->offset + instCount );
+	// join the chunk roots by brute force: A and B merge when each is the other's best match
+	for (int i = 0; i < 16; i++) nodeIdx[i] = root[i];
+	int nodeIndices = 16, next = 1;
+	int A = 0, B = FindBestMatch( nodeIndices, A );
+	while (nodeIndices > 1)
 	{
-		nodeIdx[i] = nodesUsed;
-		tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
-		tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
-		tlasNode[nodesUsed].BLAS = i;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		int C = FindBestMatch( nodeIndices, B );
+		if (A == C)
+		{
+			const uint parent = nodeIndices == 2 ? 0 : next++; // the last one is the root
+			CreateParent( parent, nodeIdx[A], nodeIdx[B] );
+			nodeIdx[A] = parent;
+			nodeIdx[B] = nodeIdx[--nodeIndices];
+			if (A == nodeIndices) A = B;
+			if (nodeIndices > 1) B = FindBestMatch( nodeIndices, A );
+		}
+		else A = B, B = C;
 	}
-	// use agglomerative clustering to build the TLAS
-	int nodeIndices = blasCount;
-	int A = 0, B = FindBestMatch( nodeIndices, A );
-	// copy last remaining node to the root node
-	tlasNode[0] = tlasNode[nodeIdx[A]];
+	nodesUsed = 32 + 2 * instCount;
+}
+
+uint TLAS::Cluster( KDTree& kd, const uint count, uint out )
+{
+	// cluster one chunk, in rounds: every active node finds its nearest neighbour,
+	// and all mutual nearest pairs merge. A parent takes the slot of its first
+	// child, which moves to 'out', so the nodes keep their kD-tree indices.
+	const uint first = kd.offset - 32;
+	uint* A = clusterIdx + first, * B = clusterB + first, * match = clusterMatch + first;
+	float* SA = clusterSA + first;
+	auto Join = [&]( const uint a, const uint b ) { tlasNode[out] = tlasNode[a]; CreateParent( a, out++, b ); };
+	kd.rebuild();
+	uint active = count;
+	for (uint i = 0; i < count; i++) A[i] = kd.offset + i;
+	while (active > 2)
+	{
+		kd.FindNearest( A, active, B, SA, false ); // this thread only: the chunks run in parallel
+		for (uint i = 0; i < active; i++) match[A[i] - kd.offset] = B[i];
+		// commit all merges of this round; the refit waits until the end
+		uint kept = 0;
+		for (uint i = 0; i < active; i++)
+		{
+			const uint a = A[i], b = B[i];
+			if (match[b - kd.offset] == a)
+			{
+				if (b < a) continue; // merged into b
+				Join( a, b );
+				kd.removeLeaf( a ), kd.removeLeaf( b ), kd.add( a, false );
+			}
+			A[kept++] = a;
+		}
+		if (kept == active)
+		{
+			// no mutual pairs, which ties can cause: merge the first node with its neighbour
+			const uint a = A[0], b = B[0];
+			Join( a, b );
+			kd.removeLeaf( a ), kd.removeLeaf( b ), kd.add( a, false );
+			for (uint i = 1; i < kept; i++) if (A[i] == b) { A[i] = A[--kept]; break; }
+		}
+		kd.batchRefit();
+		active = kept;
+	}
+	if (active == 2) Join( A[0], A[1] );
+	return A[0];
 }
 
 void TLAS::SortAndSplit( uint first, uint last, uint level )
 {
-	if (!item) item = new SortItem[blasCount];
+	if (!item) item = buildArena->Alloc<SortItem>( blasCount );
 	uint axis = level % 3; // TODO: use dominant axis at each level?
 	if (level == 0)
 	{
-		for (uint i = 0; i < blasCount; i++) item[i].blasIdx = i;
+		for (uint i = 0; i < instCount; i++) item[i].blasIdx = instList[i];
 		treeIdx = 0;
 	}
 	for (uint idx, i = first; i <= last; i++)
 		idx = item[i].blasIdx,
-		item[i].pos = (blas[idx].bounds.bmin[axis] + blas[idx].bounds.bmin[axis]) * 0.5f;
+		item[i].pos = (blas[idx].bounds.bmin[axis] + blas[idx].bounds.bmax[axis]) * 0.5f;
 	QuickSort( item, first, last );
 	uint half = (first + last) >> 1;
 	if (level < 3)
@@ -513,7 +757,7 @@ void TLAS::SortAndSplit( uint first, uint last, uint level )
 		tlasNode[nodesUsed].BLAS = item[i].blasIdx;
 		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
 	}
-	if (!tree[treeIdx]) tree[treeIdx] = new KDTree( tlasNode + first + 32, half - first + 1, first + 32 );
+	SetTree( first + 32, half - first + 1 );
 	treeSize[treeIdx++] = half - first + 1;
 	for (uint i = half + 1; i <= last; i++)
 	{
@@ -523,10 +767,19 @@ void TLAS::SortAndSplit( uint first, uint last, uint level )
 		tlasNode[nodesUsed].BLAS = item[i].blasIdx;
 		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
 	}
-	if (!tree[treeIdx]) tree[treeIdx] = new KDTree( tlasNode + half + 33, last - half, half + 33 );
+	SetTree( half + 33, last - half );
 	treeSize[treeIdx++] = last - half;
 }
 
+void TLAS::SetTree( uint first, uint count )
+{
+	// the chunks change size with instCount, and the nodes may move: the trees
+	// are claimed once, with room for the largest chunk, and reset every build
+	KDTree*& kd = tree[treeIdx];
+	if (kd) kd->reset( tlasNode + first, count, first );
+	else kd = new (buildArena->Alloc<KDTree>( 1 )) KDTree( tlasNode + first, count, first, buildArena, (blasCount + 15) / 16 );
+}
+
 void TLAS::CreateParent( uint idx, uint left, uint right )
 {
 	tlasNode[idx].left = left, tlasNode[idx].right = right;
@@ -559,47 +812,116 @@ void TLAS::QuickSort( SortItem a[], int first, int last )
 void TLAS::BuildQuick()
 {
 	// building the TLAS top-down, fastest option for the Boids demo
-	static Mesh m;
-	if (!m.tri) m = Mesh( blasCount );
-	for (uint i = 0; i < blasCount; i++)
+	// temporary mesh and BVH live in the frame arena; no heap traffic per frame
+	if (instCount == 0)
 	{
-		m.tri[i].vertex0 = blas[i].bounds.bmin;
-		m.tri[i].vertex1 = blas[i].bounds.bmax;
-		m.tri[i].vertex2 = (blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f; // degenerate but with the correct aabb
+		// everything was baked by Flatten: an empty leaf as the root, so the
+		// node array still describes a valid (empty) tree
+		tlasNode[0].aabbMin = float3( 1e30f ), tlasNode[0].aabbMax = float3( -1e30f );
+		tlasNode[0].leftRight = 0, tlasNode[0].BLAS = 0;
+		nodesUsed = 1;
+		return;
 	}
-	if (!m.bvh)
+	frameArena->Reset();
+	Mesh m( instCount, frameArena );
+	for (uint i = 0; i < instCount; i++)
 	{
-		m.bvh = new BVH( &m );
-		m.bvh->subdivToOnePrim = true;
+		const aabb& b = blas[instList[i]].bounds;
+		m.tri[i].vertex0 = b.bmin;
+		m.tri[i].vertex1 = b.bmax;
+		m.tri[i].vertex2 = (b.bmin + b.bmax) * 0.5f; // degenerate but with the correct aabb
 	}
-	m.bvh->Build();
+	BVH bvh( &m, frameArena, true );
 	// copy the BVH to a TLAS
-	memcpy( tlasNode, m.bvh->bvhNode, m.bvh->nodesUsed * sizeof( BVHNode ) );
-	for (uint i = 0; i < m.bvh->nodesUsed; i++) if (i != 1)
+	memcpy( tlasNode, bvh.bvhNode, bvh.nodesUsed * sizeof( BVHNode ) );
+	nodesUsed = bvh.nodesUsed;
+	for (uint i = 0; i < bvh.nodesUsed; i++) if (i != 1)
 	{
-		const BVHNode& n = m.bvh->bvhNode[i];
+		const BVHNode& n = bvh.bvhNode[i];
 		if (n.isLeaf())
-			tlasNode[i].BLAS = m.bvh->triIdx[n.leftFirst],
+			tlasNode[i].BLAS = instList[bvh.triIdx[n.leftFirst]],
 			tlasNode[i].leftRight = 0; // mark as leaf
 		else
 			tlasNode[i].leftRight = n.leftFirst + ((n.leftFirst + 1) << 16);
 	}
 }
 
+static bool Bake( BVHInstance& b, const uint maxTriCount )
+{
+	return b.isStatic && (uint)b.GetBLAS()->mesh->triCount <= maxTriCount;
+}
+
+void TLAS::Flatten( uint maxTriCount )
+{
+	// bake the static instances with at most maxTriCount triangles into a single
+	// world-space BVH; the rest stays in the TLAS, so dynamic or large instances
+	// keep the two-level path (hybrid mode). Baked transforms must not change.
+	uint flatTris = 0, flatCount = 0;
+	instCount = 0;
+	for (uint i = 0; i < blasCount; i++)
+		if (Bake( blas[i], maxTriCount )) flatTris += blas[i].GetBLAS()->mesh->triCount, flatCount++;
+		else instList[instCount++] = i;
+	if (flatTris == 0) return;
+	// hits in the baked BVH report the flat triangle index; flatInstPrim maps it
+	// back to the usual encoding: instance index in the upper 12 bits, primitive in the lower 20
+	FATALERROR_IF( blasCount > 4096, "Flatten: %i instances; instPrim holds 4096.", blasCount );
+	flatMesh = new Mesh( flatTris );
+	_aligned_free( flatMesh->triEx ), flatMesh->triEx = 0; // shading uses the original meshes
+	flatInstPrim = new uint[flatTris];
+	// world-space triangles; flatInstPrim translates hits back to the original instance and primitive
+	for (uint i = 0, k = 0; i < blasCount; i++) if (Bake( blas[i], maxTriCount ))
+	{
+		const Mesh* m = blas[i].GetBLAS()->mesh;
+		const mat4& T = blas[i].GetTransform();
+		FATALERROR_IF( m->triCount > 0x100000, "Flatten: %i triangles in one mesh; instPrim holds 2^20.", m->triCount );
+		for (int j = 0; j < m->triCount; j++, k++)
+		{
+			flatMesh->tri[k].vertex0 = TransformPosition( m->tri[j].vertex0, T );
+			flatMesh->tri[k].vertex1 = TransformPosition( m->tri[j].vertex1, T );
+			flatMesh->tri[k].vertex2 = TransformPosition( m->tri[j].vertex2, T );
+			flatInstPrim[k] = (blas[i].GetIndex() << 20) + j;
+		}
+	}
+	flatBVH = new BVH( flatMesh );
+	flatMesh->bvh = flatBVH;
+	BuildQuick();
+	// memory: the baked BVH stores every instance's triangles, the two-level path
+	// stores each BLAS once plus an instance and two TLAS nodes per instance
+	size_t flatBytes = flatBVH->Bytes() + flatTris * sizeof( uint ), instancedBytes = 0;
+	vector<BVH*> unique;
+	for (uint i = 0; i < blasCount; i++) if (Bake( blas[i], maxTriCount ))
+	{
+		BVH* b = blas[i].GetBLAS();
+		if (find( unique.begin(), unique.end(), b ) == unique.end()) unique.push_back( b ), instancedBytes += b->Bytes();
+		instancedBytes += sizeof( BVHInstance ) + 2 * sizeof( TLASNode );
+	}
+	printf( "flattened %i of %i instances (%i triangles, %i nodes): %.2fMB single-level, %.2fMB two-level\n",
+		flatCount, blasCount, flatTris, flatBVH->nodesUsed, flatBytes / 1048576.0f, instancedBytes / 1048576.0f );
+}
+
 void TLAS::Intersect( Ray& ray, RayCounter* counter )
 {
 	// calculate reciprocal ray directions for faster AABB intersection
 	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	// baked static instances first; a hit there shortens the TLAS traversal
+	if (flatBVH)
+	{
+		const float t = ray.hit.t;
+		flatBVH->Intersect( ray, 0, counter );
+		if (ray.hit.t < t) ray.hit.instPrim = flatInstPrim[ray.hit.instPrim];
+		if (instCount == 0) return;
+	}
 	// use a local stack instead of a recursive function
 	TLASNode* node = &tlasNode[0], * stack[64];
 	uint stackPtr = 0;
+	InstanceRayCache cache; // instance-space direction, shared by similar instances
 	// traversl loop; terminates when the stack is empty
 	while (1)
 	{
 		if (node->isLeaf())
 		{
 			// current node is a leaf: intersect BLAS
-			blas[node->BLAS].Intersect( ray, counter );
+			blas[node->BLAS].Intersect( ray, counter, cache );
 #ifdef TRACK
 			counter->incrementTraversals();
 #endif
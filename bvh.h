@@ -5,9 +5,18 @@
 
 #define TRACK
 
+// intersect leaf triangles in SoA blocks, using the widest SIMD the CPU has
+#define USE_TRIBLOCKS
+
 // bin count for binned BVH building
 #define BINS 8
 
+// triangles per SoA leaf block
+#define BLOCKSIZE 8
+
+// linear allocator for build data
+#include "arena.h"
+
 namespace Tmpl8
 {
 
@@ -21,6 +30,15 @@ __declspec(align(64)) struct Tri
 	union { float3 centroid; __m128 centroid4; }; // total size: 64 bytes
 };
 
+// leaf triangles in SoA layout, so a SIMD kernel can test a full block at once
+__declspec(align(64)) struct TriBlock
+{
+	float v0x[BLOCKSIZE], v0y[BLOCKSIZE], v0z[BLOCKSIZE];
+	float e1x[BLOCKSIZE], e1y[BLOCKSIZE], e1z[BLOCKSIZE]; // edge1 = vertex1 - vertex0
+	float e2x[BLOCKSIZE], e2y[BLOCKSIZE], e2z[BLOCKSIZE]; // edge2 = vertex2 - vertex0
+	uint primIdx[BLOCKSIZE]; // total size: 320 bytes; unused lanes have zero edges
+};
+
 // additional triangle data, for texturing and shading
 struct TriEx { float2 uv0, uv1, uv2; float3 N0, N1, N2; };
 
@@ -114,22 +132,28 @@ __declspec(align(64)) class BVH
 	};
 public:
 	BVH() = default;
-	BVH( class Mesh* mesh );
+	BVH( class Mesh* mesh, Arena* arena = 0, bool onePrimLeaves = false, bool build = true );
 	void Build();
 	void Refit();
 	void Intersect( Ray& ray, uint instanceIdx, RayCounter* counter );
+	void PackLeaves();
+	size_t Bytes() const;
 private:
 	void Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax );
 	void UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax );
 	float FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax );
-	class Mesh* mesh = 0;
 public:
+	class Mesh* mesh = 0;
 	uint* triIdx = 0;
 	uint nodesUsed;
 	BVHNode* bvhNode = 0;
 	bool subdivToOnePrim = false; // for TLAS experiment
 	BuildJob buildStack[64];
 	int buildStackPtr;
+	// SoA copy of the leaf triangles; leafBlock holds the first block for each leaf node
+	TriBlock* triBlock = 0;
+	uint* leafBlock = 0;
+	uint blocksUsed = 0, blockCapacity = 0;
 };
 
 // minimalist mesh class
@@ -137,16 +161,27 @@ class Mesh
 {
 public:
 	Mesh() = default;
-	Mesh( uint primCount );
+	Mesh( uint primCount, Arena* arena = 0 );
 	Mesh( const char* objFile, const char* texFile, const float scale = 1 );
 	Tri* tri = 0;			// triangle data for intersection
 	TriEx* triEx = 0;		// triangle data for shading
 	int triCount = 0;
 	BVH* bvh = 0;
 	Surface* texture = 0;
+	class MipTexture* mipTexture = 0; // the same texture, mipmapped and tiled
 	float3* P = 0, * N = 0;
 };
 
+// instance-space ray of the last instance visited during a TLAS traversal.
+// Direction and reciprocal direction only depend on the linear part of the
+// inverse transform, so instances that share rotation and scale reuse them.
+struct InstanceRayCache
+{
+	__m128 col[3];		// linear part of the inverse transform, as columns
+	__m128 D4, rD4;		// instance-space direction and reciprocal direction
+	bool valid = false;
+};
+
 // instance of a BVH, with transform and world bounds
 class BVHInstance
 {
@@ -155,7 +190,11 @@ public:
 	BVHInstance( BVH* blas, uint index ) : bvh( blas ), idx( index ) { SetTransform( mat4() ); }
 	void SetTransform( mat4& transform );
 	mat4& GetTransform() { return transform; }
+	mat4& GetInverseTransform() { return invTransform; }
 	void Intersect( Ray& ray, RayCounter* counter );
+	void Intersect( Ray& ray, RayCounter* counter, InstanceRayCache& cache );
+	BVH* GetBLAS() { return bvh; }
+	uint GetIndex() { return idx; }
 private:
 	mat4 transform;
 	mat4 invTransform; // inverse transform
@@ -164,7 +203,11 @@ public:
 private:
 	BVH* bvh = 0;
 	uint idx;
-	int dummy[7];
+public:
+	bool isStatic = false; // transform is fixed; allows baking into a single-level BVH
+private:
+	int dummy[6];
+	__m128 invCol[4]; // affine inverse transform as SIMD columns; total size: 256 bytes
 };
 
 // top-level BVH node
@@ -195,20 +238,29 @@ __declspec(align(64)) class TLAS
 public:
 	TLAS() = default;
 	TLAS( BVHInstance* bvhList, int N );
+	~TLAS();
+	// a TLAS owns its nodes and build memory: it can be moved, not copied
+	TLAS( const TLAS& ) = delete;
+	TLAS& operator=( const TLAS& ) = delete;
+	TLAS( TLAS&& t ) noexcept { *this = std::move( t ); }
+	TLAS& operator=( TLAS&& t ) noexcept;
 	void Build();
 	void Intersect( Ray& ray, RayCounter* counter );
 private:
 	int FindBestMatch( int N, int A );
 public:
 	TLASNode* tlasNode = 0;
+	bool ownNodes = true;	// false if tlasNode points into a mapped scene archive
 	BVHInstance* blas = 0;
-	uint nodesUsed, blasCount;
+	uint nodesUsed = 0, blasCount = 0;
 	uint* nodeIdx = 0;
 	// fast agglomerative clustering functionality
 	struct SortItem { float pos; uint blasIdx; };
 	void BuildQuick();
 	void SortAndSplit( uint first, uint last, uint level );
+	void SetTree( uint first, uint count );
 	void CreateParent( uint idx, uint left, uint right );
+	uint Cluster( KDTree& kd, const uint count, uint out );
 	static void Swap( SortItem& a, SortItem& b ) { SortItem t = a; a = b; b = t; }
 	void QuickSort( SortItem a[], int first, int last );
 	// data for fast agglomerative clustering
@@ -216,8 +268,43 @@ public:
 	uint treeSize[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 	SortItem* item = 0;
 	uint treeIdx = 0;
+	// per instance, in chunk ranges: active nodes, nearest neighbours and their areas
+	uint* clusterIdx = 0, * clusterB = 0, * clusterMatch = 0;
+	float* clusterSA = 0;
+	// build memory: kD-trees and sort items persist, BuildQuick data lives for one frame
+	Arena* buildArena = 0, * frameArena = 0;
+	// single-level mode: static instances baked into one world-space BVH
+	void Flatten( uint maxTriCount = 0xffffffff );
+	uint* instList = 0;		// instances that remain in the TLAS
+	uint instCount = 0;
+	Mesh* flatMesh = 0;
+	BVH* flatBVH = 0;
+	uint* flatInstPrim = 0;	// instance and primitive index of each baked triangle
 };
 
+// BVH quality metrics, to compare builders without rendering; see bvhstats.cpp
+struct BVHStats
+{
+	float sah = 0;			// SAH cost relative to the root, traversal and intersection cost 1
+	float epo = 0;			// end-point overlap (Aila et al., 2013), same cost model
+	uint nodes = 0, leaves = 0, maxDepth = 0;
+	uint leafSize[33] = {};	// leaves per primitive count; the last bin holds 32 and up
+	uint depth[65] = {};	// leaves per depth
+	size_t bytes = 0;		// memory claimed by the structure
+	void Print( const char* name );
+	void AppendCSV( const char* file, const char* name );
+};
+BVHStats Analyze( BVH& bvh );
+BVHStats Analyze( TLAS& tlas );
+
+// nearest neighbour queries of the kD-tree on 1k to 64k nodes; see bvh.cpp
+void BenchmarkKDTree();
+// TLAS::BuildQuick versus the clustering build, on random instance boxes
+void BenchmarkTLAS( uint N );
+
 } // namespace Tmpl8
 
+// BVH kernels for several instruction set levels, selected at startup
+#include "isa.h"
+
 // EOF
\ No newline at end of file
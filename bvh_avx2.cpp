@@ -0,0 +1,12 @@
+#include "precomp.h"
+#include "bvh.h"
+
+// BVH kernels for AVX2 + FMA; compiled with /arch:AVX2.
+// See bvh_isa.h; the level is selected at startup in bvh.cpp.
+#define ISA_LEVEL		ISA_AVX2
+#define ISA_NAMESPACE	isa_avx2
+#define ISA_TABLE		isaAVX2
+#define ISA_TITLE		"AVX2"
+#include "bvh_isa.h"
+
+// EOF
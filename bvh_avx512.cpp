@@ -0,0 +1,12 @@
+#include "precomp.h"
+#include "bvh.h"
+
+// BVH kernels for AVX-512 F/CD/BW/DQ/VL; compiled with /arch:AVX512.
+// See bvh_isa.h; the level is selected at startup in bvh.cpp.
+#define ISA_LEVEL		ISA_AVX512
+#define ISA_NAMESPACE	isa_avx512
+#define ISA_TABLE		isaAVX512
+#define ISA_TITLE		"AVX-512"
+#include "bvh_isa.h"
+
+// EOF
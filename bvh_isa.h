@@ -0,0 +1,555 @@
+// BVH kernels, compiled once per instruction set level. A source file that
+// includes this defines ISA_LEVEL, ISA_NAMESPACE, ISA_TABLE and ISA_TITLE,
+// and is compiled with the matching /arch setting (see bvh_avx2.cpp).
+// The code below sticks to intrinsics and plain float math: the linker keeps
+// a single copy of every inline function, so calling the float3 helpers from
+// precomp.h here could leak AVX-512 code into the SSE2 path (or vice versa).
+// Everything defined here sits in an unnamed namespace, so each ISA source
+// file keeps its own copy; only the kernel table at the end is shared.
+
+namespace ISA_NAMESPACE
+{
+namespace
+{
+
+// helpers
+
+static inline float HalfArea( const __m128 e )
+{
+	// e.x * e.y + e.y * e.z + e.z * e.x, using the x, y and z lanes of e
+	const int yzxShuffle = 9;
+#if ISA_LEVEL >= ISA_SSE41
+	return _mm_cvtss_f32( _mm_dp_ps( e, _mm_shuffle_ps( e, e, yzxShuffle ), 0x7f ) );
+#else
+	const __m128 p = _mm_mul_ps( e, _mm_shuffle_ps( e, e, yzxShuffle ) );
+	return _mm_cvtss_f32( _mm_add_ss( p, _mm_add_ss( _mm_shuffle_ps( p, p, 1 ), _mm_shuffle_ps( p, p, 2 ) ) ) );
+#endif
+}
+
+static inline __m128 BlendXYZ( const __m128 w4, const __m128 xyz4 )
+{
+	// x, y and z from xyz4, w from w4
+	const __m128 mask4 = _mm_castsi128_ps( _mm_setr_epi32( -1, -1, -1, 0 ) );
+#if ISA_LEVEL >= ISA_SSE41
+	return _mm_blendv_ps( w4, xyz4, mask4 );
+#else
+	return _mm_or_ps( _mm_and_ps( mask4, xyz4 ), _mm_andnot_ps( mask4, w4 ) );
+#endif
+}
+
+static inline float IntersectAABB_SSE( const Ray& ray, const __m128 bmin4, const __m128 bmax4 )
+{
+	// "slab test" ray/AABB intersection, using SIMD instructions
+	const __m128 mask4 = _mm_castsi128_ps( _mm_setr_epi32( -1, -1, -1, 0 ) );
+	const __m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmin4, mask4 ), ray.O4 ), ray.rD4 );
+	const __m128 t2 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmax4, mask4 ), ray.O4 ), ray.rD4 );
+	const __m128 vmax4 = _mm_max_ps( t1, t2 ), vmin4 = _mm_min_ps( t1, t2 );
+	// reduce x, y and z without leaving the SIMD registers
+	const float tmax = _mm_cvtss_f32( _mm_min_ss( vmax4, _mm_min_ss( _mm_shuffle_ps( vmax4, vmax4, 1 ), _mm_shuffle_ps( vmax4, vmax4, 2 ) ) ) );
+	const float tmin = _mm_cvtss_f32( _mm_max_ss( vmin4, _mm_max_ss( _mm_shuffle_ps( vmin4, vmin4, 1 ), _mm_shuffle_ps( vmin4, vmin4, 2 ) ) ) );
+	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
+}
+
+static inline void IntersectTri( Ray& ray, const Tri& tri, const uint instPrim )
+{
+	// Moeller-Trumbore, as in bvh.cpp, written out per component
+	const float e1x = tri.vertex1.x - tri.vertex0.x, e1y = tri.vertex1.y - tri.vertex0.y, e1z = tri.vertex1.z - tri.vertex0.z;
+	const float e2x = tri.vertex2.x - tri.vertex0.x, e2y = tri.vertex2.y - tri.vertex0.y, e2z = tri.vertex2.z - tri.vertex0.z;
+	const float hx = ray.D.y * e2z - ray.D.z * e2y, hy = ray.D.z * e2x - ray.D.x * e2z, hz = ray.D.x * e2y - ray.D.y * e2x;
+	const float a = e1x * hx + e1y * hy + e1z * hz;
+	if (a > -0.00001f && a < 0.00001f) return; // ray parallel to triangle
+	const float f = 1 / a;
+	const float sx = ray.O.x - tri.vertex0.x, sy = ray.O.y - tri.vertex0.y, sz = ray.O.z - tri.vertex0.z;
+	const float u = f * (sx * hx + sy * hy + sz * hz);
+	if (u < 0 || u > 1) return;
+	const float qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+	const float v = f * (ray.D.x * qx + ray.D.y * qy + ray.D.z * qz);
+	if (v < 0 || u + v > 1) return;
+	const float t = f * (e2x * qx + e2y * qy + e2z * qz);
+	if (t > 0.0001f && t < ray.hit.t)
+		ray.hit.t = t, ray.hit.u = u,
+		ray.hit.v = v, ray.hit.instPrim = instPrim;
+}
+
+// SIMD leaf block intersection: the same Moeller-Trumbore test as above,
+// on every lane of a TriBlock at once.
+
+static inline void StoreNearest( Ray& ray, int mask, const float* t, const float* u, const float* v,
+	const uint* primLo, const uint* primHi, const uint instBits )
+{
+	// lanes 0..7 come from primLo, lanes 8..15 (AVX-512 only) from primHi
+	for (int i = 0; mask; i++, mask >>= 1) if ((mask & 1) && t[i] < ray.hit.t)
+		ray.hit.t = t[i], ray.hit.u = u[i], ray.hit.v = v[i],
+		ray.hit.instPrim = instBits + (i < BLOCKSIZE ? primLo[i] : primHi[i - BLOCKSIZE]);
+}
+
+#if ISA_LEVEL >= ISA_AVX512
+
+static void IntersectTriBlocks( Ray& ray, const TriBlock* block, const uint blockCount, const uint instBits )
+{
+	// 16 lanes: two consecutive blocks per iteration; an odd tail is paired with an empty block
+	static const TriBlock emptyBlock = {};
+	const __m512 Ox = _mm512_set1_ps( ray.O.x ), Oy = _mm512_set1_ps( ray.O.y ), Oz = _mm512_set1_ps( ray.O.z );
+	const __m512 Dx = _mm512_set1_ps( ray.D.x ), Dy = _mm512_set1_ps( ray.D.y ), Dz = _mm512_set1_ps( ray.D.z );
+	const __m512 eps16 = _mm512_set1_ps( 0.00001f ), tmin16 = _mm512_set1_ps( 0.0001f );
+	const __m512 zero16 = _mm512_setzero_ps(), one16 = _mm512_set1_ps( 1 );
+	__declspec(align(64)) float t[16], u[16], v[16];
+	for (uint b = 0; b < blockCount; b += 2)
+	{
+		const TriBlock& lo = block[b], & hi = b + 1 < blockCount ? block[b + 1] : emptyBlock;
+	#define LOAD16( f ) _mm512_castpd_ps( _mm512_insertf64x4( _mm512_castps_pd( _mm512_castps256_ps512( \
+		_mm256_load_ps( lo.f ) ) ), _mm256_castps_pd( _mm256_load_ps( hi.f ) ), 1 ) )
+		const __m512 e1x = LOAD16( e1x ), e1y = LOAD16( e1y ), e1z = LOAD16( e1z );
+		const __m512 e2x = LOAD16( e2x ), e2y = LOAD16( e2y ), e2z = LOAD16( e2z );
+		const __m512 hx = _mm512_sub_ps( _mm512_mul_ps( Dy, e2z ), _mm512_mul_ps( Dz, e2y ) );
+		const __m512 hy = _mm512_sub_ps( _mm512_mul_ps( Dz, e2x ), _mm512_mul_ps( Dx, e2z ) );
+		const __m512 hz = _mm512_sub_ps( _mm512_mul_ps( Dx, e2y ), _mm512_mul_ps( Dy, e2x ) );
+		const __m512 a = _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( e1x, hx ), _mm512_mul_ps( e1y, hy ) ), _mm512_mul_ps( e1z, hz ) );
+		const __m512 f = _mm512_div_ps( one16, a );
+		const __m512 sx = _mm512_sub_ps( Ox, LOAD16( v0x ) );
+		const __m512 sy = _mm512_sub_ps( Oy, LOAD16( v0y ) );
+		const __m512 sz = _mm512_sub_ps( Oz, LOAD16( v0z ) );
+	#undef LOAD16
+		const __m512 u16 = _mm512_mul_ps( f, _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( sx, hx ), _mm512_mul_ps( sy, hy ) ), _mm512_mul_ps( sz, hz ) ) );
+		const __m512 qx = _mm512_sub_ps( _mm512_mul_ps( sy, e1z ), _mm512_mul_ps( sz, e1y ) );
+		const __m512 qy = _mm512_sub_ps( _mm512_mul_ps( sz, e1x ), _mm512_mul_ps( sx, e1z ) );
+		const __m512 qz = _mm512_sub_ps( _mm512_mul_ps( sx, e1y ), _mm512_mul_ps( sy, e1x ) );
+		const __m512 v16 = _mm512_mul_ps( f, _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( Dx, qx ), _mm512_mul_ps( Dy, qy ) ), _mm512_mul_ps( Dz, qz ) ) );
+		const __m512 t16 = _mm512_mul_ps( f, _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( e2x, qx ), _mm512_mul_ps( e2y, qy ) ), _mm512_mul_ps( e2z, qz ) ) );
+		__mmask16 mask = _mm512_cmp_ps_mask( _mm512_abs_ps( a ), eps16, _CMP_GE_OQ );
+		mask &= _mm512_cmp_ps_mask( u16, zero16, _CMP_GE_OQ ) & _mm512_cmp_ps_mask( u16, one16, _CMP_LE_OQ );
+		mask &= _mm512_cmp_ps_mask( v16, zero16, _CMP_GE_OQ ) & _mm512_cmp_ps_mask( _mm512_add_ps( u16, v16 ), one16, _CMP_LE_OQ );
+		mask &= _mm512_cmp_ps_mask( t16, tmin16, _CMP_GT_OQ ) & _mm512_cmp_ps_mask( t16, _mm512_set1_ps( ray.hit.t ), _CMP_LT_OQ );
+		if (!mask) continue;
+		_mm512_store_ps( t, t16 ), _mm512_store_ps( u, u16 ), _mm512_store_ps( v, v16 );
+		StoreNearest( ray, mask, t, u, v, lo.primIdx, hi.primIdx, instBits );
+	}
+}
+
+#elif ISA_LEVEL >= ISA_AVX2
+
+static void IntersectTriBlocks( Ray& ray, const TriBlock* block, const uint blockCount, const uint instBits )
+{
+	const __m256 Ox = _mm256_set1_ps( ray.O.x ), Oy = _mm256_set1_ps( ray.O.y ), Oz = _mm256_set1_ps( ray.O.z );
+	const __m256 Dx = _mm256_set1_ps( ray.D.x ), Dy = _mm256_set1_ps( ray.D.y ), Dz = _mm256_set1_ps( ray.D.z );
+	const __m256 absMask8 = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ) );
+	const __m256 eps8 = _mm256_set1_ps( 0.00001f ), tmin8 = _mm256_set1_ps( 0.0001f );
+	const __m256 zero8 = _mm256_setzero_ps(), one8 = _mm256_set1_ps( 1 );
+	__declspec(align(32)) float t[8], u[8], v[8];
+	for (uint b = 0; b < blockCount; b++)
+	{
+		const TriBlock& tb = block[b];
+		const __m256 e1x = _mm256_load_ps( tb.e1x ), e1y = _mm256_load_ps( tb.e1y ), e1z = _mm256_load_ps( tb.e1z );
+		const __m256 e2x = _mm256_load_ps( tb.e2x ), e2y = _mm256_load_ps( tb.e2y ), e2z = _mm256_load_ps( tb.e2z );
+		const __m256 hx = _mm256_sub_ps( _mm256_mul_ps( Dy, e2z ), _mm256_mul_ps( Dz, e2y ) );
+		const __m256 hy = _mm256_sub_ps( _mm256_mul_ps( Dz, e2x ), _mm256_mul_ps( Dx, e2z ) );
+		const __m256 hz = _mm256_sub_ps( _mm256_mul_ps( Dx, e2y ), _mm256_mul_ps( Dy, e2x ) );
+		const __m256 a = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, hx ), _mm256_mul_ps( e1y, hy ) ), _mm256_mul_ps( e1z, hz ) );
+		const __m256 f = _mm256_div_ps( one8, a );
+		const __m256 sx = _mm256_sub_ps( Ox, _mm256_load_ps( tb.v0x ) );
+		const __m256 sy = _mm256_sub_ps( Oy, _mm256_load_ps( tb.v0y ) );
+		const __m256 sz = _mm256_sub_ps( Oz, _mm256_load_ps( tb.v0z ) );
+		const __m256 u8 = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, hx ), _mm256_mul_ps( sy, hy ) ), _mm256_mul_ps( sz, hz ) ) );
+		const __m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+		const __m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+		const __m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+		const __m256 v8 = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( Dx, qx ), _mm256_mul_ps( Dy, qy ) ), _mm256_mul_ps( Dz, qz ) ) );
+		const __m256 t8 = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ), _mm256_mul_ps( e2y, qy ) ), _mm256_mul_ps( e2z, qz ) ) );
+		__m256 mask = _mm256_cmp_ps( _mm256_and_ps( a, absMask8 ), eps8, _CMP_GE_OQ );
+		mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( u8, zero8, _CMP_GE_OQ ), _mm256_cmp_ps( u8, one8, _CMP_LE_OQ ) ) );
+		mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( v8, zero8, _CMP_GE_OQ ), _mm256_cmp_ps( _mm256_add_ps( u8, v8 ), one8, _CMP_LE_OQ ) ) );
+		mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( t8, tmin8, _CMP_GT_OQ ), _mm256_cmp_ps( t8, _mm256_set1_ps( ray.hit.t ), _CMP_LT_OQ ) ) );
+		const int hits = _mm256_movemask_ps( mask );
+		if (!hits) continue;
+		_mm256_store_ps( t, t8 ), _mm256_store_ps( u, u8 ), _mm256_store_ps( v, v8 );
+		StoreNearest( ray, hits, t, u, v, tb.primIdx, 0, instBits );
+	}
+}
+
+#else
+
+static void IntersectTriBlocks( Ray& ray, const TriBlock* block, const uint blockCount, const uint instBits )
+{
+	// 4 lanes: each block is processed in two halves
+	const __m128 Ox = _mm_set1_ps( ray.O.x ), Oy = _mm_set1_ps( ray.O.y ), Oz = _mm_set1_ps( ray.O.z );
+	const __m128 Dx = _mm_set1_ps( ray.D.x ), Dy = _mm_set1_ps( ray.D.y ), Dz = _mm_set1_ps( ray.D.z );
+	const __m128 absMask4 = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+	const __m128 eps4 = _mm_set1_ps( 0.00001f ), tmin4 = _mm_set1_ps( 0.0001f );
+	const __m128 zero4 = _mm_setzero_ps(), one4 = _mm_set1_ps( 1 );
+	__declspec(align(16)) float t[4], u[4], v[4];
+	for (uint b = 0; b < blockCount; b++) for (uint o = 0; o < BLOCKSIZE; o += 4)
+	{
+		const TriBlock& tb = block[b];
+		const __m128 e1x = _mm_load_ps( tb.e1x + o ), e1y = _mm_load_ps( tb.e1y + o ), e1z = _mm_load_ps( tb.e1z + o );
+		const __m128 e2x = _mm_load_ps( tb.e2x + o ), e2y = _mm_load_ps( tb.e2y + o ), e2z = _mm_load_ps( tb.e2z + o );
+		// h = cross( D, edge2 ), a = dot( edge1, h )
+		const __m128 hx = _mm_sub_ps( _mm_mul_ps( Dy, e2z ), _mm_mul_ps( Dz, e2y ) );
+		const __m128 hy = _mm_sub_ps( _mm_mul_ps( Dz, e2x ), _mm_mul_ps( Dx, e2z ) );
+		const __m128 hz = _mm_sub_ps( _mm_mul_ps( Dx, e2y ), _mm_mul_ps( Dy, e2x ) );
+		const __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+		const __m128 f = _mm_div_ps( one4, a );
+		// s = O - vertex0, u = f * dot( s, h )
+		const __m128 sx = _mm_sub_ps( Ox, _mm_load_ps( tb.v0x + o ) );
+		const __m128 sy = _mm_sub_ps( Oy, _mm_load_ps( tb.v0y + o ) );
+		const __m128 sz = _mm_sub_ps( Oz, _mm_load_ps( tb.v0z + o ) );
+		const __m128 u4 = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+		// q = cross( s, edge1 ), v = f * dot( D, q ), t = f * dot( edge2, q )
+		const __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+		const __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+		const __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+		const __m128 v4 = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( Dx, qx ), _mm_mul_ps( Dy, qy ) ), _mm_mul_ps( Dz, qz ) ) );
+		const __m128 t4 = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+		// combine all rejection tests in a single mask
+		__m128 mask = _mm_cmpge_ps( _mm_and_ps( a, absMask4 ), eps4 );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmple_ps( u4, one4 ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( v4, zero4 ), _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpgt_ps( t4, tmin4 ), _mm_cmplt_ps( t4, _mm_set1_ps( ray.hit.t ) ) ) );
+		const int hits = _mm_movemask_ps( mask );
+		if (!hits) continue;
+		_mm_store_ps( t, t4 ), _mm_store_ps( u, u4 ), _mm_store_ps( v, v4 );
+		StoreNearest( ray, hits, t, u, v, tb.primIdx + o, 0, instBits );
+	}
+}
+
+#endif
+
+// BVH traversal
+
+static void Intersect( BVH& bvh, Ray& ray, uint instanceIdx, RayCounter* counter )
+{
+	BVHNode* node = &bvh.bvhNode[0], * stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->triCount > 0) // isLeaf()
+		{
+		#ifdef USE_TRIBLOCKS
+			if (bvh.triBlock)
+			{
+				const uint blockCount = (node->triCount + BLOCKSIZE - 1) / BLOCKSIZE;
+				IntersectTriBlocks( ray, bvh.triBlock + bvh.leafBlock[node - bvh.bvhNode], blockCount, instanceIdx << 20 );
+			}
+			else
+		#endif
+			for (uint i = 0; i < node->triCount; i++)
+			{
+				// index the triangle directly: the baked BVH of Flatten may exceed 20 bits
+				const uint prim = bvh.triIdx[node->leftFirst + i];
+				IntersectTri( ray, bvh.mesh->tri[prim], (instanceIdx << 20) + prim );
+			}
+		#ifdef TRACK
+			counter->triangleTests += node->triCount;
+		#endif
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode* child1 = &bvh.bvhNode[node->leftFirst];
+		BVHNode* child2 = &bvh.bvhNode[node->leftFirst + 1];
+		float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
+		float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
+	#ifdef TRACK
+		counter->boxTests += 2;
+	#endif
+		if (dist1 > dist2)
+		{
+			float d = dist1; dist1 = dist2; dist2 = d;
+			BVHNode* c = child1; child1 = child2; child2 = c;
+		}
+		if (dist1 == 1e30f)
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+		}
+		else
+		{
+			node = child1;
+			if (dist2 != 1e30f) stack[stackPtr++] = child2;
+		}
+	}
+}
+
+// BVH construction
+
+static float FindBestSplitPlane( BVH& bvh, BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax )
+{
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++)
+	{
+		float boundsMin = centroidMin.cell[a], boundsMax = centroidMax.cell[a];
+		if (boundsMin == boundsMax) continue;
+		// populate the bins
+		float scale = BINS / (boundsMax - boundsMin);
+		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
+		int leftSum = 0, rightSum = 0;
+		__m128 min4[BINS], max4[BINS];
+		uint count[BINS];
+		for (uint i = 0; i < BINS; i++)
+			min4[i] = _mm_set_ps1( 1e30f ),
+			max4[i] = _mm_set_ps1( -1e30f ),
+			count[i] = 0;
+		for (uint i = 0; i < node.triCount; i++)
+		{
+			Tri& triangle = bvh.mesh->tri[bvh.triIdx[node.leftFirst + i]];
+			int binIdx = (int)((triangle.centroid.cell[a] - boundsMin) * scale);
+			if (binIdx > BINS - 1) binIdx = BINS - 1;
+			count[binIdx]++;
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v0 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v0 );
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v1 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v1 );
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v2 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v2 );
+		}
+		// gather data for the 7 planes between the 8 bins
+		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
+		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			leftSum += count[i];
+			rightSum += count[BINS - 1 - i];
+			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
+			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 2 - i] );
+			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
+			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 2 - i] );
+			leftCountArea[i] = leftSum * HalfArea( _mm_sub_ps( leftMax4, leftMin4 ) );
+			rightCountArea[BINS - 2 - i] = rightSum * HalfArea( _mm_sub_ps( rightMax4, rightMin4 ) );
+		}
+		// calculate SAH cost for the 7 planes
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			const float planeCost = leftCountArea[i] + rightCountArea[i];
+			if (planeCost < bestCost)
+				axis = a, splitPos = i + 1, bestCost = planeCost;
+		}
+	}
+	return bestCost;
+}
+
+static void UpdateNodeBounds( BVH& bvh, uint nodeIdx, float3& centroidMin, float3& centroidMax )
+{
+	BVHNode& node = bvh.bvhNode[nodeIdx];
+	__m128 min4 = _mm_set_ps1( 1e30f ), max4 = _mm_set_ps1( -1e30f );
+	__m128 cmin4 = _mm_set_ps1( 1e30f ), cmax4 = _mm_set_ps1( -1e30f );
+	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	{
+		Tri& leafTri = bvh.mesh->tri[bvh.triIdx[first + i]];
+		min4 = _mm_min_ps( min4, leafTri.v0 ), max4 = _mm_max_ps( max4, leafTri.v0 );
+		min4 = _mm_min_ps( min4, leafTri.v1 ), max4 = _mm_max_ps( max4, leafTri.v1 );
+		min4 = _mm_min_ps( min4, leafTri.v2 ), max4 = _mm_max_ps( max4, leafTri.v2 );
+		cmin4 = _mm_min_ps( cmin4, leafTri.centroid4 );
+		cmax4 = _mm_max_ps( cmax4, leafTri.centroid4 );
+	}
+	// keep leftFirst and triCount, which live in the w lanes
+	node.aabbMin4 = BlendXYZ( node.aabbMin4, min4 );
+	node.aabbMax4 = BlendXYZ( node.aabbMax4, max4 );
+	__declspec(align(16)) float c[8];
+	_mm_store_ps( c, cmin4 ), _mm_store_ps( c + 4, cmax4 );
+	centroidMin.x = c[0], centroidMin.y = c[1], centroidMin.z = c[2];
+	centroidMax.x = c[4], centroidMax.y = c[5], centroidMax.z = c[6];
+}
+
+// kD-tree nearest neighbour search, for agglomerative TLAS clustering
+
+static int FindNearest( KDTree& tree, uint A, uint& startB, float& startSA )
+{
+	KDTree::KDNode* node = tree.node;
+	TLASNode* tlas = tree.tlas;
+	// keep all hot data together
+	A -= tree.offset;
+	__declspec(align(64)) struct TravState
+	{
+		__m128 Pa4, tlasAbmin4, tlasAbmax4;
+		uint n, stackPtr, bestB;
+		float smallestSA; // exactly one cacheline
+	} state;
+	uint stack[60];
+	uint& n = state.n, & stackPtr = state.stackPtr, & bestB = state.bestB;
+	float& smallestSA = state.smallestSA;
+	n = 0, stackPtr = 0, smallestSA = startSA, bestB = startB - tree.offset;
+	// gather data for node A
+	__m128& tlasAbmin4 = state.tlasAbmin4;
+	__m128& tlasAbmax4 = state.tlasAbmax4;
+	tlasAbmin4 = _mm_setr_ps( tlas[A].aabbMin.x, tlas[A].aabbMin.y, tlas[A].aabbMin.z, 0 );
+	tlasAbmax4 = _mm_setr_ps( tlas[A].aabbMax.x, tlas[A].aabbMax.y, tlas[A].aabbMax.z, 0 );
+	__m128& Pa4 = state.Pa4;
+	Pa4 = _mm_mul_ps( _mm_set_ps1( 0.5f ), _mm_add_ps( tlasAbmin4, tlasAbmax4 ) );
+	__declspec(align(16)) float Pa[4];
+	_mm_store_ps( Pa, Pa4 );
+	const __m128 half4 = _mm_set_ps1( 0.5f );
+	const __m128 extentA4 = _mm_sub_ps( tlasAbmax4, tlasAbmin4 );
+	const __m128 halfExtentA4 = _mm_mul_ps( half4, _mm_sub_ps( tlasAbmax4, tlasAbmin4 ) );
+	const __m128 xyzMask4 = _mm_castsi128_ps( _mm_setr_epi32( -1, -1, -1, 0 ) );
+	// walk the tree
+	while (1)
+	{
+		while (1)
+		{
+			if ((node[n].parax & 7) > 3) // isLeaf()
+			{
+				// loop over the BLASes stored in this leaf
+				for (uint i = 0; i < node[n].count; i++)
+				{
+					uint B = tree.tlasIdx[node[n].first + i];
+					if (B == A) continue;
+					// calculate surface area of union of A and B
+					const __m128 bbmin4 = _mm_and_ps( tlas[B].aabbMin4, xyzMask4 );
+					const __m128 bbmax4 = _mm_and_ps( tlas[B].aabbMax4, xyzMask4 );
+					const float SA = HalfArea( _mm_sub_ps( _mm_max_ps( tlasAbmax4, bbmax4 ), _mm_min_ps( tlasAbmin4, bbmin4 ) ) );
+					if (SA < smallestSA) smallestSA = SA, bestB = B;
+				}
+				break;
+			}
+			// consider recursing into branches, sorted by distance
+			uint t, nearNode = node[n].left, farNode = node[n].right;
+			if (Pa[node[n].parax & 7] > node[n].splitPos) t = nearNode, nearNode = farNode, farNode = t;
+			const __m128 v0a = _mm_max_ps( _mm_sub_ps( node[nearNode].bmin4, Pa4 ), _mm_sub_ps( Pa4, node[nearNode].bmax4 ) );
+			const __m128 v0b = _mm_max_ps( _mm_sub_ps( node[farNode].bmin4, Pa4 ), _mm_sub_ps( Pa4, node[farNode].bmax4 ) );
+			const __m128 d4a = _mm_max_ps( extentA4, _mm_sub_ps( v0a, _mm_add_ps( node[nearNode].minSize4, halfExtentA4 ) ) );
+			const __m128 d4b = _mm_max_ps( extentA4, _mm_sub_ps( v0b, _mm_add_ps( node[farNode].minSize4, halfExtentA4 ) ) );
+			const float sa1 = HalfArea( d4a ), sa2 = HalfArea( d4b );
+			const float diff1 = sa1 - smallestSA, diff2 = sa2 - smallestSA;
+			const uint visit = (diff1 < 0) * 2 + (diff2 < 0);
+			if (!visit) break;
+			if (visit == 3) stack[stackPtr++] = farNode, n = nearNode;
+			else if (visit == 2) n = nearNode; else n = farNode;
+		}
+		if (stackPtr == 0) break;
+		n = stack[--stackPtr];
+	}
+	// all done; return best match
+	startB = bestB + tree.offset;
+	startSA = smallestSA;
+	return bestB + tree.offset;
+}
+
+// batch search: four queries per traversal, one per SIMD lane. Bounds and
+// areas are kept as structures of arrays, so the surface areas of the node
+// tests and of the leaf unions take plain vertical math, for four queries at
+// once. A node is visited when it may hold a better match for any of them;
+// queries that are close together share most of their traversal.
+
+static inline __m128 HalfArea4( const __m128 ex, const __m128 ey, const __m128 ez )
+{
+	return _mm_add_ps( _mm_mul_ps( ex, ey ), _mm_add_ps( _mm_mul_ps( ey, ez ), _mm_mul_ps( ez, ex ) ) );
+}
+
+static inline __m128 Select( const __m128 mask4, const __m128 a4, const __m128 b4 )
+{
+	// a4 where mask4 is set, b4 elsewhere
+#if ISA_LEVEL >= ISA_SSE41
+	return _mm_blendv_ps( b4, a4, mask4 );
+#else
+	return _mm_or_ps( _mm_and_ps( mask4, a4 ), _mm_andnot_ps( mask4, b4 ) );
+#endif
+}
+
+static inline __m128 ChildArea4( const KDTree::KDNode& child, const __m128* Pa, const __m128* extentA, const __m128* halfExtentA )
+{
+	// the node test of FindNearest, per lane
+	const float* bmin = (const float*)&child.bmin4, * bmax = (const float*)&child.bmax4, * minSize = (const float*)&child.minSize4;
+	__m128 d[3];
+	for (int k = 0; k < 3; k++)
+	{
+		const __m128 v0 = _mm_max_ps( _mm_sub_ps( _mm_set1_ps( bmin[k] ), Pa[k] ), _mm_sub_ps( Pa[k], _mm_set1_ps( bmax[k] ) ) );
+		d[k] = _mm_max_ps( extentA[k], _mm_sub_ps( v0, _mm_add_ps( _mm_set1_ps( minSize[k] ), halfExtentA[k] ) ) );
+	}
+	return HalfArea4( d[0], d[1], d[2] );
+}
+
+static void FindNearest4( KDTree& tree, const uint* A, uint* bestB, float* bestSA )
+{
+	KDTree::KDNode* node = tree.node;
+	TLASNode* tlas = tree.tlas;
+	// bounds of the four A nodes, transposed: one register per axis
+	__declspec(align(16)) float bounds[6][4];
+	__declspec(align(16)) int a[4], best[4];
+	for (int l = 0; l < 4; l++)
+	{
+		const float* f = (const float*)&tlas[a[l] = A[l] - tree.offset]; // aabbMin in 0..2, aabbMax in 4..6
+		for (int k = 0; k < 3; k++) bounds[k][l] = f[k], bounds[3 + k][l] = f[4 + k];
+		best[l] = bestB[l] - tree.offset;
+	}
+	const __m128 half4 = _mm_set1_ps( 0.5f );
+	__m128 Amin[3], Amax[3], Pa[3], extentA[3], halfExtentA[3];
+	for (int k = 0; k < 3; k++)
+	{
+		Amin[k] = _mm_load_ps( bounds[k] ), Amax[k] = _mm_load_ps( bounds[3 + k] );
+		Pa[k] = _mm_mul_ps( half4, _mm_add_ps( Amin[k], Amax[k] ) );
+		extentA[k] = _mm_sub_ps( Amax[k], Amin[k] ), halfExtentA[k] = _mm_mul_ps( half4, extentA[k] );
+	}
+	const __m128i A4 = _mm_load_si128( (const __m128i*)a );
+	__m128i best4 = _mm_load_si128( (const __m128i*)best );
+	__m128 smallest4 = _mm_loadu_ps( bestSA );
+	uint stack[60], stackPtr = 0, n = 0;
+	while (1)
+	{
+		while (1)
+		{
+			const KDTree::KDNode& kn = node[n];
+			if ((kn.parax & 7) > 3) // isLeaf()
+			{
+				for (uint i = 0; i < kn.count; i++)
+				{
+					// surface area of the union of each A with B
+					const uint B = tree.tlasIdx[kn.first + i];
+					const float* b = (const float*)&tlas[B];
+					const __m128 ex = _mm_sub_ps( _mm_max_ps( Amax[0], _mm_set1_ps( b[4] ) ), _mm_min_ps( Amin[0], _mm_set1_ps( b[0] ) ) );
+					const __m128 ey = _mm_sub_ps( _mm_max_ps( Amax[1], _mm_set1_ps( b[5] ) ), _mm_min_ps( Amin[1], _mm_set1_ps( b[1] ) ) );
+					const __m128 ez = _mm_sub_ps( _mm_max_ps( Amax[2], _mm_set1_ps( b[6] ) ), _mm_min_ps( Amin[2], _mm_set1_ps( b[2] ) ) );
+					const __m128 SA = HalfArea4( ex, ey, ez );
+					const __m128i B4 = _mm_set1_epi32( (int)B );
+					const __m128 self4 = _mm_castsi128_ps( _mm_cmpeq_epi32( A4, B4 ) );
+					const __m128 better4 = _mm_andnot_ps( self4, _mm_cmplt_ps( SA, smallest4 ) );
+					smallest4 = Select( better4, SA, smallest4 );
+					best4 = _mm_castps_si128( Select( better4, _mm_castsi128_ps( B4 ), _mm_castsi128_ps( best4 ) ) );
+				}
+				break;
+			}
+			// near child first, for the side that most of the queries are on
+			uint t, nearNode = kn.left, farNode = kn.right;
+			const int right = _mm_movemask_ps( _mm_cmpgt_ps( Pa[kn.parax & 7], _mm_set1_ps( kn.splitPos ) ) );
+			if ((right & 1) + ((right >> 1) & 1) + ((right >> 2) & 1) + (right >> 3) > 2) t = nearNode, nearNode = farNode, farNode = t;
+			const bool visitNear = _mm_movemask_ps( _mm_cmplt_ps( ChildArea4( node[nearNode], Pa, extentA, halfExtentA ), smallest4 ) ) != 0;
+			const bool visitFar = _mm_movemask_ps( _mm_cmplt_ps( ChildArea4( node[farNode], Pa, extentA, halfExtentA ), smallest4 ) ) != 0;
+			if (visitNear && visitFar) stack[stackPtr++] = farNode, n = nearNode;
+			else if (visitNear) n = nearNode; else if (visitFar) n = farNode; else break;
+		}
+		if (stackPtr == 0) break;
+		n = stack[--stackPtr];
+	}
+	_mm_store_si128( (__m128i*)best, best4 );
+	_mm_storeu_ps( bestSA, smallest4 );
+	for (int l = 0; l < 4; l++) bestB[l] = best[l] + tree.offset;
+}
+
+static void FindNearestBatch( KDTree& tree, const uint* A, const uint count, uint* bestB, float* bestSA )
+{
+	// groups of four; a partial group repeats its last query in the spare lanes
+	for (uint i = 0; i < count; i += 4)
+	{
+		uint a[4], b[4];
+		float sa[4];
+		for (uint l = 0; l < 4; l++)
+		{
+			const uint j = i + l < count ? i + l : count - 1;
+			a[l] = A[j], b[l] = bestB[j], sa[l] = bestSA[j];
+		}
+		FindNearest4( tree, a, b, sa );
+		for (uint l = 0; l < 4 && i + l < count; l++) bestB[i + l] = b[l], bestSA[i + l] = sa[l];
+	}
+}
+
+} // unnamed namespace
+} // namespace ISA_NAMESPACE
+
+// kernel table for this instruction set level
+const ISAKernels Tmpl8::ISA_TABLE = {
+	ISA_TITLE,
+	ISA_NAMESPACE::Intersect,
+	ISA_NAMESPACE::IntersectTriBlocks,
+	ISA_NAMESPACE::FindBestSplitPlane,
+	ISA_NAMESPACE::UpdateNodeBounds,
+	ISA_NAMESPACE::FindNearest,
+	ISA_NAMESPACE::FindNearestBatch
+};
+
+// EOF
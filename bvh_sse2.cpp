@@ -0,0 +1,12 @@
+#include "precomp.h"
+#include "bvh.h"
+
+// BVH kernels for SSE2 (any x64 CPU); compiled with /arch:SSE2.
+// See bvh_isa.h; the level is selected at startup in bvh.cpp.
+#define ISA_LEVEL		ISA_SSE2
+#define ISA_NAMESPACE	isa_sse2
+#define ISA_TABLE		isaSSE2
+#define ISA_TITLE		"SSE2"
+#include "bvh_isa.h"
+
+// EOF
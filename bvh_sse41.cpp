@@ -0,0 +1,17 @@
+#include "precomp.h"
+#include "bvh.h"
+
+// BVH kernels for SSE4.1. MSVC has no /arch for this level: the file builds
+// with /arch:SSE2 and uses the SSE4.1 intrinsics directly; other compilers
+// get the level from the pragma below. SelectISA only picks this table on
+// CPUs that report SSE4.1. See bvh_isa.h; the level is selected in bvh.cpp.
+#if defined(__GNUC__)
+#pragma GCC target( "sse4.1" )
+#endif
+#define ISA_LEVEL		ISA_SSE41
+#define ISA_NAMESPACE	isa_sse41
+#define ISA_TABLE		isaSSE41
+#define ISA_TITLE		"SSE4.1"
+#include "bvh_isa.h"
+
+// EOF
@@ -0,0 +1,221 @@
+#include "precomp.h"
+#include "bvh.h"
+
+// BVH quality metrics. The SAH cost of a tree is the expected cost of a random
+// ray that hits the root: every node contributes its surface area relative to
+// the root, times 1 for an interior node or its primitive count for a leaf.
+// EPO (end-point overlap) weighs the same per-node costs with the surface area
+// of geometry that lies inside a node's box but belongs to another subtree;
+// it predicts ray tracing performance better than SAH alone. See:
+// Aila, Karras and Laine, "On Quality Metrics of Bounding Volume Hierarchies", 2013.
+
+static float HalfArea( const float3& bmin, const float3& bmax )
+{
+	const float3 e = bmax - bmin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+static bool Overlaps( const float3& amin, const float3& amax, const float3& bmin, const float3& bmax )
+{
+	return amin.x <= bmax.x && amax.x >= bmin.x && amin.y <= bmax.y && amax.y >= bmin.y && amin.z <= bmax.z && amax.z >= bmin.z;
+}
+
+static float ClippedArea( const Tri& tri, const float3& bmin, const float3& bmax )
+{
+	// Sutherland-Hodgman: clip the triangle against the six box planes, then
+	// measure the remaining polygon; three vertices plus one per plane at most
+	float3 poly[2][9] = { { tri.vertex0, tri.vertex1, tri.vertex2 } };
+	int n = 3, cur = 0;
+	for (int plane = 0; plane < 6; plane++)
+	{
+		const int axis = plane >> 1;
+		const float d = (plane & 1) ? bmax.cell[axis] : bmin.cell[axis];
+		const float side = (plane & 1) ? -1.0f : 1.0f; // positive: inside
+		const float3* in = poly[cur];
+		float3* out = poly[1 - cur];
+		int m = 0;
+		for (int i = 0; i < n; i++)
+		{
+			const float3& a = in[i], & b = in[(i + 1) % n];
+			const float da = (a.cell[axis] - d) * side, db = (b.cell[axis] - d) * side;
+			if (da >= 0) out[m++] = a;
+			if ((da >= 0) != (db >= 0)) out[m++] = a + (b - a) * (da / (da - db));
+		}
+		n = m, cur = 1 - cur;
+		if (n < 3) return 0;
+	}
+	float3 c( 0 );
+	for (int i = 1; i < n - 1; i++) c += cross( poly[cur][i] - poly[cur][0], poly[cur][i + 1] - poly[cur][0] );
+	return 0.5f * length( c );
+}
+
+BVHStats Tmpl8::Analyze( BVH& bvh )
+{
+	BVHStats stats;
+	stats.bytes = bvh.Bytes();
+	// walk the tree once: node counts, histograms, SAH, and the range of
+	// triIdx entries below each node, which is contiguous for this builder
+	const uint N = bvh.nodesUsed;
+	uint* first = new uint[N], * last = new uint[N], * order = new uint[N], * depth = new uint[N];
+	uint visited = 0;
+	vector<uint> stack = { 0 }; // no depth limit: a degenerate tree is what this is for
+	const float rootArea = HalfArea( bvh.bvhNode[0].aabbMin, bvh.bvhNode[0].aabbMax );
+	float sah = 0;
+	depth[0] = 0;
+	while (!stack.empty())
+	{
+		const uint idx = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvh.bvhNode[idx];
+		FATALERROR_IF( visited == N, "Analyze: more than %i nodes are reachable; the tree has a cycle.", N );
+		order[visited++] = idx;
+		const float rel = HalfArea( node.aabbMin, node.aabbMax ) / rootArea;
+		if (node.isLeaf())
+		{
+			sah += rel * node.triCount;
+			stats.leaves++;
+			stats.leafSize[min( node.triCount, 32u )]++;
+			stats.depth[min( depth[idx], 64u )]++;
+			stats.maxDepth = max( stats.maxDepth, depth[idx] );
+			first[idx] = node.leftFirst, last[idx] = node.leftFirst + node.triCount;
+		}
+		else
+		{
+			sah += rel;
+			FATALERROR_IF( node.leftFirst + 1 >= N, "Analyze: node %i has children %i and %i, but only %i nodes are in use.", idx, node.leftFirst, node.leftFirst + 1, N );
+			depth[node.leftFirst] = depth[node.leftFirst + 1] = depth[idx] + 1;
+			stack.push_back( node.leftFirst + 1 ), stack.push_back( node.leftFirst );
+		}
+	}
+	stats.nodes = visited, stats.sah = sah;
+	// children are visited after their parent, so a reverse pass completes the ranges
+	for (int i = visited - 1; i >= 0; i--)
+	{
+		const BVHNode& node = bvh.bvhNode[order[i]];
+		if (!node.isLeaf())
+			first[order[i]] = min( first[node.leftFirst], first[node.leftFirst + 1] ),
+			last[order[i]] = max( last[node.leftFirst], last[node.leftFirst + 1] );
+	}
+	// EPO: for each node, find the triangles of other subtrees that overlap its box
+	const Tri* tri = bvh.mesh->tri;
+	double totalArea = 0, epo = 0;
+	for (int i = 0; i < bvh.mesh->triCount; i++)
+		totalArea += 0.5f * length( cross( tri[i].vertex1 - tri[i].vertex0, tri[i].vertex2 - tri[i].vertex0 ) );
+#pragma omp parallel for schedule(dynamic) reduction(+:epo)
+	for (int i = 0; i < (int)visited; i++)
+	{
+		const BVHNode& node = bvh.bvhNode[order[i]];
+		const uint lo = first[order[i]], hi = last[order[i]];
+		vector<uint> todo = { 0 };
+		double overlap = 0;
+		while (!todo.empty())
+		{
+			const uint idx = todo.back();
+			todo.pop_back();
+			const BVHNode& other = bvh.bvhNode[idx];
+			if (first[idx] >= lo && last[idx] <= hi) continue; // the node itself or a descendant
+			if (!Overlaps( node.aabbMin, node.aabbMax, other.aabbMin, other.aabbMax )) continue;
+			if (!other.isLeaf()) { todo.push_back( other.leftFirst ), todo.push_back( other.leftFirst + 1 ); continue; }
+			for (uint j = other.leftFirst; j < other.leftFirst + other.triCount; j++)
+				if (j < lo || j >= hi) overlap += ClippedArea( tri[bvh.triIdx[j]], node.aabbMin, node.aabbMax );
+		}
+		epo += overlap * (node.isLeaf() ? node.triCount : 1);
+	}
+	stats.epo = totalArea > 0 ? (float)(epo / totalArea) : 0;
+	delete[] first, delete[] last, delete[] order, delete[] depth;
+	return stats;
+}
+
+BVHStats Tmpl8::Analyze( TLAS& tlas )
+{
+	// same metrics for the top level; its primitives are instance bounds, so
+	// EPO uses the area of instance boxes inside other subtrees' nodes, and a
+	// leaf costs one instance, regardless of the BLAS behind it
+	BVHStats stats;
+	stats.bytes = sizeof( TLASNode ) * 2 * (tlas.blasCount + 64) + sizeof( BVHInstance ) * tlas.blasCount;
+	if (tlas.flatBVH) stats.bytes += tlas.flatBVH->Bytes() + tlas.flatMesh->triCount * sizeof( uint );
+	if (tlas.instCount == 0) return stats;
+	vector<uint> order, parent( tlas.nodesUsed ), depth( tlas.nodesUsed );
+	vector<uint> stack = { 0 };
+	const float rootArea = HalfArea( tlas.tlasNode[0].aabbMin, tlas.tlasNode[0].aabbMax );
+	float sah = 0;
+	parent[0] = 0, depth[0] = 0;
+	while (!stack.empty())
+	{
+		const uint idx = stack.back();
+		stack.pop_back();
+		TLASNode& node = tlas.tlasNode[idx];
+		order.push_back( idx );
+		sah += HalfArea( node.aabbMin, node.aabbMax ) / rootArea;
+		if (node.isLeaf())
+		{
+			stats.leaves++;
+			stats.leafSize[1]++;
+			stats.depth[min( depth[idx], 64u )]++;
+			stats.maxDepth = max( stats.maxDepth, depth[idx] );
+			continue;
+		}
+		const uint left = node.leftRight & 0xffff, right = node.leftRight >> 16;
+		FATALERROR_IF( left >= parent.size() || right >= parent.size(), "Analyze: TLAS node %i has children %i and %i, but only %i nodes are in use.", idx, left, right, tlas.nodesUsed );
+		parent[left] = parent[right] = idx;
+		depth[left] = depth[right] = depth[idx] + 1;
+		stack.push_back( right ), stack.push_back( left );
+	}
+	stats.nodes = (uint)order.size(), stats.sah = sah;
+	double totalArea = 0, epo = 0;
+	for (uint i = 0; i < tlas.instCount; i++)
+		totalArea += HalfArea( tlas.blas[tlas.instList[i]].bounds.bmin, tlas.blas[tlas.instList[i]].bounds.bmax );
+	const int nodeCount = (int)order.size();
+#pragma omp parallel for schedule(dynamic) reduction(+:epo)
+	for (int i = 0; i < nodeCount; i++)
+	{
+		const uint n = order[i];
+		TLASNode& node = tlas.tlasNode[n];
+		vector<uint> todo = { 0 };
+		double overlap = 0;
+		while (!todo.empty())
+		{
+			const uint idx = todo.back();
+			todo.pop_back();
+			// skip the node itself and its descendants
+			uint a = idx;
+			while (a != n && a != 0) a = parent[a];
+			if (a == n) continue;
+			TLASNode& other = tlas.tlasNode[idx];
+			if (!Overlaps( node.aabbMin, node.aabbMax, other.aabbMin, other.aabbMax )) continue;
+			if (!other.isLeaf()) { todo.push_back( other.leftRight & 0xffff ), todo.push_back( other.leftRight >> 16 ); continue; }
+			const aabb& b = tlas.blas[other.BLAS].bounds;
+			const float3 bmin = fmaxf( b.bmin, node.aabbMin ), bmax = fminf( b.bmax, node.aabbMax );
+			overlap += HalfArea( bmin, bmax );
+		}
+		epo += overlap;
+	}
+	stats.epo = totalArea > 0 ? (float)(epo / totalArea) : 0;
+	return stats;
+}
+
+void BVHStats::Print( const char* name )
+{
+	printf( "%s: %i nodes, %i leaves, depth %i, %.2fMB\n", name, nodes, leaves, maxDepth, bytes / 1048576.0f );
+	printf( "  SAH cost: %.2f, EPO: %.2f\n", sah, epo );
+	printf( "  leaf size:" );
+	for (int i = 0; i < 33; i++) if (leafSize[i]) printf( " %i%s:%i", i, i == 32 ? "+" : "", leafSize[i] );
+	printf( "\n  leaf depth:" );
+	for (int i = 0; i < 65; i++) if (depth[i]) printf( " %i:%i", i, depth[i] );
+	printf( "\n" );
+}
+
+void BVHStats::AppendCSV( const char* file, const char* name )
+{
+	// one line per run, so builder variants and regressions can be tracked over time
+	FILE* f = fopen( file, "r" );
+	const bool isNew = !f;
+	if (f) fclose( f );
+	f = fopen( file, "a" );
+	if (!f) { printf( "could not open %s for writing\n", file ); return; }
+	if (isNew) fprintf( f, "name,nodes,leaves,maxdepth,bytes,sah,epo\n" );
+	fprintf( f, "%s,%i,%i,%i,%zu,%.4f,%.4f\n", name, nodes, leaves, maxDepth, bytes, sah, epo );
+	fclose( f );
+}
+
+// EOF
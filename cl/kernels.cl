@@ -1,4 +1,5 @@
 #include "template/common.h" 
+#include "cl/skymap.h"
 
 inline uint RGB32FtoRGB8( float3 c )
 {
@@ -144,45 +145,41 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 	}
 }
 
-float3 Trace( struct Ray* ray, __global float* skyPixels, __global struct Tri* triData, 
+float3 Trace( struct Ray* ray, __global uint* skyMap, __global struct Tri* triData, 
 	__global struct BVHNode* bvhNodeData, __global uint* idxData )
 {
 	// see if we hit a teapot
 	BVHIntersect( ray, 0, triData, bvhNodeData, idxData );
 	if (ray->hit.t < 1e30f) return (float3)(1,1,1);
 	// sample sky
-	float phi = atan2( ray->D.z, ray->D.x );
-	uint u = (uint)(3200 * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
-	uint v = (uint)(1600 * acos( ray->D.y ) * INVPI - 0.5f);
-	uint skyIdx = (u + v * 3200) % (3200 * 1600);
-	return 0.65f * (float3)(skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2]);
+	return 0.65f * DecodeRGB9E5( skyMap[SkyMapIndex( ray->D.x, ray->D.y, ray->D.z )] );
 }
 
-__kernel void render( __global uint* target, __global float* skyPixels,
+__kernel void render( __global uint* target, __global uint* skyMap,
 	__global struct Tri* triData, __global struct TriEx* triExData,
 	__global uint* texData, __global struct TLASNode* tlasData,
 	__global struct BVHInstance* instData,
 	__global struct BVHNode* bvhNodeData, __global uint* idxData,
-	float3 camPos, float3 p0, float3 p1, float3 p2 
+	float3 camPos, float3 p0, float3 p1, float3 p2, int width, int height
 )
 {
 	// plot a pixel into the target array in GPU memory
 	int threadIdx = get_global_id( 0 );
-	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
-	int x = threadIdx % SCRWIDTH;
-	int y = threadIdx / SCRWIDTH;
+	if (threadIdx >= width * height) return;
+	int x = threadIdx % width;
+	int y = threadIdx / width;
 	// create a primary ray for the pixel
 	struct Ray ray;
 	ray.O = camPos;
 	float3 pixelPos = ray.O + p0 +
-		(p1 - p0) * ((float)x / SCRWIDTH) +
-		(p2 - p0) * ((float)y / SCRHEIGHT);
+		(p1 - p0) * ((float)x / width) +
+		(p2 - p0) * ((float)y / height);
 	ray.D = normalize( pixelPos - ray.O );
 	ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
 	// trace the primary ray
-	float3 color = Trace( &ray, skyPixels, triData, bvhNodeData, idxData );
+	float3 color = Trace( &ray, skyMap, triData, bvhNodeData, idxData );
 	// plot the result
-	target[x + y * SCRWIDTH] = RGB32FtoRGB8( color );
+	target[x + y * width] = RGB32FtoRGB8( color );
 }
 
 // EOF
\ No newline at end of file
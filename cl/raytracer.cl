@@ -1,68 +1,84 @@
 #include "template/common.h"
+#include "cl/rng.h"
+#include "cl/skymap.h"
 #include "cl/tools.cl"
+#include "cl/wavefront.h"
 
 __constant float3 lightPos = (float3)(3, 10, 2);
 __constant float3 lightColor = (float3)(150, 150, 120);
 __constant float3 ambient = (float3)(0.2f, 0.2f, 0.4f);
 
-float3 Trace( struct Ray* ray, __global float* skyPixels, 
+// shading, shared by the megakernel and the wavefront kernels; like the CPU
+// renderer with nearest texture lookups
+
+float3 HitNormal( struct Intersection* hit, __global struct TriEx* triExData, __global struct BVHInstance* instData )
+{
+	// interpolate the vertex normals and bring the result to world space
+	__global struct TriEx* tri = triExData + (hit->instPrim & 0xfffff);
+	float3 N0 = (float3)( tri->N0x, tri->N0y, tri->N0z );
+	float3 N1 = (float3)( tri->N1x, tri->N1y, tri->N1z );
+	float3 N2 = (float3)( tri->N2x, tri->N2y, tri->N2z );
+	float3 N = hit->u * N1 + hit->v * N2 + (1 - (hit->u + hit->v)) * N0;
+	return normalize( TransformVector( &N, &instData[hit->instPrim >> 20].transform ) );
+}
+
+float3 HitAlbedo( struct Intersection* hit, __global struct TriEx* triExData, __global uint* texData )
+{
+	// calculate texture uv based on barycentrics
+	__global struct TriEx* tri = triExData + (hit->instPrim & 0xfffff);
+	float2 uv = hit->u * tri->uv1 + hit->v * tri->uv2 + (1 - (hit->u + hit->v)) * tri->uv0;
+	int iu = (int)(uv.x * 1024) & 1023;
+	int iv = (int)(uv.y * 1024) & 1023;
+	return RGB8toRGB32F( texData[iu + (iv << 10)] );
+}
+
+bool IsMirror( uint instIdx ) { return (instIdx * 17) & 1; }
+
+float3 DirectLight( float3 I, float3 N, float3* L, float* dist )
+{
+	// unshadowed light from the point light; also returns the direction to it
+	*L = lightPos - I;
+	*dist = length( *L );
+	*L *= 1.0f / *dist;
+	return max( 0.0f, dot( N, *L ) ) * lightColor * (1.0f / (*dist * *dist));
+}
+
+float3 Trace( struct Ray* ray, __global uint* skyMap, 
 	__global struct BVHInstance* instData, __global struct TLASNode* tlasData,
 	__global uint* texData, __global struct Tri* triData, __global struct TriEx* triExData,
 	__global struct BVHNode* bvhNodeData, __global uint* idxData 
 )
 {
 #if 1
-	// default renderer
-	int rayDepth = 0;
-	float3 R;
-	// bounce until we hit the sky or a diffuse surface
-	while (rayDepth < 4)
+	// default renderer: bounce off mirrors until we hit the sky or a diffuse surface
+	for (int rayDepth = 0;; rayDepth++)
 	{
 		TLASIntersect( ray, triData, instData, tlasData, bvhNodeData, idxData );
 		struct Intersection i = ray->hit;
 		if (i.t == 1e30f)
 		{
 			// sample sky
-			return SampleSky( &ray->D, skyPixels );
+			return SampleSky( &ray->D, skyMap );
 		}
-		// calculate texture uv based on barycentrics
-		uint triIdx = i.instPrim & 0xfffff;
-		uint instIdx = i.instPrim >> 20;
-		__global struct TriEx* tri = triExData + triIdx;
-		float2 uv = i.u * tri->uv1 + i.v * tri->uv2 + (1 - (i.u + i.v)) * tri->uv0;
-		int iu = (int)(uv.x * 1024) & 1023;
-		int iv = (int)(uv.y * 1024) & 1023;
-		uint texel = texData[iu + (iv << 10)];
-		float3 albedo = RGB8toRGB32F( texel );
-		// calculate the normal for the intersection
-		float3 N0 = (float3)( tri->N0x, tri->N0y, tri->N0z );
-		float3 N1 = (float3)( tri->N1x, tri->N1y, tri->N1z );
-		float3 N2 = (float3)( tri->N2x, tri->N2y, tri->N2z );
-		float3 N = i.u * N1 + i.v * N2 + (1 - (i.u + i.v)) * N0;
-		N = normalize( TransformVector( &N, &instData[instIdx].transform ) );
+		float3 N = HitNormal( &i, triExData, instData );
 		float3 I = ray->O + (ray->D * i.t);
 		// shading
-		bool mirror = (instIdx * 17) & 1;
-		if (mirror)
+		if (IsMirror( i.instPrim >> 20 ))
 		{
 			// calculate the specular reflection in the intersection point
-			float3 R = ray->D - (2 * N * dot( N, ray->D ));
-			if (rayDepth == 1) return SampleSky( &R, skyPixels );
-			ray->D = R;
-			ray->O = I + ray->D * 0.005f;
+			if (rayDepth >= MAX_MIRROR_DEPTH) return (float3)( 0, 0, 0 );
+			ray->D = ray->D - (2 * N * dot( N, ray->D ));
+			ray->O = I + ray->D * 0.001f;
 			ray->hit.t = 1e30f;
 		}
 		else
 		{
 			// calculate the diffuse reflection in the intersection point
-			float3 L = lightPos - I;
-			float dist = length( L );
-			L *= 1.0f / dist;
-			return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+			float3 L;
+			float dist;
+			return HitAlbedo( &i, triExData, texData ) * (ambient + DirectLight( I, N, &L, &dist ));
 		}
-		rayDepth++;
 	}
-	return (float3)( 1, 1, 1 );
 #else
 	// minimal depth renderer for performance experiments
 	TLASIntersect( ray, triData, instData, tlasData, bvhNodeData, idxData );
@@ -75,36 +91,196 @@ float3 Trace( struct Ray* ray, __global float* skyPixels,
 
 __kernel void render( 
 	write_only image2d_t target,
-	__global float* skyPixels,
+	__global uint* skyMap,
 	__global struct Tri* triData, __global struct TriEx* triExData,
 	__global uint* texData, __global struct TLASNode* tlasData,
 	__global struct BVHInstance* instData,
 	__global struct BVHNode* bvhNodeData, __global uint* idxData,
-	float3 camPos, float3 p0, float3 p1, float3 p2 
+	float3 camPos, float3 p0, float3 p1, float3 p2, uint frame, int width, int height
 )
 {
 	// plot a pixel into the target array in GPU memory
 	int threadIdx = get_global_id( 0 );
-	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
-	int x = threadIdx % SCRWIDTH;
-	int y = threadIdx / SCRWIDTH;
-	// intialize RNG
-	uint seed = WangHash( threadIdx * 17 + 1 );
+	if (threadIdx >= width * height) return;
+	int x = threadIdx % width;
+	int y = threadIdx / width;
 	// create a primary ray for the pixel
 	struct Ray ray;
 	float3 color = (float3)( 0, 0, 0 );
 	for( int i = 0; i < 2; i++ )
 	{
 		float3 pixelPos = p0 +
-			(p1 - p0) * (((float)x + RandomFloat( &seed )) / SCRWIDTH) +
-			(p2 - p0) * (((float)y + RandomFloat( &seed )) / SCRHEIGHT);
+			(p1 - p0) * (((float)x + PixelRandom( threadIdx, frame, i, 0 )) / width) +
+			(p2 - p0) * (((float)y + PixelRandom( threadIdx, frame, i, 1 )) / height);
 		ray.O = camPos;
 		ray.D = normalize( pixelPos - ray.O );
 		ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
 		// trace the primary ray
-		color += Trace( &ray, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData );
+		color += Trace( &ray, skyMap, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData );
 	}
 	write_imagef( target, (int2)(x, y), (float4)( color * (1.0f / 2.0f), 1 ) );
 }
 
+// wavefront path tracer: instead of running each path to its end in one
+// work-item, the paths advance one bounce at a time, with a kernel per stage:
+// - generate: a primary ray per pixel, into ray queue 0;
+// - extend: find the nearest hit for every ray in the current queue;
+// - shade: add sky and diffuse light to the pixels; mirror hits push their
+//   reflection into the other ray queue, diffuse hits push a shadow ray;
+// - connect: trace the shadow rays, and add their light if nothing blocks it.
+// All work-items in a stage do the same work, so mirror and diffuse lanes no
+// longer wait for each other. Every kernel clears the counters of the stage
+// after the next one (see cl/wavefront.h), so the host only reads them back
+// to see when the queues run dry. One path per pixel per pass: a pixel is
+// written by one work-item at a time, without atomics.
+
+__kernel void generate( __global struct PathRay* rays, __global uint* counters,
+	float3 camPos, float3 p0, float3 p1, float3 p2, uint frame, uint sample, int width, int height
+)
+{
+	int pixel = get_global_id( 0 );
+	if (pixel == 0) counters[COUNT_RAYS] = width * height, counters[HEAD_EXTEND] = 0;
+	if (pixel >= width * height) return;
+	int x = pixel % width;
+	int y = pixel / width;
+	float3 pixelPos = p0 +
+		(p1 - p0) * (((float)x + PixelRandom( pixel, frame, sample, 0 )) / width) +
+		(p2 - p0) * (((float)y + PixelRandom( pixel, frame, sample, 1 )) / height);
+	float3 D = normalize( pixelPos - camPos );
+	__global struct PathRay* ray = rays + pixel;
+	ray->Ox = camPos.x, ray->Oy = camPos.y, ray->Oz = camPos.z, ray->pixel = pixel;
+	ray->Dx = D.x, ray->Dy = D.y, ray->Dz = D.z;
+}
+
+uint FetchBatch( volatile __global uint* head, __local uint* batch )
+{
+	// persistent threads: a group takes the next get_local_size( 0 ) queue entries
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (get_local_id( 0 ) == 0) *batch = atomic_add( head, (uint)get_local_size( 0 ) );
+	barrier( CLK_LOCAL_MEM_FENCE );
+	return *batch;
+}
+
+// extend and connect run as persistent threads: just enough groups to fill the
+// device, which fetch batches of rays until the queue is empty. A group that
+// drew short rays takes new ones, instead of leaving its cores idle until the
+// slowest ray of a fixed partition is done. See Aila and Laine, "Understanding
+// the Efficiency of Ray Traversal on GPUs", 2009.
+
+__kernel void extend( __global struct PathRay* rays, __global uint* counters, int in,
+	__global struct Tri* triData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData,
+	__global struct BVHNode* bvhNodeData, __global uint* idxData
+)
+{
+	// clear the queues that shade fills, and the fetch position of connect
+	if (get_global_id( 0 ) == 0) counters[COUNT_RAYS + 1 - in] = counters[COUNT_SHADOW] = counters[HEAD_CONNECT] = 0;
+	uint count = counters[COUNT_RAYS + in];
+	__local uint batch;
+	for (uint first; (first = FetchBatch( counters + HEAD_EXTEND, &batch )) < count;)
+	{
+		uint i = first + get_local_id( 0 );
+		if (i >= count) continue; // the group still takes part in the next fetch
+		struct Ray ray;
+		ray.O = (float3)( rays[i].Ox, rays[i].Oy, rays[i].Oz );
+		ray.D = (float3)( rays[i].Dx, rays[i].Dy, rays[i].Dz );
+		ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+		TLASIntersect( &ray, triData, instData, tlasData, bvhNodeData, idxData );
+		rays[i].hit = ray.hit;
+	}
+}
+
+__kernel void shade( __global struct PathRay* rays, __global struct PathRay* nextRays,
+	__global struct ShadowRay* shadowRays, __global float4* accumulator,
+	__global uint* counters, int in, int depth, int shadows,
+	__global uint* skyMap, __global struct TriEx* triExData, __global uint* texData,
+	__global struct BVHInstance* instData
+)
+{
+	// one work-item per ray; the group collects its new rays first, so it
+	// reserves its range in each queue with a single atomic add
+	uint i = get_global_id( 0 );
+	if (i == 0) counters[HEAD_EXTEND] = 0;
+	__local uint nextCount, shadowCount, nextBase, shadowBase;
+	if (get_local_id( 0 ) == 0) nextCount = shadowCount = 0;
+	barrier( CLK_LOCAL_MEM_FENCE );
+	int nextSlot = -1, shadowSlot = -1;
+	struct PathRay next;
+	struct ShadowRay shadow;
+	if (i < counters[COUNT_RAYS + in])
+	{
+		struct PathRay ray = rays[i];
+		float3 O = (float3)( ray.Ox, ray.Oy, ray.Oz ), D = (float3)( ray.Dx, ray.Dy, ray.Dz );
+		float3 color = (float3)( 0, 0, 0 );
+		if (ray.hit.t == 1e30f) color = SampleSky( &D, skyMap ); else
+		{
+			float3 N = HitNormal( &ray.hit, triExData, instData );
+			float3 I = O + D * ray.hit.t;
+			if (IsMirror( ray.hit.instPrim >> 20 ))
+			{
+				// the reflection continues the path; deeper mirror hits are black
+				if (depth < MAX_MIRROR_DEPTH)
+				{
+					float3 R = D - 2 * N * dot( N, D );
+					I += R * 0.001f;
+					next.Ox = I.x, next.Oy = I.y, next.Oz = I.z, next.pixel = ray.pixel;
+					next.Dx = R.x, next.Dy = R.y, next.Dz = R.z;
+					nextSlot = atomic_inc( &nextCount );
+				}
+			}
+			else
+			{
+				// ambient light now; the point light after the shadow test, if enabled
+				float3 L;
+				float dist;
+				float3 albedo = HitAlbedo( &ray.hit, triExData, texData ), direct = DirectLight( I, N, &L, &dist );
+				if (!shadows) color = albedo * (ambient + direct); else
+				{
+					color = albedo * ambient, direct *= albedo;
+					if (direct.x + direct.y + direct.z > 0)
+					{
+						I += L * 0.001f;
+						shadow.Ox = I.x, shadow.Oy = I.y, shadow.Oz = I.z, shadow.pixel = ray.pixel;
+						shadow.Dx = L.x, shadow.Dy = L.y, shadow.Dz = L.z, shadow.dist = dist - 0.002f;
+						shadow.r = direct.x, shadow.g = direct.y, shadow.b = direct.z;
+						shadowSlot = atomic_inc( &shadowCount );
+					}
+				}
+			}
+		}
+		if (nextSlot < 0) accumulator[ray.pixel] += (float4)( color, 0 );
+	}
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (get_local_id( 0 ) == 0)
+		nextBase = atomic_add( counters + COUNT_RAYS + 1 - in, nextCount ),
+		shadowBase = atomic_add( counters + COUNT_SHADOW, shadowCount );
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (nextSlot >= 0) nextRays[nextBase + nextSlot] = next;
+	if (shadowSlot >= 0) shadowRays[shadowBase + shadowSlot] = shadow;
+}
+
+__kernel void connect( __global struct ShadowRay* shadowRays, __global float4* accumulator,
+	__global uint* counters,
+	__global struct Tri* triData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData,
+	__global struct BVHNode* bvhNodeData, __global uint* idxData
+)
+{
+	uint count = counters[COUNT_SHADOW];
+	__local uint batch;
+	for (uint first; (first = FetchBatch( counters + HEAD_CONNECT, &batch )) < count;)
+	{
+		uint i = first + get_local_id( 0 );
+		if (i >= count) continue;
+		struct ShadowRay shadow = shadowRays[i];
+		struct Ray ray;
+		ray.O = (float3)( shadow.Ox, shadow.Oy, shadow.Oz );
+		ray.D = (float3)( shadow.Dx, shadow.Dy, shadow.Dz );
+		ray.hit.t = shadow.dist;
+		// any hit closer than the light shortens t
+		TLASIntersect( &ray, triData, instData, tlasData, bvhNodeData, idxData );
+		if (ray.hit.t == shadow.dist) accumulator[shadow.pixel] += (float4)( shadow.r, shadow.g, shadow.b, 0 );
+	}
+}
+
 // EOF
\ No newline at end of file
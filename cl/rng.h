@@ -0,0 +1,38 @@
+// rng.h is to be included in host and device code and provides a stateless,
+// counter-based random number generator. Each number is a hash of the pixel,
+// frame, sample and dimension it is used for, so there is no shared seed to
+// race on, and a frame is bit-exact reproducible on any thread count, on the
+// CPU as well as on the GPU.
+
+#ifndef RNG_H
+#define RNG_H
+
+#ifdef __OPENCL_VERSION__
+#define RNG_FUNC
+#else
+#define RNG_FUNC inline
+#endif
+
+// PCG hash; see Jarzynski and Olano, "Hash Functions for GPU Rendering", 2020
+RNG_FUNC uint PCGHash( uint v )
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// random uint for dimension 'dim' of sample 'sample' of a pixel in a frame
+RNG_FUNC uint PixelRandomUInt( uint pixel, uint frame, uint sample, uint dim )
+{
+	return PCGHash( dim + PCGHash( sample + PCGHash( frame + PCGHash( pixel ) ) ) );
+}
+
+// random float in [0,1): the top 24 bits convert exactly, on any device
+RNG_FUNC float PixelRandom( uint pixel, uint frame, uint sample, uint dim )
+{
+	return (PixelRandomUInt( pixel, frame, sample, dim ) >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
+
+// EOF
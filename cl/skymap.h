@@ -0,0 +1,48 @@
+// skymap.h is to be included in host and device code and addresses the
+// preprocessed sky: an octahedral map, which needs no trigonometry to look up,
+// stored as RGB9E5, 4 bytes per texel (three 9-bit mantissas and a shared
+// 5-bit exponent). See Cigolle et al., "A Survey of Efficient Representations
+// for Independent Unit Vectors", JCGT 2014, and EXT_texture_shared_exponent.
+
+#ifndef SKYMAP_H
+#define SKYMAP_H
+
+#define SKYMAP_SIZE 2048 // texels per side; 16MB, versus 61MB for the float equirectangular source
+
+#ifdef __OPENCL_VERSION__
+#define SKY_FUNC
+#define SKY_FLOAT3( x, y, z ) (float3)( x, y, z )
+#define SKY_ASFLOAT( u ) as_float( u )
+#else
+#define SKY_FUNC inline
+#define SKY_FLOAT3( x, y, z ) float3( x, y, z )
+inline float SkyAsFloat( uint u ) { float f; memcpy( &f, &u, 4 ); return f; }
+#define SKY_ASFLOAT( u ) SkyAsFloat( u )
+#endif
+
+// texel index for a direction: project onto the octahedron |x| + |y| + |z| = 1,
+// fold the lower half (y < 0) over the upper one, and use x and z as coordinates
+SKY_FUNC uint SkyMapIndex( float x, float y, float z )
+{
+	const float s = 1.0f / (fabs( x ) + fabs( y ) + fabs( z ));
+	float px = x * s, pz = z * s;
+	if (y < 0)
+	{
+		const float fx = (1 - fabs( pz )) * (px < 0 ? -1 : 1);
+		pz = (1 - fabs( px )) * (pz < 0 ? -1 : 1), px = fx;
+	}
+	const int u = min( SKYMAP_SIZE - 1, (int)((px * 0.5f + 0.5f) * SKYMAP_SIZE) );
+	const int v = min( SKYMAP_SIZE - 1, (int)((pz * 0.5f + 0.5f) * SKYMAP_SIZE) );
+	return (uint)(u + v * SKYMAP_SIZE);
+}
+
+// RGB9E5 to float: each mantissa times 2^(exponent - 15 - 9), built directly as float bits
+SKY_FUNC float3 DecodeRGB9E5( uint c )
+{
+	const float scale = SKY_ASFLOAT( ((c >> 27) + 103) << 23 );
+	return SKY_FLOAT3( (c & 511) * scale, ((c >> 9) & 511) * scale, ((c >> 18) & 511) * scale );
+}
+
+#endif
+
+// EOF
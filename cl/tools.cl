@@ -1,6 +1,7 @@
 ﻿// using random numbers in GPU code:
 // 1. seed using the thread id and a Wang Hash: seed = WangHash( (threadidx+1)*17 )
 // 2. from there on: use RandomInt / RandomFloat
+// for results that must match the CPU renderer, use PixelRandom from cl/rng.h
 uint WangHash( uint s ) 
 { 
 	s = (s ^ 61) ^ (s >> 16);
@@ -72,8 +73,7 @@ struct TLASNode
 struct BVHInstance
 {
 	float16 transform;
-	float16 invTransform; // inverse transform
-	uint dummy[16];
+	float16 invTransform; // inverse transform; packed on the host, see GPURenderer
 };
 
 // ray tracing helper functions
@@ -254,13 +254,10 @@ void TLASIntersect( struct Ray* ray, __global struct Tri* tri,
 
 // skydome
 
-float3 SampleSky( float3* D, __global float* skyPixels )
+float3 SampleSky( float3* D, __global uint* skyMap )
 {
-	float phi = atan2( D->z, D->x );
-	uint u = (uint)(3200 * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
-	uint v = (uint)(1600 * acos( D->y ) * INVPI - 0.5f);
-	uint skyIdx = (u + v * 3200) % (3200 * 1600);
-	return 0.65f * (float3)(skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2]);
+	// octahedral RGB9E5 map, see cl/skymap.h
+	return 0.65f * DecodeRGB9E5( skyMap[SkyMapIndex( D->x, D->y, D->z )] );
 }
 
 // EOF
\ No newline at end of file
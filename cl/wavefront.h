@@ -0,0 +1,37 @@
+// wavefront.h is to be included in host and device code, after the ray
+// tracing structs, and describes the queues of the wavefront path tracer in
+// cl/raytracer.cl: two ray queues, used alternately for each bounce, and a
+// queue of shadow rays. Their lengths and the fetch positions of the
+// persistent kernels live in one small array of counters.
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#define COUNT_RAYS 0		// and 1: rays in queue 0 and 1
+#define COUNT_SHADOW 2		// shadow rays
+#define HEAD_EXTEND 3		// next ray for the persistent extend kernel
+#define HEAD_CONNECT 4		// next shadow ray for the persistent connect kernel
+#define COUNTERS 8
+
+#define MAX_MIRROR_DEPTH 10	// mirror hits beyond this are black, as in WhittedApp::Trace
+#define WAVEFRONT_GROUP 64	// work-items per group in the extend, shade and connect kernels
+
+struct PathRay
+{
+	float Ox, Oy, Oz;
+	uint pixel;
+	float Dx, Dy, Dz, dummy;
+	struct Intersection hit; // total size: 48 bytes
+};
+
+struct ShadowRay
+{
+	float Ox, Oy, Oz;
+	uint pixel;
+	float Dx, Dy, Dz, dist;
+	float r, g, b, dummy;	// light that reaches the pixel if nothing blocks the ray; 48 bytes
+};
+
+#endif
+
+// EOF
@@ -14,6 +14,8 @@ del *.suo /AH
 del *.user
 del *.o
 del *.VC.db
+del assets\*.skymap
+del assets\scene.bin
 rd ipch /S /Q
 rd release /S /Q
 rd debug /S /Q
@@ -0,0 +1,150 @@
+#include "precomp.h"
+#include "bvh.h"
+#include "gpurender.h"
+#include "cl/skymap.h"
+#include "cl/wavefront.h"
+
+#define PERSISTENT_GROUPS 16 // persistent work-groups per compute unit
+
+// the host structs that go to the device as they are
+static_assert( sizeof( Tri ) == 64 && sizeof( BVHNode ) == 32 && sizeof( TLASNode ) == 32, "layout differs from cl/tools.cl" );
+
+GPURenderer::GPURenderer( Mesh* mesh, TLAS& tlas, const uint* skyMap, const int width, const int height ) :
+	mesh( mesh ), tlas( tlas ), width( width ), height( height )
+{
+	// one program holds all kernels; the first kernel builds it
+	render = new Kernel( "cl/raytracer.cl", "render" );
+	generate = new Kernel( render->GetProgram(), "generate" );
+	extend = new Kernel( render->GetProgram(), "extend" );
+	shade = new Kernel( render->GetProgram(), "shade" );
+	connect = new Kernel( render->GetProgram(), "connect" );
+	// scene data; Tri, BVHNode and TLASNode match the kernel structs as they are,
+	// TriEx gets padded; the kernels expect a 1024x1024 texture
+	Surface* texture = mesh->texture;
+	FATALERROR_IF( texture->width != 1024 || texture->height != 1024, "the OpenCL renderer needs a 1024x1024 texture" );
+	const int tris = mesh->triCount;
+	triExData = (float*)MALLOC64( tris * 16 * sizeof( float ) );
+	for (int i = 0; i < tris; i++)
+	{
+		const TriEx& ex = mesh->triEx[i];
+		const float packed[16] = { ex.uv0.x, ex.uv0.y, ex.uv1.x, ex.uv1.y, ex.uv2.x, ex.uv2.y,
+			ex.N0.x, ex.N0.y, ex.N0.z, ex.N1.x, ex.N1.y, ex.N1.z, ex.N2.x, ex.N2.y, ex.N2.z, 0 };
+		memcpy( triExData + i * 16, packed, sizeof( packed ) );
+	}
+	BVH* bvh = mesh->bvh;
+	triBuffer = new Buffer( sizeof( Tri ) * tris, mesh->tri, Buffer::READONLY );
+	triExBuffer = new Buffer( 16 * sizeof( float ) * tris, triExData, Buffer::READONLY );
+	texBuffer = new Buffer( sizeof( uint ) * texture->width * texture->height, texture->pixels, Buffer::READONLY );
+	bvhNodeBuffer = new Buffer( sizeof( BVHNode ) * bvh->nodesUsed, bvh->bvhNode, Buffer::READONLY );
+	idxBuffer = new Buffer( sizeof( uint ) * tris, bvh->triIdx, Buffer::READONLY );
+	skyBuffer = new Buffer( sizeof( uint ) * SKYMAP_SIZE * SKYMAP_SIZE, (void*)skyMap, Buffer::READONLY );
+	// of an instance, the kernels need just the matrices: half of BVHInstance
+	instData = (float*)MALLOC64( tlas.blasCount * 32 * sizeof( float ) );
+	instances = new MirrorBuffer( 32 * sizeof( float ), tlas.blasCount );
+	tlasNodes = new MirrorBuffer( sizeof( TLASNode ), 2 * (tlas.blasCount + 64) ); // as many as the TLAS has room for
+	Buffer* scene[6] = { triBuffer, triExBuffer, texBuffer, bvhNodeBuffer, idxBuffer, skyBuffer };
+	for (int i = 0; i < 6; i++) scene[i]->CopyToDevice();
+	UploadScene();
+	// queues for one path per pixel; CopyFromDevice allocates the host side
+	const int pixels = width * height;
+	for (int i = 0; i < 2; i++) rayQueue[i] = new Buffer( sizeof( PathRay ) * pixels );
+	shadowQueue = new Buffer( sizeof( ShadowRay ) * pixels );
+	counters = new Buffer( sizeof( uint ) * COUNTERS );
+	accumulator = new Buffer( sizeof( float4 ) * pixels );
+	// the megakernel writes to an image; a plain one, not shared with OpenGL
+	const cl_image_format format = { CL_RGBA, CL_FLOAT };
+	cl_image_desc desc = {};
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D, desc.image_width = width, desc.image_height = height;
+	cl_int error;
+	image = clCreateImage( Kernel::GetContext(), CL_MEM_WRITE_ONLY, &format, &desc, 0, &error );
+	FATALERROR_IF( error != CL_SUCCESS, "clCreateImage failed: %i", error );
+	// enough persistent groups to keep every compute unit busy
+	cl_uint units = 1;
+	clGetDeviceInfo( Kernel::GetDevice(), CL_DEVICE_MAX_COMPUTE_UNITS, sizeof( units ), &units, 0 );
+	persistentItems = (size_t)units * PERSISTENT_GROUPS * WAVEFRONT_GROUP;
+}
+
+GPURenderer::~GPURenderer()
+{
+	clReleaseMemObject( image );
+	Buffer* buffers[10] = { triBuffer, triExBuffer, texBuffer, bvhNodeBuffer, idxBuffer, skyBuffer,
+		rayQueue[0], rayQueue[1], shadowQueue, counters };
+	for (int i = 0; i < 10; i++) delete buffers[i];
+	delete accumulator;
+	delete instances;
+	delete tlasNodes;
+	FREE64( triExData );
+	FREE64( instData );
+	Kernel* kernels[5] = { render, generate, extend, shade, connect };
+	for (int i = 0; i < 5; i++) delete kernels[i];
+}
+
+void GPURenderer::UploadScene()
+{
+	// the MirrorBuffers find what changed: instances that did not move, and
+	// nodes that BuildQuick produced the same as last frame, stay where they are
+	for (uint i = 0; i < tlas.blasCount; i++)
+	{
+		memcpy( instData + i * 32, &tlas.blas[i].GetTransform(), 16 * sizeof( float ) );
+		memcpy( instData + i * 32 + 16, &tlas.blas[i].GetInverseTransform(), 16 * sizeof( float ) );
+	}
+	const cl_event e[2] = { instances->Upload( instData, tlas.blasCount ), tlasNodes->Upload( tlas.tlasNode, tlas.nodesUsed ) };
+	sceneReady = e[1] ? e[1] : e[0]; // same queue: the later write is done last
+	bytesUploaded = instances->recordsSent * 32 * sizeof( float ) + tlasNodes->recordsSent * sizeof( TLASNode );
+}
+
+void GPURenderer::RenderMegakernel( const float3& camPos, const float3& p0, const float3& p1, const float3& p2, const uint frame )
+{
+	render->SetArguments( &image, skyBuffer, triBuffer, triExBuffer, texBuffer, tlasNodes->GetBuffer(), instances->GetBuffer(), bvhNodeBuffer, idxBuffer,
+		camPos, camPos + p0, camPos + p1, camPos + p2, (int)frame, width, height );
+	render->Run( (size_t)width * height, 0, sceneReady ? &sceneReady : 0 );
+}
+
+void GPURenderer::ReadImage( float4* pixels )
+{
+	const size_t origin[3] = { 0, 0, 0 }, region[3] = { (size_t)width, (size_t)height, 1 };
+	const cl_int error = clEnqueueReadImage( Kernel::GetQueue(), image, CL_TRUE, origin, region, 0, 0, pixels, 0, 0, 0 );
+	FATALERROR_IF( error != CL_SUCCESS, "clEnqueueReadImage failed: %i", error );
+}
+
+void GPURenderer::Render( const float3& camPos, const float3& p0, const float3& p1, const float3& p2, const uint frame, const uint firstSample, const int spp, const bool shadows )
+{
+	Timer timer;
+	auto stageDone = [&]( const int stage ) { if (profile) clFinish( Kernel::GetQueue() ), stageSeconds[stage] += timer.elapsed(), timer.reset(); };
+	memset( stageSeconds, 0, sizeof( stageSeconds ) );
+	raysTraced = 0;
+	accumulator->Clear();
+	const int pixels = width * height;
+	for (int sample = 0; sample < spp; sample++)
+	{
+		generate->SetArguments( rayQueue[0], counters, camPos, camPos + p0, camPos + p1, camPos + p2, (int)frame, (int)(firstSample + sample), width, height );
+		generate->Run( (size_t)pixels );
+		stageDone( 0 );
+		// a bounce per iteration; the host only learns how many rays the next one has
+		uint count = pixels;
+		for (int depth = 0; count > 0; depth++)
+		{
+			const int in = depth & 1;
+			extend->SetArguments( rayQueue[in], counters, in, triBuffer, tlasNodes->GetBuffer(), instances->GetBuffer(), bvhNodeBuffer, idxBuffer );
+			extend->Run( persistentItems, WAVEFRONT_GROUP, sample == 0 && depth == 0 && sceneReady ? &sceneReady : 0 );
+			stageDone( 1 );
+			shade->SetArguments( rayQueue[in], rayQueue[1 - in], shadowQueue, accumulator, counters, in, depth, shadows ? 1 : 0,
+				skyBuffer, triExBuffer, texBuffer, instances->GetBuffer() );
+			shade->Run( (count + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP * WAVEFRONT_GROUP, WAVEFRONT_GROUP );
+			stageDone( 2 );
+			if (shadows)
+			{
+				connect->SetArguments( shadowQueue, accumulator, counters, triBuffer, tlasNodes->GetBuffer(), instances->GetBuffer(), bvhNodeBuffer, idxBuffer );
+				connect->Run( persistentItems, WAVEFRONT_GROUP );
+				stageDone( 3 );
+			}
+			counters->CopyFromDevice();
+			const uint* c = counters->GetHostPtr();
+			raysTraced += count + c[COUNT_SHADOW];
+			count = c[COUNT_RAYS + 1 - in];
+		}
+	}
+	accumulator->CopyFromDevice();
+}
+
+// EOF
@@ -0,0 +1,54 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// OpenCL renderer for the demo scene, in two versions: the 'render' megakernel
+// in cl/raytracer.cl, a work-item per pixel that runs its paths to the end, and
+// the wavefront path tracer next to it, with a kernel per stage and ray queues
+// in between. Both follow WhittedApp::Trace with nearest texture lookups, so
+// their images can be compared with the CPU renderers. Results are read back
+// instead of shared with OpenGL, so this also runs on CPU runtimes like PoCL.
+class GPURenderer
+{
+public:
+	GPURenderer( Mesh* mesh, TLAS& tlas, const uint* skyMap, const int width, const int height );
+	~GPURenderer();
+	GPURenderer( const GPURenderer& ) = delete;
+	GPURenderer& operator=( const GPURenderer& ) = delete;
+	// instances and TLAS nodes: the ones that changed since the last upload are
+	// sent without blocking; kernels that trace rays wait for them. Not to be
+	// called while kernels of the previous frame still run.
+	void UploadScene();
+	// camPos and the screen corners relative to it, as in WhittedApp
+	void RenderMegakernel( const float3& camPos, const float3& p0, const float3& p1, const float3& p2, const uint frame );
+	void ReadImage( float4* pixels );
+	// 'spp' passes of one path per pixel, summed in 'accumulator' and read back
+	void Render( const float3& camPos, const float3& p0, const float3& p1, const float3& p2, const uint frame, const uint firstSample, const int spp, const bool shadows );
+	const float4* Result() { return (const float4*)accumulator->GetHostPtr(); }
+	// statistics of the last Render; stage times are only measured when profiling,
+	// as that waits for every kernel: generate, extend, shade, connect
+	uint64_t raysTraced = 0;
+	uint bytesUploaded = 0;	// by the last UploadScene
+	bool profile = false;
+	float stageSeconds[4] = {};
+private:
+	Mesh* mesh;
+	TLAS& tlas;
+	int width, height;
+	size_t persistentItems;	// work-items for the persistent kernels
+	Kernel* render, * generate, * extend, * shade, * connect;
+	// scene data in the layout of cl/tools.cl
+	float* triExData;		// TriEx padded to 64 bytes
+	float* instData;		// transform and inverse of each instance
+	Buffer* triBuffer, * triExBuffer, * texBuffer, * bvhNodeBuffer, * idxBuffer, * skyBuffer;
+	MirrorBuffer* instances, * tlasNodes;
+	cl_event sceneReady = 0; // the last write of UploadScene, if any
+	// wavefront queues and results; the megakernel renders to an image
+	Buffer* rayQueue[2], * shadowQueue, * counters, * accumulator;
+	cl_mem image;
+};
+
+} // namespace Tmpl8
+
+// EOF
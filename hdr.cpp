@@ -0,0 +1,135 @@
+#include "precomp.h"
+#include "hdr.h"
+
+// RGBE: three 8-bit mantissas and a shared exponent per pixel; a channel is
+// mantissa * 2^(exponent - 136), and exponent 0 is black. Most files store
+// each scanline as four run-length encoded channel planes ("new" RLE, for
+// lines of 8 to 32767 pixels); the rest are flat. Like stb_image, old-style
+// RLE and orientations other than "-Y height +X width" are not supported.
+
+static bool ParseHeader( const uchar*& p, const uchar* end, int& width, int& height )
+{
+	const bool radiance = end - p >= 11 && !memcmp( p, "#?RADIANCE\n", 11 ), rgbeMagic = end - p >= 7 && !memcmp( p, "#?RGBE\n", 7 );
+	if (!radiance && !rgbeMagic) return false;
+	// key=value lines up to an empty line, then the resolution
+	bool rgbe = false;
+	while (true)
+	{
+		const uchar* eol = (const uchar*)memchr( p, '\n', end - p );
+		if (!eol) return false;
+		if (eol == p) { p++; break; }
+		if (eol - p == 22 && !memcmp( p, "FORMAT=32-bit_rle_rgbe", 22 )) rgbe = true;
+		p = eol + 1;
+	}
+	const uchar* eol = (const uchar*)memchr( p, '\n', end - p );
+	if (!rgbe || !eol || eol - p > 63) return false;
+	char line[64] = {};
+	memcpy( line, p, eol - p );
+	p = eol + 1;
+	return sscanf( line, "-Y %i +X %i", &height, &width ) == 2 && width > 0 && height > 0;
+}
+
+static const uchar* SkipScanline( const uchar* p, const uchar* end, const int width )
+{
+	// validates an RLE scanline without decoding it; returns the next one, or 0
+	if (end - p < 4 || p[0] != 2 || p[1] != 2 || ((p[2] << 8) | p[3]) != width) return 0;
+	p += 4;
+	for (int c = 0; c < 4; c++) for (int i = 0; i < width;)
+	{
+		if (p >= end) return 0;
+		int count = *p++;
+		const bool run = count > 128;
+		if (run) count -= 128;
+		if (count == 0 || count > width - i) return 0;
+		p += run ? 1 : count, i += count;
+		if (p > end) return 0;
+	}
+	return p;
+}
+
+static void DecodeScanline( const uchar* p, uchar* rgbe, const int width )
+{
+	// planes to interleaved RGBE; the scanline was validated by SkipScanline
+	p += 4;
+	for (int c = 0; c < 4; c++) for (int i = 0; i < width;)
+	{
+		int count = *p++;
+		if (count > 128) { const uchar value = *p++; for (count -= 128; count--;) rgbe[i++ * 4 + c] = value; }
+		else while (count--) rgbe[i++ * 4 + c] = *p++;
+	}
+}
+
+static inline __m128 RGBEToFloat( const __m128i p, const bool sqrtValues )
+{
+	// p: R, G, B, E as ints. The scale 2^(e - 128) is built as float bits and
+	// applied after the exact 2^-8, so no exponent can overflow; only e = 1,
+	// for values below 2^-127, flushes to zero
+	const __m128i e = _mm_shuffle_epi32( p, 0xff );
+	const __m128i bits = _mm_and_si128( _mm_slli_epi32( _mm_sub_epi32( e, _mm_set1_epi32( 1 ) ), 23 ), _mm_cmpgt_epi32( e, _mm_setzero_si128() ) );
+	const __m128 c = _mm_mul_ps( _mm_mul_ps( _mm_cvtepi32_ps( p ), _mm_set1_ps( 1.0f / 256 ) ), _mm_castsi128_ps( bits ) );
+	return sqrtValues ? _mm_sqrt_ps( c ) : c;
+}
+
+static void ConvertScanline( const uchar* rgbe, float* dst, const int width, const bool sqrtValues )
+{
+	// four pixels per iteration; each result is stored as four floats, three
+	// floats apart, so the fourth lane is overwritten by the next pixel. The
+	// last pixel of the line is stored separately: the next line may belong
+	// to another thread.
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 < width; i += 4)
+	{
+		const __m128i v = _mm_loadu_si128( (const __m128i*)(rgbe + i * 4) );
+		const __m128i lo = _mm_unpacklo_epi8( v, zero ), hi = _mm_unpackhi_epi8( v, zero );
+		_mm_storeu_ps( dst + i * 3, RGBEToFloat( _mm_unpacklo_epi16( lo, zero ), sqrtValues ) );
+		_mm_storeu_ps( dst + i * 3 + 3, RGBEToFloat( _mm_unpackhi_epi16( lo, zero ), sqrtValues ) );
+		_mm_storeu_ps( dst + i * 3 + 6, RGBEToFloat( _mm_unpacklo_epi16( hi, zero ), sqrtValues ) );
+		_mm_storeu_ps( dst + i * 3 + 9, RGBEToFloat( _mm_unpackhi_epi16( hi, zero ), sqrtValues ) );
+	}
+	for (; i < width; i++)
+	{
+		int packed;
+		memcpy( &packed, rgbe + i * 4, 4 );
+		const __m128i p = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( packed ), zero ), zero );
+		const __m128 c = RGBEToFloat( p, sqrtValues );
+		if (i < width - 1) { _mm_storeu_ps( dst + i * 3, c ); continue; }
+		float last[4];
+		_mm_storeu_ps( last, c );
+		memcpy( dst + i * 3, last, 3 * sizeof( float ) );
+	}
+}
+
+float* Tmpl8::LoadHDR( const char* file, int& width, int& height, const bool sqrtValues )
+{
+	MappedFile source( file );
+	if (!source.data) return 0;
+	const uchar* p = source.data, * end = p + source.size;
+	if (!ParseHeader( p, end, width, height )) return 0;
+	// locate the scanlines; RLE lines have variable length, so this is serial,
+	// but it only reads the run headers
+	const bool rle = width >= 8 && width < 32768 && end - p >= 4 && p[0] == 2 && p[1] == 2 && !(p[2] & 128);
+	vector<const uchar*> line( height );
+	for (int y = 0; y < height; y++)
+	{
+		line[y] = p;
+		if (rle) p = SkipScanline( p, end, width );
+		else p = end - p >= (ptrdiff_t)width * 4 ? p + width * 4 : 0;
+		if (!p) return 0;
+	}
+	float* pixels = (float*)MALLOC64( (size_t)width * height * 3 * sizeof( float ) );
+#pragma omp parallel
+	{
+		uchar* rgbe = rle ? (uchar*)MALLOC64( width * 4 ) : 0;
+	#pragma omp for schedule(dynamic, 16)
+		for (int y = 0; y < height; y++)
+		{
+			if (rle) DecodeScanline( line[y], rgbe, width );
+			ConvertScanline( rle ? rgbe : line[y], pixels + (size_t)y * width * 3, width, sqrtValues );
+		}
+		if (rgbe) FREE64( rgbe );
+	}
+	return pixels;
+}
+
+// EOF
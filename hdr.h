@@ -0,0 +1,16 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// Radiance .hdr (RGBE) loader, a faster stbi_loadf for this format. The file
+// is memory-mapped and its scanlines are located in one quick serial pass;
+// then lines are run-length decoded in parallel, and converted to float four
+// channels at a time with SSE. Returns three floats per pixel, allocated with
+// MALLOC64, or 0 if the file can not be read. With 'sqrtValues', the square
+// root of every value is taken in the same pass.
+float* LoadHDR( const char* file, int& width, int& height, const bool sqrtValues = false );
+
+} // namespace Tmpl8
+
+// EOF
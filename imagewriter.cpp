@@ -0,0 +1,194 @@
+#include "precomp.h"
+#include "imagewriter.h"
+
+static bool HasExtension( const char* file, const char* ext )
+{
+	const char* dot = strrchr( file, '.' );
+	return dot && _stricmp( dot, ext ) == 0;
+}
+
+bool ImageWriter::IsFloatFormat( const char* file ) { return HasExtension( file, ".pfm" ) || HasExtension( file, ".exr" ); }
+bool ImageWriter::IsSupported( const char* file ) { return HasExtension( file, ".png" ) || IsFloatFormat( file ); }
+
+ImageWriter::ImageWriter( const int maxPending ) : maxPending( maxPending )
+{
+	worker = thread( &ImageWriter::Worker, this );
+}
+
+ImageWriter::~ImageWriter()
+{
+	{
+		lock_guard<mutex> guard( lock );
+		quit = true;
+	}
+	changed.notify_all();
+	worker.join();
+}
+
+void ImageWriter::Write( const char* file, const int width, const int height, const uint* pixels, const float3* radiance )
+{
+	// copy the frame before queueing it, so the caller can reuse its buffers right away
+	Job job;
+	job.file = file, job.width = width, job.height = height;
+	if (IsFloatFormat( file )) job.radiance.assign( radiance, radiance + width * height );
+	else job.pixels.assign( pixels, pixels + width * height );
+	unique_lock<mutex> guard( lock );
+	changed.wait( guard, [this] { return (int)queue.size() < maxPending; } );
+	queue.push_back( move( job ) );
+	guard.unlock();
+	changed.notify_all();
+}
+
+void ImageWriter::Flush()
+{
+	unique_lock<mutex> guard( lock );
+	changed.wait( guard, [this] { return queue.empty() && !busy; } );
+}
+
+void ImageWriter::Worker()
+{
+	while (1)
+	{
+		unique_lock<mutex> guard( lock );
+		changed.wait( guard, [this] { return quit || !queue.empty(); } );
+		if (queue.empty()) return; // quitting, and nothing left to write
+		Job job = move( queue.front() );
+		queue.pop_front(), busy = 1;
+		guard.unlock();
+		changed.notify_all(); // a slot in the queue became available
+		Timer timer;
+		bool ok;
+		if (HasExtension( job.file.c_str(), ".png" )) ok = SavePNG( job );
+		else if (HasExtension( job.file.c_str(), ".pfm" )) ok = SavePFM( job );
+		else ok = SaveEXR( job );
+		if (!ok) printf( "could not write %s\n", job.file.c_str() );
+		guard.lock();
+		writeSeconds += timer.elapsed(), framesWritten += ok ? 1 : 0, busy = 0;
+		guard.unlock();
+		changed.notify_all();
+	}
+}
+
+// PNG: 8-bit RGB, one IDAT chunk compressed with zlib, 'sub' filter on every line
+
+static void PutU32BE( vector<uchar>& out, const uint v )
+{
+	out.push_back( v >> 24 ), out.push_back( (v >> 16) & 255 ), out.push_back( (v >> 8) & 255 ), out.push_back( v & 255 );
+}
+
+static void PutChunk( vector<uchar>& out, const char* type, const uchar* data, const uint size )
+{
+	PutU32BE( out, size );
+	const size_t start = out.size();
+	out.insert( out.end(), type, type + 4 );
+	out.insert( out.end(), data, data + size );
+	PutU32BE( out, (uint)crc32( 0, out.data() + start, size + 4 ) );
+}
+
+bool ImageWriter::SavePNG( const Job& job )
+{
+	const int w = job.width, h = job.height, stride = w * 3 + 1;
+	vector<uchar> raw( (size_t)stride * h );
+	for (int y = 0; y < h; y++)
+	{
+		uchar* line = raw.data() + (size_t)y * stride;
+		const uint* src = job.pixels.data() + (size_t)y * w;
+		line[0] = 1; // filter: difference with the pixel to the left
+		for (int x = w - 1; x >= 0; x--)
+		{
+			const uint c = src[x], l = x ? src[x - 1] : 0;
+			line[1 + x * 3] = (uchar)((c >> 16) - (l >> 16));
+			line[2 + x * 3] = (uchar)((c >> 8) - (l >> 8));
+			line[3 + x * 3] = (uchar)(c - l);
+		}
+	}
+	uLongf packedSize = compressBound( (uLong)raw.size() );
+	vector<uchar> packed( packedSize );
+	if (compress2( packed.data(), &packedSize, raw.data(), (uLong)raw.size(), Z_DEFAULT_COMPRESSION ) != Z_OK) return false;
+	vector<uchar> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uchar header[13] = { 0 };
+	header[0] = w >> 24, header[1] = (w >> 16) & 255, header[2] = (w >> 8) & 255, header[3] = w & 255;
+	header[4] = h >> 24, header[5] = (h >> 16) & 255, header[6] = (h >> 8) & 255, header[7] = h & 255;
+	header[8] = 8, header[9] = 2; // 8 bits per channel, RGB
+	PutChunk( png, "IHDR", header, 13 );
+	PutChunk( png, "IDAT", packed.data(), (uint)packedSize );
+	PutChunk( png, "IEND", 0, 0 );
+	FILE* f = fopen( job.file.c_str(), "wb" );
+	if (!f) return false;
+	const bool ok = fwrite( png.data(), 1, png.size(), f ) == png.size();
+	fclose( f );
+	return ok;
+}
+
+// PFM: little-endian float RGB, lines stored bottom to top
+
+bool ImageWriter::SavePFM( const Job& job )
+{
+	FILE* f = fopen( job.file.c_str(), "wb" );
+	if (!f) return false;
+	fprintf( f, "PF\n%i %i\n-1.0\n", job.width, job.height );
+	bool ok = true;
+	for (int y = job.height - 1; y >= 0; y--)
+		ok &= fwrite( job.radiance.data() + (size_t)y * job.width, sizeof( float3 ), job.width, f ) == (size_t)job.width;
+	fclose( f );
+	return ok;
+}
+
+// OpenEXR: uncompressed scanlines, 32-bit float B, G, R channels; see
+// "The OpenEXR File Layout", openexr.com. Values are little-endian, like x86.
+
+template <class T> static void Put( vector<uchar>& out, const T& v )
+{
+	out.insert( out.end(), (const uchar*)&v, (const uchar*)&v + sizeof( T ) );
+}
+
+static void PutAttribute( vector<uchar>& out, const char* name, const char* type, const uint size )
+{
+	out.insert( out.end(), name, name + strlen( name ) + 1 );
+	out.insert( out.end(), type, type + strlen( type ) + 1 );
+	Put( out, size );
+}
+
+bool ImageWriter::SaveEXR( const Job& job )
+{
+	const int w = job.width, h = job.height;
+	vector<uchar> exr = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 }; // magic, version 2, single part scanline
+	PutAttribute( exr, "channels", "chlist", 3 * 18 + 1 );
+	for (const char* name : { "B", "G", "R" })
+	{
+		exr.push_back( name[0] ), exr.push_back( 0 );
+		Put( exr, 2 ); // pixel type: float
+		Put( exr, 0 ); // pLinear and reserved
+		Put( exr, 1 ), Put( exr, 1 ); // x and y sampling
+	}
+	exr.push_back( 0 );
+	PutAttribute( exr, "compression", "compression", 1 ), exr.push_back( 0 ); // none
+	const int window[4] = { 0, 0, w - 1, h - 1 };
+	PutAttribute( exr, "dataWindow", "box2i", 16 ), Put( exr, window );
+	PutAttribute( exr, "displayWindow", "box2i", 16 ), Put( exr, window );
+	PutAttribute( exr, "lineOrder", "lineOrder", 1 ), exr.push_back( 0 ); // increasing y
+	PutAttribute( exr, "pixelAspectRatio", "float", 4 ), Put( exr, 1.0f );
+	PutAttribute( exr, "screenWindowCenter", "v2f", 8 ), Put( exr, 0.0f ), Put( exr, 0.0f );
+	PutAttribute( exr, "screenWindowWidth", "float", 4 ), Put( exr, 1.0f );
+	exr.push_back( 0 ); // end of header
+	// line offset table, then one chunk per line: y, byte count, and the channels one after another
+	const uint lineBytes = w * 3 * sizeof( float );
+	const uint64_t firstLine = exr.size() + h * sizeof( uint64_t );
+	for (int y = 0; y < h; y++) Put( exr, firstLine + (uint64_t)y * (8 + lineBytes) );
+	exr.reserve( exr.size() + (size_t)h * (8 + lineBytes) );
+	for (int y = 0; y < h; y++)
+	{
+		Put( exr, y ), Put( exr, lineBytes );
+		const float3* src = job.radiance.data() + (size_t)y * w;
+		for (int x = 0; x < w; x++) Put( exr, src[x].z );
+		for (int x = 0; x < w; x++) Put( exr, src[x].y );
+		for (int x = 0; x < w; x++) Put( exr, src[x].x );
+	}
+	FILE* f = fopen( job.file.c_str(), "wb" );
+	if (!f) return false;
+	const bool ok = fwrite( exr.data(), 1, exr.size(), f ) == exr.size();
+	fclose( f );
+	return ok;
+}
+
+// EOF
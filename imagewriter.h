@@ -0,0 +1,45 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// writes frames to disk on a background thread, so the renderer can start on the
+// next frame while the previous one is compressed and saved. The format follows
+// the file extension: .png (8-bit, tonemapped pixels), .pfm or .exr (32-bit float,
+// linear radiance). Write copies the data; it blocks only when 'maxPending' frames
+// are already queued, which bounds memory use when the disk is the bottleneck.
+class ImageWriter
+{
+public:
+	ImageWriter( const int maxPending = 2 );
+	~ImageWriter(); // writes the remaining frames
+	void Write( const char* file, const int width, const int height, const uint* pixels, const float3* radiance );
+	void Flush();
+	static bool IsFloatFormat( const char* file );
+	static bool IsSupported( const char* file );
+	// statistics, for reporting
+	float writeSeconds = 0;	// total time spent writing on the I/O thread
+	int framesWritten = 0;
+private:
+	struct Job
+	{
+		string file;
+		int width, height;
+		vector<uint> pixels;
+		vector<float3> radiance;
+	};
+	void Worker();
+	static bool SavePNG( const Job& job );
+	static bool SavePFM( const Job& job );
+	static bool SaveEXR( const Job& job );
+	list<Job> queue;
+	mutex lock;
+	condition_variable changed;
+	thread worker;
+	int maxPending, busy = 0;
+	bool quit = false;
+};
+
+} // namespace Tmpl8
+
+// EOF
@@ -0,0 +1,35 @@
+#pragma once
+
+// instruction set levels for the BVH kernels. SSE2 is the minimum: it is part
+// of x64, so there is no scalar fallback. MSVC has no /arch for SSE4.1; that
+// level is built with /arch:SSE2 and only its intrinsics use SSE4.1.
+#define ISA_SSE2	0
+#define ISA_SSE41	1
+#define ISA_AVX2	2
+#define ISA_AVX512	3
+
+// uncomment to override CPU detection, e.g. to compare levels on one machine
+// #define FORCE_ISA ISA_SSE2
+
+namespace Tmpl8
+{
+
+// BVH traversal and build kernels. bvh_isa.h is compiled once for each
+// instruction set level (bvh_sse2.cpp .. bvh_avx512.cpp, each with its own
+// /arch setting); at startup the best table for the CPU becomes activeISA.
+struct ISAKernels
+{
+	const char* name;
+	void (*Intersect)( BVH& bvh, Ray& ray, uint instanceIdx, RayCounter* counter );
+	void (*IntersectTriBlocks)( Ray& ray, const TriBlock* block, const uint blockCount, const uint instBits );
+	float (*FindBestSplitPlane)( BVH& bvh, BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax );
+	void (*UpdateNodeBounds)( BVH& bvh, uint nodeIdx, float3& centroidMin, float3& centroidMax );
+	int (*FindNearest)( KDTree& tree, uint A, uint& startB, float& startSA );
+	void (*FindNearestBatch)( KDTree& tree, const uint* A, const uint count, uint* bestB, float* bestSA );
+};
+extern const ISAKernels isaSSE2, isaSSE41, isaAVX2, isaAVX512;
+extern const ISAKernels* activeISA;
+
+} // namespace Tmpl8
+
+// EOF
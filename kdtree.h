@@ -21,22 +21,45 @@ public:
 		uint t = tlasIdx[a]; tlasIdx[a] = tlasIdx[b]; tlasIdx[b] = t;
 	}
 	KDTree() = default;
-	KDTree( TLASNode* tlasNodes, const uint N, const uint O )
+	KDTree( TLASNode* tlasNodes, const uint N, const uint O, Arena* arena, const uint maxN = 0 )
 	{
-		// allocate space for nodes and indices
+		// allocate space for nodes and indices, for up to maxN TLAS nodes, so
+		// that reset can reuse the tree for ranges of another size
+		capacity = max( N, maxN );
+		const uint C = capacity;
+		leaf = arena->Alloc<uint>( C );		// leaf node of each tlas, by index in this tree
+		node = arena->Alloc<KDNode>( C * 2 ); // pre-allocate kdtree nodes, aligned
+		tlasIdx = arena->Alloc<uint>( C * 2 + 64 ); // tlas array indirection so we can store ranges of nodes in leaves
+		freeNode = arena->Alloc<uint>( C * 2 );	// nodes released by removeLeaf, claimed by add
+		dirty = arena->Alloc<uchar>( C * 2 );	// nodes that batchRefit must update
+		bucket = arena->Alloc<uint>( C * 2 + 1 ); // counting sort of the batch queries by leaf
+		sorted = arena->Alloc<uint>( C );
+		reset( tlasNodes, N, O );
+	}
+	static size_t ArenaBytes( const uint maxN )
+	{
+		// arena space the constructor claims for up to maxN TLAS nodes; keep in
+		// sync with the allocations above. The arena pads each one to a cacheline
+		const size_t C = maxN;
+		auto line = []( const size_t bytes ) { return (bytes + 63) & ~(size_t)63; };
+		return line( sizeof( uint ) * C ) + line( sizeof( KDNode ) * C * 2 ) + line( sizeof( uint ) * (C * 2 + 64) ) +
+			line( sizeof( uint ) * C * 2 ) + line( C * 2 ) + line( sizeof( uint ) * (C * 2 + 1) ) + line( sizeof( uint ) * C );
+	}
+	void reset( TLASNode* tlasNodes, const uint N, const uint O )
+	{
+		FATALERROR_IF( N > capacity, "kD-tree for %i TLAS nodes has room for %i.", N, capacity );
 		tlas = tlasNodes;			// copy of the original array of tlas nodes
-		blasCount = N;				// blasCount remains constant
+		blasCount = N;				// blasCount remains constant until the next reset
 		tlasCount = N;				// tlasCount will grow during aggl. clustering
 		offset = O;					// index of the first TLAS node in the array
-		if (!leaf) leaf = new uint[100000];
-		node = (KDNode*)_aligned_malloc( sizeof( KDNode ) * N * 2, 64 ); // pre-allocate kdtree nodes, aligned
-		tlasIdx = new uint[N * 2 + 64]; // tlas array indirection so we can store ranges of nodes in leaves
 	}
 	void rebuild()
 	{
 		// we'll assume we get the same number of TLAS nodes each time
 		tlasCount = blasCount;
 		for (uint i = 0; i < blasCount; i++) tlasIdx[i] = i;
+		freeCount = 0;
+		memset( dirty, 0, blasCount * 2 );
 		// subdivide root node
 		node[0].first = 0, node[0].count = blasCount, node[0].parax = 7;
 		nodePtr = 1;				// root = 0, so node 1 is the first node we can create
@@ -48,13 +71,37 @@ public:
 			for (uint j = 0; j < node[i].count; j++)
 			{
 				uint idx = tlasIdx[node[i].first + j];
-				leaf[idx + offset] = i;	// we can find tlas[idx] in leaf node[i]
+				leaf[idx] = i;			// we can find tlas[idx] in leaf node[i]
 				float3 tlSize = 0.5f * (tlas[idx].aabbMax - tlas[idx].aabbMin);
 				node[i].minSize = fminf( node[i].minSize, tlSize );
 			}
 		}
 		else node[i].minSize = fminf( node[node[i].left].minSize, node[node[i].right].minSize );
 	}
+	void markDirty( uint idx )
+	{
+		// flag a node and its ancestors for batchRefit; a flagged node has flagged ancestors
+		while (!dirty[idx])
+		{
+			dirty[idx] = 1;
+			if (idx == 0) break;
+			idx = node[idx].parax >> 3;
+		}
+	}
+	void batchRefit( uint idx = 0 )
+	{
+		// refit the flagged nodes, children first; after a batch of add( idx, false )
+		// calls this visits each changed node once, where recurseRefit would visit
+		// the shared ancestors once per added leaf
+		if (!dirty[idx]) return;
+		dirty[idx] = 0;
+		KDNode& n = node[idx];
+		if (n.isLeaf()) return;
+		batchRefit( n.left ), batchRefit( n.right );
+		n.minSize = fminf( node[n.left].minSize, node[n.right].minSize );
+		n.bmin = fminf( node[n.left].bmin, node[n.right].bmin );
+		n.bmax = fmaxf( node[n.left].bmax, node[n.right].bmax );
+	}
 	void recurseRefit( uint idx )
 	{
 		while (1)
@@ -124,7 +171,7 @@ public:
 		left.parax = right.parax = (((uint)(&node - this->node)) << 3) + 7;
 		right.count = N - left.count;
 	}
-	void add( uint idx )
+	void add( uint idx, const bool refit = true )
 	{
 		// capture bounds of new node
 		idx -= offset;
@@ -133,14 +180,13 @@ public:
 		float3 C = (newTLAS.aabbMin + newTLAS.aabbMax) * 0.5f;
 		tlasIdx[tlasCount++] = idx;
 		// claim a new KDNode for the tlas and make it a leaf
-		uint leafIdx, intIdx, nidx;
-		KDNode& leafNode = node[leafIdx = freed[0]];
-		leaf[idx + offset] = leafIdx;
+		uint leafIdx = freeNode[--freeCount], intIdx = freeNode[--freeCount], nidx;
+		dirty[leafIdx] = dirty[intIdx] = 0; // stale flags of released nodes
+		KDNode& leafNode = node[leafIdx];
+		leaf[idx] = leafIdx;
 		leafNode.first = tlasCount - 1, leafNode.count = 1;
 		leafNode.bmin = leafNode.bmax = C;
 		leafNode.minSize = 0.5f * (newTLAS.aabbMax - newTLAS.aabbMin);
-		// we'll also need a new interior node
-		intIdx = freed[1];
 		// see where we should insert it
 		float3 P = (newTLAS.aabbMin + newTLAS.aabbMax) * 0.5f;
 		KDNode* n = &node[nidx = 0];
@@ -156,7 +202,7 @@ public:
 				Pn = (node[intIdx].bmin + node[intIdx].bmax) * 0.5f;
 				// and finally, redirect leaf entries for old root
 				for (uint j = 0; j < node[intIdx].count; j++)
-					leaf[tlasIdx[node[intIdx].first + j] + offset] = intIdx;
+					leaf[tlasIdx[node[intIdx].first + j]] = intIdx;
 				// put the new leaf and n in the correct fields
 				nidx = intIdx, intIdx = 0, node[intIdx].parax = 0;
 			}
@@ -183,20 +229,20 @@ public:
 		}
 		else // traverse
 			n = &node[nidx = ((P[n->parax & 7] < n->splitPos) ? n->left : n->right)];
-		// refit
-		recurseRefit( leaf[idx + offset] );
+		// refit now, or flag the path for batchRefit
+		if (refit) recurseRefit( leaf[idx] ); else markDirty( leaf[idx] );
 	}
 	void removeLeaf( uint idx )
 	{
 		// determine which node to delete for tlas[idx]: must be a leaf
-		uint toDelete = leaf[idx];
 		idx -= offset;
+		uint toDelete = leaf[idx];
 		if (node[toDelete].count > 1) // special case: multiple TLASes in one node, rare
 		{
 			KDNode& n = node[toDelete];
 			for (uint j = 0; j < n.count; j++) if (tlasIdx[n.first + j] == idx)
 				tlasIdx[n.first + j] = tlasIdx[n.first + n.count-- - 1];
-			freed[0] = nodePtr++, freed[1] = nodePtr++;
+			freeNode[freeCount++] = nodePtr++, freeNode[freeCount++] = nodePtr++;
 			return;
 		}
 		uint parentIdx = node[toDelete].parax >> 3;
@@ -206,95 +252,25 @@ public:
 		parent = node[sibling]; // by value, but rather elegant
 		if (parent.isLeaf()) // redirect leaf entries if the sibling is a leaf
 			for (uint j = 0; j < parent.count; j++)
-				leaf[tlasIdx[parent.first + j] + offset] = parentIdx;
+				leaf[tlasIdx[parent.first + j]] = parentIdx;
 		else // make sure child nodes point to the new index
 			node[parent.left].parax = (parentIdx << 3) + (node[parent.left].parax & 7),
 			node[parent.right].parax = (parentIdx << 3) + (node[parent.right].parax & 7);
-		freed[0] = sibling, freed[1] = toDelete;
-	}
-	int FindNearest( uint A, uint& startB, float& startSA )
-	{
-		// keep all hot data together
-		A -= offset;
-		__declspec(align(64)) struct TravState
-		{
-			__m128 Pa4, tlasAbmin4, tlasAbmax4;
-			uint n, stackPtr, bestB;
-			float smallestSA; // exactly one cacheline
-		} state;
-		uint stack[60];
-		uint& n = state.n, & stackPtr = state.stackPtr, & bestB = state.bestB;
-		float& smallestSA = state.smallestSA;
-		n = 0, stackPtr = 0, smallestSA = startSA, bestB = startB - offset;
-		// gather data for node A
-		__m128& tlasAbmin4 = state.tlasAbmin4;
-		__m128& tlasAbmax4 = state.tlasAbmax4;
-		tlasAbmin4 = _mm_setr_ps( tlas[A].aabbMin.x, tlas[A].aabbMin.y, tlas[A].aabbMin.z, 0 );
-		tlasAbmax4 = _mm_setr_ps( tlas[A].aabbMax.x, tlas[A].aabbMin.y, tlas[A].aabbMin.z, 0 );
-		float3 tlasAbmin = *(float3*)&state.tlasAbmin4;
-		float3 tlasAbmax = *(float3*)&state.tlasAbmax4;
-		__m128& Pa4 = state.Pa4;
-		Pa4 = _mm_mul_ps( _mm_set_ps1( 0.5f ), _mm_add_ps( tlasAbmin4, tlasAbmax4 ) );
-		const __m128 half4 = _mm_set_ps1( 0.5f );
-		const __m128 extentA4 = _mm_sub_ps( tlasAbmax4, tlasAbmin4 );
-		const __m128 halfExtentA4 = _mm_mul_ps( half4, _mm_sub_ps( tlasAbmax4, tlasAbmin4 ) );
-		const __m128 tmp4 = _mm_setr_ps( -1, -1, -1, 1 );
-		const __m128 xyzMask4 = _mm_cmple_ps( tmp4, _mm_setzero_ps() );
-		// walk the tree
-		while (1)
-		{
-			while (1)
-			{
-				if (node[n].isLeaf())
-				{
-					// loop over the BLASes stored in this leaf
-					for (uint i = 0; i < node[n].count; i++)
-					{
-						uint B = tlasIdx[node[n].first + i];
-						if (B == A) continue;
-						// calculate surface area of union of A and B
-					#if 0
-						// scalar version
-						const float3 size = fmaxf( tlasAbmax, tlas[B].aabbMax ) - fminf( tlasAbmin, tlas[B].aabbMin );
-						const float SA = size.x * size.y + size.y * size.z + size.z * size.x;
-					#else
-						// SSE version
-						const __m128 bbmin4 = _mm_and_ps( tlas[B].aabbMin4, xyzMask4 );
-						const __m128 bbmax4 = _mm_and_ps( tlas[B].aabbMax4, xyzMask4 );
-						const __m128 size4 = _mm_sub_ps( _mm_max_ps( tlasAbmax4, bbmax4 ), _mm_min_ps( tlasAbmin4, bbmin4 ) );
-						const float SA = size4.m128_f32[0] * size4.m128_f32[1] + size4.m128_f32[1] * size4.m128_f32[2] +
-							size4.m128_f32[2] * size4.m128_f32[0];
-					#endif
-						if (SA < smallestSA) smallestSA = SA, bestB = B;
-					}
-					break;
-				}
-				// consider recursing into branches, sorted by distance
-				uint t, nearNode = node[n].left, farNode = node[n].right;
-				if (Pa4.m128_f32[node[n].parax & 7] > node[n].splitPos) t = nearNode, nearNode = farNode, farNode = t;
-				const __m128 v0a = _mm_max_ps( _mm_sub_ps( node[nearNode].bmin4, Pa4 ), _mm_sub_ps( Pa4, node[nearNode].bmax4 ) );
-				const __m128 v0b = _mm_max_ps( _mm_sub_ps( node[farNode].bmin4, Pa4 ), _mm_sub_ps( Pa4, node[farNode].bmax4 ) );
-				const __m128 d4a = _mm_max_ps( extentA4, _mm_sub_ps( v0a, _mm_add_ps( node[nearNode].minSize4, halfExtentA4 ) ) );
-				const __m128 d4b = _mm_max_ps( extentA4, _mm_sub_ps( v0b, _mm_add_ps( node[farNode].minSize4, halfExtentA4 ) ) );
-				const float sa1 = d4a.m128_f32[0] * d4a.m128_f32[1] + d4a.m128_f32[1] * d4a.m128_f32[2] + d4a.m128_f32[2] * d4a.m128_f32[0];
-				const float sa2 = d4b.m128_f32[0] * d4b.m128_f32[1] + d4b.m128_f32[1] * d4b.m128_f32[2] + d4b.m128_f32[2] * d4b.m128_f32[0];
-				const float diff1 = sa1 - smallestSA, diff2 = sa2 - smallestSA;
-				const uint visit = (diff1 < 0) * 2 + (diff2 < 0);
-				if (!visit) break;
-				if (visit == 3) stack[stackPtr++] = farNode, n = nearNode;
-				else if (visit == 2) n = nearNode; else n = farNode;
-			}
-			if (stackPtr == 0) break;
-			n = stack[--stackPtr];
-		}
-		// all done; return best match
-		startB = bestB + offset;
-		startSA = smallestSA;
-		return bestB + offset;
+		freeNode[freeCount++] = sibling, freeNode[freeCount++] = toDelete;
 	}
+	// find the TLAS node that forms the smallest union with A; see bvh_isa.h
+	int FindNearest( uint A, uint& startB, float& startSA );
+	// the same for 'count' nodes, in SIMD groups of four, on all threads if 'threaded'.
+	// A is put in leaf order first; bestB and bestSA follow that order, and each
+	// search starts from startB = A, startSA = 1e30
+	void FindNearest( uint* A, const uint count, uint* bestB, float* bestSA, const bool threaded = true );
 	// data
 	KDNode* node = 0;
 	TLASNode* tlas = 0;
-	uint* tlasIdx = 0, nodePtr = 1, tlasCount = 0, blasCount = 0, offset = 0, freed[2] = { 0, 0 };
-	inline static uint* leaf = 0; // will be shared between trees
+	uint* tlasIdx = 0, nodePtr = 1, tlasCount = 0, blasCount = 0, offset = 0, capacity = 0;
+	// released nodes; a tree has its own list, so trees can be updated on separate threads
+	uint* freeNode = 0, freeCount = 0;
+	uchar* dirty = 0;
+	uint* leaf = 0;				// per tree, like node and tlasIdx; trees share no state
+	uint* bucket = 0, * sorted = 0;	// scratch for the batch FindNearest
 };
\ No newline at end of file
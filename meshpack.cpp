@@ -0,0 +1,359 @@
+#include "precomp.h"
+#include "bvh.h"
+#include "meshpack.h"
+#include "texture.h"
+
+#define PACK_MAGIC 0x4b41504d // "MPAK"
+#define PACK_VERSION 2 // 2: the chunks the BVH needs come before the TriEx chunks
+#define PACK_CHUNK 16384 // elements per chunk
+
+// chunk contents; vertices are stored as nine floats, without the centroid
+enum { CHUNK_VERTEX = 0, CHUNK_TRIEX, CHUNK_BVHNODE, CHUNK_TRIIDX };
+static const uint elementSize[4] = { 9 * sizeof( float ), sizeof( TriEx ), sizeof( BVHNode ), sizeof( uint ) };
+
+struct PackHeader
+{
+	uint magic, version, triCount, nodesUsed; // nodesUsed is 0 if the BVH is not stored
+	uint chunkCount, hasTriEx, triExSize, nodeSize;
+};
+
+struct PackChunk { uint type, codec, first, count, packedBytes; };
+
+// loads and inflates chunks on its own thread, at most 'depth' ahead of the
+// consumer, so memory use stays bounded for any file size
+class ChunkReader
+{
+public:
+	struct Chunk { uint type = 0, first = 0, count = 0, packedBytes = 0; vector<uchar> data; bool valid = false; };
+	ChunkReader( FILE* f, const uint chunkCount, const int depth ) : file( f ), chunkCount( chunkCount ), depth( depth )
+	{
+		worker = thread( &ChunkReader::Worker, this );
+	}
+	~ChunkReader()
+	{
+		{
+			lock_guard<mutex> guard( lock );
+			quit = true;
+		}
+		changed.notify_all();
+		worker.join();
+	}
+	bool Next( Chunk& chunk )
+	{
+		// false after the last chunk, or for a chunk that could not be read
+		unique_lock<mutex> guard( lock );
+		changed.wait( guard, [this] { return !queue.empty() || done; } );
+		if (queue.empty()) return false;
+		chunk = move( queue.front() );
+		queue.pop_front();
+		guard.unlock();
+		changed.notify_all();
+		return chunk.valid;
+	}
+	float inflateSeconds = 0;
+	size_t bytesRead = 0;
+private:
+	void Worker()
+	{
+		for (uint i = 0; i < chunkCount; i++)
+		{
+			{
+				unique_lock<mutex> guard( lock );
+				changed.wait( guard, [this] { return quit || (int)queue.size() < depth; } );
+				if (quit) break;
+			}
+			Timer timer;
+			Chunk chunk = Read();
+			const bool valid = chunk.valid;
+			{
+				lock_guard<mutex> guard( lock );
+				inflateSeconds += timer.elapsed(), bytesRead += sizeof( PackChunk ) + chunk.packedBytes;
+				queue.push_back( move( chunk ) );
+			}
+			changed.notify_all();
+			if (!valid) break;
+		}
+		{
+			lock_guard<mutex> guard( lock );
+			done = true;
+		}
+		changed.notify_all();
+	}
+	Chunk Read()
+	{
+		Chunk chunk;
+		PackChunk h;
+		if (fread( &h, sizeof( h ), 1, file ) != 1 || h.type > CHUNK_TRIIDX || h.count > PACK_CHUNK) return chunk;
+		const uLong rawBytes = h.count * elementSize[h.type];
+		vector<uchar> packed( h.packedBytes );
+		if (h.packedBytes && fread( packed.data(), h.packedBytes, 1, file ) != 1) return chunk;
+		chunk.type = h.type, chunk.first = h.first, chunk.count = h.count, chunk.packedBytes = h.packedBytes;
+		if (h.codec == PACK_STORED) chunk.data = move( packed ), chunk.valid = h.packedBytes == rawBytes;
+		else if (h.codec == PACK_ZLIB)
+		{
+			uLongf size = rawBytes;
+			chunk.data.resize( rawBytes );
+			chunk.valid = uncompress( chunk.data.data(), &size, packed.data(), h.packedBytes ) == Z_OK && size == rawBytes;
+		}
+		return chunk;
+	}
+	FILE* file;
+	uint chunkCount;
+	int depth;
+	list<Chunk> queue;
+	mutex lock;
+	condition_variable changed;
+	thread worker;
+	bool quit = false, done = false;
+};
+
+static void FreeBVH( BVH* bvh )
+{
+	// a BVH built on the heap, by its constructor or by LoadMeshPack
+	if (!bvh) return;
+	_aligned_free( bvh->bvhNode ), delete[] bvh->triIdx, delete[] bvh->leafBlock, FREE64( bvh->triBlock );
+	delete bvh;
+}
+
+static void FreeMesh( Mesh* mesh )
+{
+	// for meshes from LoadMeshPack only; the OBJ loader allocates differently
+	FreeBVH( mesh->bvh );
+	FREE64( mesh->tri ), FREE64( mesh->triEx );
+	delete mesh;
+}
+
+bool Tmpl8::SaveMeshPack( const char* file, Mesh& mesh, const bool withBVH, const int codec, const int level )
+{
+	const uint N = mesh.triCount;
+	vector<float> vertices( (size_t)N * 9 );
+	for (uint i = 0; i < N; i++)
+		memcpy( &vertices[i * 9], &mesh.tri[i].vertex0, 12 ),
+		memcpy( &vertices[i * 9 + 3], &mesh.tri[i].vertex1, 12 ),
+		memcpy( &vertices[i * 9 + 6], &mesh.tri[i].vertex2, 12 );
+	const uchar* source[4] = { (uchar*)vertices.data(), (uchar*)mesh.triEx, withBVH ? (uchar*)mesh.bvh->bvhNode : 0, withBVH ? (uchar*)mesh.bvh->triIdx : 0 };
+	const uint count[4] = { N, mesh.triEx ? N : 0, withBVH ? mesh.bvh->nodesUsed : 0, withBVH ? N : 0 };
+	struct Job { PackChunk header; vector<uchar> data; };
+	vector<Job> jobs;
+	// everything the BVH needs comes first, so the loader can build it while the
+	// TriEx chunks are still being inflated
+	const uint order[4] = { CHUNK_VERTEX, CHUNK_BVHNODE, CHUNK_TRIIDX, CHUNK_TRIEX };
+	for (uint type : order) for (uint first = 0; first < count[type]; first += PACK_CHUNK)
+	{
+		Job job;
+		job.header = { type, (uint)codec, first, min( (uint)PACK_CHUNK, count[type] - first ), 0 };
+		jobs.push_back( job );
+	}
+	// chunks are independent, so they compress in parallel
+	int failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+	for (int i = 0; i < (int)jobs.size(); i++)
+	{
+		Job& job = jobs[i];
+		const uchar* raw = source[job.header.type] + (size_t)job.header.first * elementSize[job.header.type];
+		const uLong rawBytes = job.header.count * elementSize[job.header.type];
+		if (codec == PACK_STORED) job.data.assign( raw, raw + rawBytes );
+		else
+		{
+			uLongf packedBytes = compressBound( rawBytes );
+			job.data.resize( packedBytes );
+			if (compress2( job.data.data(), &packedBytes, raw, rawBytes, level ) != Z_OK) failed++;
+			job.data.resize( packedBytes );
+		}
+		job.header.packedBytes = (uint)job.data.size();
+	}
+	if (failed) return false;
+	FILE* f = fopen( file, "wb" );
+	if (!f) return false;
+	const PackHeader header = { PACK_MAGIC, PACK_VERSION, N, withBVH ? mesh.bvh->nodesUsed : 0,
+		(uint)jobs.size(), mesh.triEx ? 1u : 0u, sizeof( TriEx ), sizeof( BVHNode ) };
+	bool written = fwrite( &header, sizeof( header ), 1, f ) == 1;
+	for (size_t i = 0; i < jobs.size() && written; i++)
+		written = fwrite( &jobs[i].header, sizeof( PackChunk ), 1, f ) == 1 &&
+			(jobs[i].data.empty() || fwrite( jobs[i].data.data(), jobs[i].data.size(), 1, f ) == 1);
+	fclose( f );
+	return written;
+}
+
+Mesh* Tmpl8::LoadMeshPack( const char* file, MeshPackStats* stats )
+{
+	Timer timer;
+	FILE* f = fopen( file, "rb" );
+	if (!f) return 0;
+	PackHeader header;
+	if (fread( &header, sizeof( header ), 1, f ) != 1 || header.magic != PACK_MAGIC || header.version != PACK_VERSION ||
+		header.triExSize != sizeof( TriEx ) || header.nodeSize != sizeof( BVHNode ) || header.nodesUsed > header.triCount * 2)
+	{
+		fclose( f );
+		return 0;
+	}
+	const uint N = header.triCount;
+	Mesh* mesh = new Mesh();
+	mesh->triCount = N;
+	mesh->tri = (Tri*)MALLOC64( N * sizeof( Tri ) );
+	mesh->triEx = (TriEx*)MALLOC64( N * sizeof( TriEx ) );
+	if (!header.hasTriEx) memset( mesh->triEx, 0, N * sizeof( TriEx ) );
+	BVH* bvh = mesh->bvh = new BVH( mesh, 0, false, false );
+	uchar* destination[4] = { 0, (uchar*)mesh->triEx, (uchar*)bvh->bvhNode, (uchar*)bvh->triIdx };
+	const uint limit[4] = { N, header.hasTriEx ? N : 0, header.nodesUsed, header.nodesUsed ? N : 0 };
+	// convert each chunk while the reader inflates the next one; the BVH needs
+	// only the vertices and, when stored, the nodes and triangle indices, so its
+	// build starts on its own thread once those are in, and overlaps the TriEx
+	// chunks. After that, chunks that the builder reads are rejected.
+	ChunkReader::Chunk chunk;
+	uint received = 0, arrived[4] = {};
+	float waitSeconds = 0, inflateSeconds, buildSeconds = 0;
+	size_t packedBytes;
+	bool valid = true;
+	thread builder;
+	auto BuildReady = [&]() { return arrived[CHUNK_VERTEX] == N && arrived[CHUNK_BVHNODE] == header.nodesUsed && arrived[CHUNK_TRIIDX] == limit[CHUNK_TRIIDX]; };
+	auto StartBuild = [&]()
+	{
+		builder = thread( [&]()
+		{
+			Timer build;
+			if (header.nodesUsed) bvh->nodesUsed = header.nodesUsed, bvh->PackLeaves(); else bvh->Build();
+			buildSeconds = build.elapsed();
+		} );
+	};
+	{
+		ChunkReader reader( f, header.chunkCount, 2 );
+		while (1)
+		{
+			Timer wait;
+			const bool more = reader.Next( chunk );
+			waitSeconds += wait.elapsed();
+			if (!more) break;
+			const uint end = limit[chunk.type];
+			if (chunk.first > end || chunk.count > end - chunk.first || (builder.joinable() && chunk.type != CHUNK_TRIEX)) { valid = false; break; }
+			received++, arrived[chunk.type] += chunk.count;
+			if (chunk.type == CHUNK_VERTEX)
+			{
+				// the parse step: vertices into Tri, with the centroids the BVH builder uses
+				const float* v = (const float*)chunk.data.data();
+				for (uint i = 0; i < chunk.count; i++, v += 9)
+				{
+					Tri& tri = mesh->tri[chunk.first + i];
+					tri.vertex0 = float3( v[0], v[1], v[2] );
+					tri.vertex1 = float3( v[3], v[4], v[5] );
+					tri.vertex2 = float3( v[6], v[7], v[8] );
+					tri.centroid = (tri.vertex0 + tri.vertex1 + tri.vertex2) * 0.3333f;
+				}
+			}
+			else memcpy( destination[chunk.type] + (size_t)chunk.first * elementSize[chunk.type], chunk.data.data(), chunk.data.size() );
+			if (!builder.joinable() && BuildReady()) StartBuild();
+		}
+		inflateSeconds = reader.inflateSeconds, packedBytes = sizeof( header ) + reader.bytesRead;
+	}
+	fclose( f );
+	// an empty mesh has nothing to wait for
+	if (valid && !builder.joinable() && BuildReady()) StartBuild();
+	Timer join;
+	if (builder.joinable()) builder.join(); else valid = false;
+	const float joinSeconds = join.elapsed();
+	if (!valid || received != header.chunkCount || arrived[CHUNK_TRIEX] != limit[CHUNK_TRIEX]) { FreeMesh( mesh ); return 0; }
+	if (stats)
+	{
+		stats->seconds = timer.elapsed(), stats->buildSeconds = buildSeconds, stats->joinSeconds = joinSeconds;
+		stats->inflateSeconds = inflateSeconds, stats->waitSeconds = waitSeconds;
+		stats->rawBytes = (size_t)N * (elementSize[CHUNK_VERTEX] + (header.hasTriEx ? sizeof( TriEx ) : 0));
+		if (header.nodesUsed) stats->rawBytes += header.nodesUsed * sizeof( BVHNode ) + N * sizeof( uint );
+		stats->packedBytes = packedBytes;
+	}
+	return mesh;
+}
+
+static Mesh* LoadTriText( const char* file )
+{
+	// .tri: one triangle per line, as nine floats. Parsed like the OBJ loader
+	// does, with fgets and sscanf
+	FILE* f = fopen( file, "r" );
+	if (!f) return 0;
+	vector<float3> v;
+	char line[512];
+	while (fgets( line, sizeof( line ), f ))
+	{
+		float3 a, b, c;
+		if (sscanf( line, "%f %f %f %f %f %f %f %f %f", &a.x, &a.y, &a.z, &b.x, &b.y, &b.z, &c.x, &c.y, &c.z ) == 9)
+			v.push_back( a ), v.push_back( b ), v.push_back( c );
+	}
+	fclose( f );
+	Mesh* mesh = new Mesh( (uint)v.size() / 3 );
+	for (int i = 0; i < mesh->triCount; i++)
+		mesh->tri[i].vertex0 = v[i * 3], mesh->tri[i].vertex1 = v[i * 3 + 1], mesh->tri[i].vertex2 = v[i * 3 + 2];
+	mesh->bvh = new BVH( mesh );
+	return mesh;
+}
+
+static void FreeTextMesh( Mesh* mesh, const bool obj )
+{
+	// for meshes from the OBJ loader, which uses new[] and loads a texture, and
+	// from LoadTriText, which uses the plain Mesh constructor
+	FreeBVH( mesh->bvh );
+	if (obj) delete[] mesh->tri, delete[] mesh->triEx, delete[] mesh->N, delete[] mesh->P, delete mesh->mipTexture, delete mesh->texture;
+	else _aligned_free( mesh->tri ), _aligned_free( mesh->triEx );
+	delete mesh;
+}
+
+static bool SameMesh( const Mesh& a, const Mesh& b )
+{
+	if (a.triCount != b.triCount || a.bvh->nodesUsed != b.bvh->nodesUsed) return false;
+	for (int i = 0; i < a.triCount; i++)
+	{
+		const Tri& p = a.tri[i], & q = b.tri[i];
+		if (memcmp( &p.vertex0, &q.vertex0, 12 ) || memcmp( &p.vertex1, &q.vertex1, 12 ) || memcmp( &p.vertex2, &q.vertex2, 12 ) || memcmp( &p.centroid, &q.centroid, 12 )) return false;
+	}
+	return !memcmp( a.triEx, b.triEx, a.triCount * sizeof( TriEx ) ) && !memcmp( a.bvh->triIdx, b.bvh->triIdx, a.triCount * sizeof( uint ) ) &&
+		!memcmp( a.bvh->bvhNode, b.bvh->bvhNode, a.bvh->nodesUsed * sizeof( BVHNode ) ) && a.bvh->blocksUsed == b.bvh->blocksUsed &&
+		!memcmp( a.bvh->triBlock, b.bvh->triBlock, a.bvh->blocksUsed * sizeof( TriBlock ) );
+}
+
+void Tmpl8::BenchmarkMeshPack( const char* meshFile )
+{
+	// whitted --packbench <mesh.tri|mesh.obj>: the text baseline parses and builds once;
+	// each pack is loaded three times, and the best time is reported
+	const char* ext = strrchr( meshFile, '.' );
+	const bool obj = ext && _stricmp( ext, ".obj" ) == 0;
+	Timer timer;
+	Mesh* mesh = obj ? new Mesh( meshFile, "assets/bricks.png" ) : LoadTriText( meshFile );
+	const float textTime = timer.elapsed();
+	if (!mesh || mesh->triCount == 0) { printf( "could not load %s\n", meshFile ); if (mesh) FreeTextMesh( mesh, obj ); return; }
+	FILE* f = fopen( meshFile, "rb" );
+	if (!f) { printf( "could not open %s\n", meshFile ); FreeTextMesh( mesh, obj ); return; }
+	fseek( f, 0, SEEK_END );
+	const long textBytes = ftell( f );
+	fclose( f );
+	printf( "%s: %i triangles, %.1fKB of text; parsed and built in %.2fms%s\n",
+		meshFile, mesh->triCount, textBytes / 1024.0f, textTime * 1000, obj ? " (including the texture)" : "" );
+	// not <mesh>.mpk: for the scene mesh, that is the pack WhittedApp::LoadMesh loads
+	char packFile[1024];
+	snprintf( packFile, sizeof( packFile ), "%s.%08x.mpk", meshFile, (uint)chrono::high_resolution_clock::now().time_since_epoch().count() );
+	for (int variant = 0; variant < 4; variant++)
+	{
+		const bool withBVH = variant < 2;
+		const int codec = (variant & 1) ? PACK_ZLIB : PACK_STORED;
+		Timer saveTimer;
+		if (!SaveMeshPack( packFile, *mesh, withBVH, codec )) { printf( "could not write %s\n", packFile ); break; }
+		const float saveTime = saveTimer.elapsed();
+		MeshPackStats best;
+		best.seconds = 1e30f;
+		bool same = true;
+		for (int run = 0; run < 3; run++)
+		{
+			MeshPackStats stats;
+			Mesh* loaded = LoadMeshPack( packFile, &stats );
+			if (!loaded) { same = false; break; }
+			same &= SameMesh( *mesh, *loaded );
+			FreeMesh( loaded );
+			if (stats.seconds < best.seconds) best = stats;
+		}
+		printf( "  %-6s %-9s %8.1fKB (%5.1f%%), saved in %6.2fms; loaded in %6.2fms: inflate %6.2fms, waited %6.2fms, %s %6.2fms (joined after %5.2fms); %s\n",
+			codec == PACK_ZLIB ? "zlib" : "stored", withBVH ? "with BVH" : "mesh only", best.packedBytes / 1024.0f,
+			100.0f * best.packedBytes / max( (size_t)1, best.rawBytes ), saveTime * 1000, best.seconds * 1000, best.inflateSeconds * 1000,
+			best.waitSeconds * 1000, withBVH ? "leaf packing" : "BVH build", best.buildSeconds * 1000, best.joinSeconds * 1000, same ? "identical" : "DIFFERENT" );
+	}
+	RemoveFile( packFile );
+	FreeTextMesh( mesh, obj );
+}
+
+// EOF
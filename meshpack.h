@@ -0,0 +1,37 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// compressed container for a mesh and, optionally, its BVH: a header, then a
+// list of chunks, each an independent zlib stream of up to 16K elements of
+// one array (triangle vertices, BVH nodes, triangle indices, TriEx, in that
+// order). A reader thread loads and inflates chunk N+1 while the caller
+// converts chunk N into the Mesh and BVH. Once the vertices and any stored
+// BVH are in, the BVH build (or, for a stored BVH, the leaf packing) starts
+// on its own thread and overlaps only the remaining TriEx chunks; the caller
+// joins it after the last chunk. The codec is a per-chunk field:
+// PACK_STORED skips zlib, which gives the uncompressed binary baseline.
+#define PACK_STORED 0
+#define PACK_ZLIB 1
+
+struct MeshPackStats
+{
+	float seconds = 0;			// total load time, including a BVH build
+	float inflateSeconds = 0;	// reading and inflating, on the reader thread
+	float waitSeconds = 0;		// time the caller waited for the reader
+	float buildSeconds = 0;		// BVH build or leaf packing, on its own thread
+	float joinSeconds = 0;		// time the caller waited for it after the last chunk
+	size_t packedBytes = 0, rawBytes = 0;
+};
+
+bool SaveMeshPack( const char* file, Mesh& mesh, const bool withBVH, const int codec, const int level = Z_DEFAULT_COMPRESSION );
+Mesh* LoadMeshPack( const char* file, MeshPackStats* stats = 0 );
+
+// load times for a mesh from text, from packs with and without the BVH, and
+// stored versus zlib; also checks that every pack loads to the same data
+void BenchmarkMeshPack( const char* meshFile );
+
+} // namespace Tmpl8
+
+// EOF
@@ -14,6 +14,8 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -411,6 +413,21 @@ string TextFileRead( const char* _File );
 int LineCount( const string s );
 void TextFileWrite( const string& text, const char* _File );
 
+// view of a file in memory; pages are loaded on first access and shared
+// between processes that map the same file. Read-only, unless mapped copy-
+// on-write: then a written page becomes a private copy, and the file is
+// never modified. data is 0 if the file could not be opened or is empty.
+class MappedFile
+{
+public:
+	MappedFile( const char* file, const bool copyOnWrite = false );
+	~MappedFile();
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+	uchar* data = 0;
+	size_t size = 0;
+};
+
 // math
 inline float fminf( float a, float b ) { return a < b ? a : b; }
 inline float fmaxf( float a, float b ) { return a > b ? a : b; }
@@ -1151,7 +1168,7 @@ public:
 	cl_mem* GetDevicePtr() { return &deviceBuffer; }
 	unsigned int* GetHostPtr() { return hostBuffer; }
 	void CopyToDevice( bool blocking = true );
-	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0 );
+	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0, const size_t offset = 0 );
 	void CopyFromDevice( bool blocking = true );
 	void CopyTo( Buffer* buffer );
 	void Clear();
@@ -1162,6 +1179,26 @@ public:
 	bool ownData, aligned;
 };
 
+// OpenCL buffer of fixed-size records that follows a host array which changes
+// a little every frame: Upload compares the array with what the device has and
+// writes only the records that differ, on the second queue, without blocking.
+// Kernels that read the buffer wait for the returned event; it stays valid
+// until the next Upload. The device side must not be in use while writing.
+class MirrorBuffer
+{
+public:
+	MirrorBuffer( const unsigned int stride, const unsigned int capacity );
+	~MirrorBuffer();
+	cl_event Upload( const void* records, const unsigned int count );
+	Buffer* GetBuffer() { return buffer; }
+	// statistics of the last Upload
+	unsigned int recordsSent = 0, writes = 0;
+private:
+	Buffer* buffer;			// the host side is what the device has, once 'pending' completes
+	unsigned int stride, capacity, valid = 0;
+	cl_event pending = 0;	// last write; until it is done, the host side is in use
+};
+
 // OpenCL kernel
 class Kernel
 {
@@ -1457,7 +1494,10 @@ public:
 	virtual void MouseWheel( float y ) = 0;
 	virtual void KeyUp( int key ) = 0;
 	virtual void KeyDown( int key ) = 0;
+	// command line tools; return true to exit without opening a window
+	virtual bool CommandLine( int argc, char** argv ) { return false; }
 	Surface* screen = 0;
+	int scrWidth = SCRWIDTH, scrHeight = SCRHEIGHT; // render resolution; CommandLine may change it
 };
 
 // EOF
\ No newline at end of file
@@ -90,6 +90,14 @@ void main()
 	/* in case you need this in Linux, this is the non-windows way:
 	#include <fenv.h>
 	fesetenv(FE_DFL_DISABLE_SSE_DENORMS_ENV); */
+	// command line tools run without a window; print to the calling console, if any
+	app = CreateApp();
+	if (__argc > 1)
+	{
+		FILE* file = nullptr;
+		if (!GetStdHandle( STD_OUTPUT_HANDLE ) && AttachConsole( ATTACH_PARENT_PROCESS )) freopen_s( &file, "CON", "w", stdout );
+		if (app->CommandLine( __argc, __argv )) { app->Shutdown(); return; }
+	}
 	// open a window
 	if (!glfwInit()) FatalError( "glfwInit failed." );
 	glfwSetErrorCallback( ErrorCallback );
@@ -99,9 +107,9 @@ void main()
 	glfwWindowHint( GLFW_STENCIL_BITS, GL_FALSE );
 	glfwWindowHint( GLFW_RESIZABLE, GL_FALSE /* easier :) */ );
 #ifdef FULLSCREEN
-	window = glfwCreateWindow( SCRWIDTH, SCRHEIGHT, "https://jacco.ompf2.com/author/jbikker", glfwGetPrimaryMonitor(), 0 );
+	window = glfwCreateWindow( app->scrWidth, app->scrHeight, "https://jacco.ompf2.com/author/jbikker", glfwGetPrimaryMonitor(), 0 );
 #else
-	window = glfwCreateWindow( SCRWIDTH, SCRHEIGHT, "https://jacco.ompf2.com/author/jbikker", 0, 0 );
+	window = glfwCreateWindow( app->scrWidth, app->scrHeight, "https://jacco.ompf2.com/author/jbikker", 0, 0 );
 #endif
 	if (!window) FatalError( "glfwCreateWindow failed." );
 	glfwMakeContextCurrent( window );
@@ -140,9 +148,8 @@ void main()
 	glfwShowWindow( window );
 #endif
 	// initialize application
-	InitRenderTarget( SCRWIDTH, SCRHEIGHT );
-	Surface* screen = new Surface( SCRWIDTH, SCRHEIGHT );
-	app = CreateApp();
+	InitRenderTarget( app->scrWidth, app->scrHeight );
+	Surface* screen = new Surface( app->scrWidth, app->scrHeight );
 	app->screen = screen;
 	app->Init();
 	// done, enter main loop
@@ -677,8 +684,9 @@ void Shader::SetUInt( const char* name, const uint v )
 	CheckGL();
 }
 
-// RNG - Marsaglia's xor32
-static uint seed = 0x12345678;
+// RNG - Marsaglia's xor32; one stream per thread, so concurrent use is safe.
+// For reproducible rendering, use the stateless PixelRandom in cl/rng.h.
+static thread_local uint seed = 0x12345678;
 uint RandomUInt()
 {
 	seed ^= seed << 13;
@@ -871,6 +879,25 @@ uint FileSize( string filename )
 	return s.good();
 }
 
+MappedFile::MappedFile( const char* file, const bool copyOnWrite )
+{
+	HANDLE f = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if (f == INVALID_HANDLE_VALUE) return;
+	LARGE_INTEGER fileSize;
+	const DWORD protect = copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY;
+	HANDLE mapping = GetFileSizeEx( f, &fileSize ) && fileSize.QuadPart > 0 ? CreateFileMappingW( f, 0, protect, 0, 0, 0 ) : 0;
+	CloseHandle( f ); // the mapping keeps the file open, and the view keeps the mapping
+	if (!mapping) return;
+	data = (uchar*)MapViewOfFile( mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle( mapping );
+	if (data) size = (size_t)fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) UnmapViewOfFile( data );
+}
+
 string TextFileRead( const char* _File )
 {
 	ifstream s( _File );
@@ -1035,6 +1062,95 @@ static cl_int getPlatformID( cl_platform_id* platform )
 	return CL_SUCCESS;
 }
 
+// program binary cache
+// A built program is stored next to its source, as <file>.bin, with a key over
+// the source and the files it includes, the device, its driver and the build
+// options. A later run with the same key loads the binary instead of compiling.
+// ----------------------------------------------------------------------------
+#define KERNEL_CACHE 1 // 0: always compile from source
+#define KERNEL_CACHE_MAGIC 0x4e49424b // "KBIN"
+struct KernelCacheHeader { uint magic, size; uint64_t key; };
+
+static void HashText( uint64_t& hash, const string& text )
+{
+	for (const char c : text) hash = (hash ^ (uchar)c) * 0x100000001b3ull; // FNV-1a
+}
+
+static void HashIncludes( uint64_t& hash, const string& text, vector<string>& seen )
+{
+	// the CL compiler expands #include "file" itself, relative to the working
+	// directory; includes in inactive #if blocks are hashed as well
+	for (size_t pos = text.find( "#include" ); pos != string::npos; pos = text.find( "#include", pos + 8 ))
+	{
+		const size_t start = text.find( '"', pos ), end = start == string::npos ? start : text.find( '"', start + 1 );
+		if (end == string::npos || start > text.find( '\n', pos )) continue;
+		const string file = text.substr( start + 1, end - start - 1 );
+		if (find( seen.begin(), seen.end(), file ) != seen.end()) continue;
+		const string incText = TextFileRead( file.c_str() );
+		seen.push_back( file );
+		HashText( hash, file ), HashText( hash, incText ), HashIncludes( hash, incText, seen );
+	}
+}
+
+static uint64_t ProgramKey( const string& source, const char* options )
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	vector<string> seen;
+	HashText( hash, source ), HashText( hash, options ), HashIncludes( hash, source, seen );
+	char info[1024];
+	const cl_device_info deviceInfo[3] = { CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION };
+	for (int i = 0; i < 3; i++) if (clGetDeviceInfo( Kernel::GetDevice(), deviceInfo[i], sizeof( info ), info, 0 ) == CL_SUCCESS) HashText( hash, info );
+	cl_platform_id platform;
+	if (clGetDeviceInfo( Kernel::GetDevice(), CL_DEVICE_PLATFORM, sizeof( platform ), &platform, 0 ) == CL_SUCCESS &&
+		clGetPlatformInfo( platform, CL_PLATFORM_VERSION, sizeof( info ), info, 0 ) == CL_SUCCESS) HashText( hash, info );
+	return hash;
+}
+
+static cl_program LoadProgramBinary( const char* file, const uint64_t key, const char* options )
+{
+	char name[1024];
+	snprintf( name, sizeof( name ), "%s.bin", file );
+	FILE* f = fopen( name, "rb" );
+	if (!f) return 0;
+	KernelCacheHeader header;
+	vector<uchar> binary;
+	bool valid = fread( &header, sizeof( header ), 1, f ) == 1 && header.magic == KERNEL_CACHE_MAGIC && header.key == key;
+	if (valid) binary.resize( header.size ), valid = fread( binary.data(), 1, header.size, f ) == header.size;
+	fclose( f );
+	if (!valid) return 0;
+	const uchar* data = binary.data();
+	const size_t size = binary.size();
+	cl_int status, error;
+	cl_program program = clCreateProgramWithBinary( Kernel::GetContext(), 1, &Kernel::GetDevice(), &size, &data, &status, &error );
+	if (error != CL_SUCCESS) return 0;
+	// a driver may still refuse a binary it wrote itself; compile in that case
+	if (status == CL_SUCCESS && clBuildProgram( program, 1, &Kernel::GetDevice(), options, 0, 0 ) == CL_SUCCESS) return program;
+	clReleaseProgram( program );
+	return 0;
+}
+
+static void SaveProgramBinary( cl_program program, const char* file, const uint64_t key )
+{
+	// the context has a single device, so there is one binary
+	size_t size = 0;
+	if (clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, sizeof( size ), &size, 0 ) != CL_SUCCESS || size == 0) return;
+	vector<uchar> binary( size );
+	uchar* data = binary.data();
+	if (clGetProgramInfo( program, CL_PROGRAM_BINARIES, sizeof( data ), &data, 0 ) != CL_SUCCESS) return;
+	// written under a temporary name and then renamed, so that another instance
+	// never loads a partial file
+	char name[1024], tmp[1024];
+	snprintf( name, sizeof( name ), "%s.bin", file );
+	snprintf( tmp, sizeof( tmp ), "%s.%08x", name, (uint)chrono::high_resolution_clock::now().time_since_epoch().count() );
+	FILE* f = fopen( tmp, "wb" );
+	if (!f) return;
+	const KernelCacheHeader header = { KERNEL_CACHE_MAGIC, (uint)size, key };
+	const bool written = fwrite( &header, sizeof( header ), 1, f ) == 1 && fwrite( data, 1, size, f ) == size;
+	fclose( f );
+	RemoveFile( name );
+	if (!written || rename( tmp, name )) RemoveFile( tmp );
+}
+
 // Buffer constructor
 // ----------------------------------------------------------------------------
 Buffer::Buffer( unsigned int N, void* ptr, unsigned int t )
@@ -1087,10 +1203,10 @@ void Buffer::CopyToDevice( bool blocking )
 
 // CopyToDevice2 method (uses 2nd queue)
 // ----------------------------------------------------------------------------
-void Buffer::CopyToDevice2( bool blocking, cl_event* eventToSet, const size_t s )
+void Buffer::CopyToDevice2( bool blocking, cl_event* eventToSet, const size_t s, const size_t offset )
 {
 	cl_int error;
-	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue2(), deviceBuffer, blocking ? CL_TRUE : CL_FALSE, 0, s == 0 ? size : s, hostBuffer, 0, 0, eventToSet ) );
+	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue2(), deviceBuffer, blocking ? CL_TRUE : CL_FALSE, offset, s == 0 ? size - offset : s, (uchar*)hostBuffer + offset, 0, 0, eventToSet ) );
 }
 
 // CopyFromDevice method
@@ -1128,6 +1244,50 @@ void Buffer::Clear()
 #endif
 }
 
+// MirrorBuffer constructor / destructor
+// ----------------------------------------------------------------------------
+MirrorBuffer::MirrorBuffer( const uint stride, const uint capacity ) : stride( stride ), capacity( capacity )
+{
+	buffer = new Buffer( stride * capacity, MALLOC64( stride * capacity ), Buffer::READONLY );
+	buffer->ownData = buffer->aligned = true;
+}
+
+MirrorBuffer::~MirrorBuffer()
+{
+	if (pending) clWaitForEvents( 1, &pending ), clReleaseEvent( pending );
+	delete buffer;
+}
+
+// MirrorBuffer::Upload
+// ----------------------------------------------------------------------------
+#define MIRROR_GAP 4 // unchanged records sent along to join two writes; a write has a fixed cost
+cl_event MirrorBuffer::Upload( const void* records, const uint count )
+{
+	FATALERROR_IF( count > capacity, "MirrorBuffer holds %i records, not %i", capacity, count );
+	// writes read the host side when they execute, not when they are queued
+	if (pending) clWaitForEvents( 1, &pending ), clReleaseEvent( pending ), pending = 0;
+	const uchar* src = (const uchar*)records;
+	uchar* copy = (uchar*)buffer->hostBuffer;
+	auto changed = [&]( const uint i ) { return i >= valid || memcmp( copy + i * stride, src + i * stride, stride ) != 0; };
+	recordsSent = writes = 0;
+	for (uint i = 0; i < count; i++) if (changed( i ))
+	{
+		// extend the run over changed records and small gaps between them
+		uint last = i;
+		for (uint j = i + 1; j < count && j <= last + MIRROR_GAP + 1; j++) if (changed( j )) last = j;
+		const uint n = last - i + 1;
+		memcpy( copy + i * stride, src + i * stride, n * stride );
+		// the queue is in order, so the event of the last write covers all of them
+		if (pending) clReleaseEvent( pending );
+		buffer->CopyToDevice2( false, &pending, n * stride, i * stride );
+		recordsSent += n, writes++, i = last;
+	}
+	valid = max( valid, count );
+	// a kernel on the first queue may wait for this; make sure it gets going
+	if (pending) clFlush( Kernel::GetQueue2() );
+	return pending;
+}
+
 // Kernel constructor
 // ----------------------------------------------------------------------------
 Kernel::Kernel( char* file, char* entryPoint )
@@ -1183,41 +1343,42 @@ Kernel::Kernel( char* file, char* entryPoint )
 		csText = tmp;
 	}
 #endif
-	// attempt to compile the loaded and expanded source text
-	const char* source = csText.c_str();
-	size_t size = strlen( source );
-	cl_int error;
-	program = clCreateProgramWithSource( context, 1, (const char**)&source, &size, &error );
-	CHECKCL( error );
 	// why does the nvidia compiler not support these:
 	// -cl-nv-maxrregcount=64 not faster than leaving it out (same for 128)
 	// -cl-no-subgroup-ifp ? fails on nvidia.
 #if 1
 	// AMD compatible compilation, thanks Jasper the Winther
-	error = clBuildProgram( program, 0, NULL, "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
-
+	const char* options = "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #else
-	error = clBuildProgram( program, 0, NULL, "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
+	const char* options = "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #endif
+	// a binary from an earlier run skips the compiler; see LoadProgramBinary.
+	// The first run reports the cold time, later runs the warm time
+	Timer buildTimer;
+	const uint64_t key = KERNEL_CACHE ? ProgramKey( csText, options ) : 0;
+	const float keyTime = buildTimer.elapsed();
+	program = KERNEL_CACHE ? LoadProgramBinary( file, key, options ) : 0;
+	const bool cached = program != 0;
+	cl_int error = CL_SUCCESS;
+	size_t size;
+	if (!cached)
+	{
+		// attempt to compile the loaded and expanded source text
+		const char* source = csText.c_str();
+		size = strlen( source );
+		program = clCreateProgramWithSource( context, 1, (const char**)&source, &size, &error );
+		CHECKCL( error );
+		error = clBuildProgram( program, 0, NULL, options, NULL, NULL );
+	}
 	// handle errors
 	if (error == CL_SUCCESS)
 	{
-		// dump PTX via: https://forums.developer.nvidia.com/t/pre-compiling-opencl-kernels-tutorial/17089
-		// and: https://stackoverflow.com/questions/12868889/clgetprograminfo-cl-program-binary-sizes-incorrect-results
-		cl_uint devCount;
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_NUM_DEVICES, sizeof( cl_uint ), &devCount, NULL ) );
-		size_t* size = new size_t[devCount];
-		size[0] = 0;
-		size_t received;
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES /* wrong data... */, devCount * sizeof( size_t ), size, &received ) );
-		char** binaries = new char* [devCount];
-		for (uint i = 0; i < devCount; i++)
-			binaries[i] = new char[size[i] + 1];
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_BINARIES, devCount * sizeof( size_t ), binaries, NULL ) );
-		FILE* f = fopen( "buildlog.txt", "wb" );
-		for (uint i = 0; i < devCount; i++)
-			fwrite( binaries[i], 1, size[i] + 1, f );
-		fclose( f );
+		// the binary is PTX on NVIDIA, see: https://forums.developer.nvidia.com/t/pre-compiling-opencl-kernels-tutorial/17089
+		Timer saveTimer;
+		if (!cached && KERNEL_CACHE) SaveProgramBinary( program, file, key );
+		const float saveTime = saveTimer.elapsed(), buildTime = buildTimer.elapsed() - saveTime - keyTime;
+		printf( "%s: %s in %.2fms; cache key %.2fms, writing the cache %.2fms\n", file,
+			cached ? "loaded the cached binary" : "compiled", buildTime * 1000, keyTime * 1000, saveTime * 1000 );
 	}
 	else
 	{
@@ -1339,7 +1500,9 @@ bool Kernel::InitCL()
 				"cl_khr_global_int32_base_atomics"
 			};
 			bool hasAll = true;
-			for (int j = 0; j < 2; j++)
+			// without a window (command line tools), OpenGL sharing is not needed,
+			// so CPU runtimes such as PoCL qualify too
+			for (int j = window ? 0 : 1; j < 2; j++)
 			{
 				size_t o = 0, s = deviceList.find( ' ', o );
 				bool hasFeature = false;
@@ -1355,15 +1518,16 @@ bool Kernel::InitCL()
 			{
 				cl_context_properties props[] =
 				{
-					CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetWGLContext( window ),
+					CL_GL_CONTEXT_KHR, (cl_context_properties)(window ? glfwGetWGLContext( window ) : 0),
 					CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
 					CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0
 				};
+				cl_context_properties headless[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
 				// attempt to create a context with the requested features
-				context = clCreateContext( props, 1, &devices[i], NULL, NULL, &error );
+				context = clCreateContext( window ? props : headless, 1, &devices[i], NULL, NULL, &error );
 				if (error == CL_SUCCESS)
 				{
-					candoInterop = true;
+					candoInterop = window != 0;
 					deviceUsed = i;
 					break;
 				}
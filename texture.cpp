@@ -0,0 +1,140 @@
+#include "precomp.h"
+#include "texture.h"
+
+void MipTexture::Layout( int w, int h )
+{
+	// level sizes; each level halves the previous one, down to a single texel
+	size_t offset[16];
+	while (levels < 16)
+	{
+		Level& l = level[levels];
+		l.width = w, l.height = h, l.blocksX = (w + 3) >> 2;
+		offset[levels++] = bytes / sizeof( uint );
+		bytes += (size_t)l.blocksX * ((h + 3) >> 2) * 64;
+		if (w == 1 && h == 1) break;
+		w = max( 1, w >> 1 ), h = max( 1, h >> 1 );
+	}
+	if (!texels) texels = (uint*)MALLOC64( bytes ), memset( texels, 0, bytes ), ownTexels = true;
+	for (int i = 0; i < levels; i++) level[i].data = texels + offset[i];
+}
+
+MipTexture::MipTexture( const int width, const int height, uint* data )
+{
+	// texels that were built before, e.g. in a mapped scene archive; not owned
+	texels = data;
+	Layout( width, height );
+}
+
+MipTexture::MipTexture( const Surface* src )
+{
+	Layout( src->width, src->height );
+	// level 0 is a copy of the surface; every other level is a 2x2 box filter of
+	// the one above it, which clamps at the last row and column for odd sizes
+	const Level& top = level[0];
+	for (int y = 0; y < top.height; y++) for (int x = 0; x < top.width; x++)
+		top.data[(((y >> 2) * top.blocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3)] = src->pixels[x + y * src->width];
+	for (int i = 1; i < levels; i++)
+	{
+		const Level& up = level[i - 1], & l = level[i];
+	#pragma omp parallel for schedule(static)
+		for (int y = 0; y < l.height; y++) for (int x = 0; x < l.width; x++)
+		{
+			const int x0 = min( x * 2, up.width - 1 ), x1 = min( x * 2 + 1, up.width - 1 );
+			const int y0 = min( y * 2, up.height - 1 ), y1 = min( y * 2 + 1, up.height - 1 );
+			const uint c[4] = { Fetch( up, x0, y0 ), Fetch( up, x1, y0 ), Fetch( up, x0, y1 ), Fetch( up, x1, y1 ) };
+			uint r = 2, g = 2, b = 2; // rounding
+			for (int j = 0; j < 4; j++) r += (c[j] >> 16) & 255, g += (c[j] >> 8) & 255, b += c[j] & 255;
+			l.data[(((y >> 2) * l.blocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3)] = ((r >> 2) << 16) + ((g >> 2) << 8) + (b >> 2);
+		}
+	}
+}
+
+// benchmark: a 32KB direct-mapped cache model stands in for the L1 data cache,
+// which gives the same miss counts on every machine; throughput is measured
+
+struct CacheModel
+{
+	uint64_t tag[512];
+	uint64_t misses = 0;
+	CacheModel() { memset( tag, 255, sizeof( tag ) ); }
+	void Touch( const void* p )
+	{
+		const uint64_t line = (uint64_t)p >> 6;
+		if (tag[line & 511] != line) tag[line & 511] = line, misses++;
+	}
+};
+
+void Tmpl8::BenchmarkTexture( const Surface* src )
+{
+	MipTexture tex( src );
+	const int N = 1 << 22, w = src->width, h = src->height;
+	printf( "texture: %ix%i, %i levels, %.2fMB tiled (%.2fMB row-major level 0)\n",
+		w, h, tex.levels, tex.bytes / 1048576.0f, w * h * 4 / 1048576.0f );
+	// access patterns: a coherent scan at one texel per sample, as primary rays
+	// see it up close, and random positions, as reflected rays see it. The mip
+	// level of each lookup follows from its ray cone, as in WhittedApp::TextureLOD,
+	// for a unit square that carries the whole texture: a coherent sample's cone
+	// is one texel wide; an incoherent ray's cone has travelled 1 to 8 units at
+	// the spread of a 720-line pixel, and meets the square at a random angle
+	float2* uv = new float2[N];
+	float* lod = new float[N];
+	const float texelScale = 0.5f * log2f( (float)w * h ), pixelSpread = 1.0f / 720;
+	const char* patternName[2] = { "coherent", "incoherent" };
+	for (int pattern = 0; pattern < 2; pattern++)
+	{
+		uint seed = 0x12345;
+		float lodSum = 0;
+		for (int i = 0; i < N; i++)
+		{
+			float coneWidth, cosine = 1;
+			if (pattern == 0) uv[i] = float2( ((i % w) + 0.5f) / w, (((i / w) % h) + 0.5f) / h ), coneWidth = 1.0f / max( w, h );
+			else
+			{
+				seed = seed * 1664525 + 1013904223, uv[i].x = (seed >> 8) * (1.0f / 16777216);
+				seed = seed * 1664525 + 1013904223, uv[i].y = (seed >> 8) * (1.0f / 16777216);
+				seed = seed * 1664525 + 1013904223, coneWidth = (1 + 7 * (seed >> 8) * (1.0f / 16777216)) * pixelSpread;
+				seed = seed * 1664525 + 1013904223, cosine = 0.2f + 0.8f * (seed >> 8) * (1.0f / 16777216);
+			}
+			lodSum += lod[i] = texelScale + log2f( coneWidth / cosine );
+		}
+		printf( "  %-10s mean cone LOD %.2f\n", patternName[pattern], lodSum / N );
+		for (int method = 0; method < 3; method++)
+		{
+			// 0: nearest, row-major; 1: bilinear, tiled, level 0; 2: bilinear, tiled, cone LOD
+			CacheModel cache;
+			for (int i = 0; i < N; i++)
+			{
+				if (method == 0)
+				{
+					const int iu = (int)(uv[i].x * w) % w, iv = (int)(uv[i].y * h) % h;
+					cache.Touch( src->pixels + iu + iv * w );
+					continue;
+				}
+				const MipTexture::Level& l = tex.level[method == 1 ? 0 : clamp( (int)(lod[i] + 0.5f), 0, tex.levels - 1 )];
+				const int x = min( (int)(uv[i].x * l.width), l.width - 1 ), y = min( (int)(uv[i].y * l.height), l.height - 1 );
+				const int x1 = (x + 1) % l.width, y1 = (y + 1) % l.height;
+				cache.Touch( &l.data[(((y >> 2) * l.blocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3)] );
+				cache.Touch( &l.data[(((y >> 2) * l.blocksX + (x1 >> 2)) << 4) + ((y & 3) << 2) + (x1 & 3)] );
+				cache.Touch( &l.data[(((y1 >> 2) * l.blocksX + (x >> 2)) << 4) + ((y1 & 3) << 2) + (x & 3)] );
+				cache.Touch( &l.data[(((y1 >> 2) * l.blocksX + (x1 >> 2)) << 4) + ((y1 & 3) << 2) + (x1 & 3)] );
+			}
+			Timer timer;
+			float3 sum( 0 );
+			if (method == 0) for (int i = 0; i < N; i++)
+			{
+				const int iu = (int)(uv[i].x * w) % w, iv = (int)(uv[i].y * h) % h;
+				const uint c = src->pixels[iu + iv * w];
+				sum += float3( (float)((c >> 16) & 255), (float)((c >> 8) & 255), (float)(c & 255) ) * (1 / 256.0f);
+			}
+			else for (int i = 0; i < N; i++) sum += tex.Sample( uv[i], method == 1 ? 0 : lod[i] );
+			const float seconds = timer.elapsed();
+			const char* methodName[3] = { "nearest, row-major", "bilinear, tiled", "bilinear, tiled, cone LOD" };
+			printf( "  %-10s %-26s %7.1f Mlookups/s, %.3f misses per lookup (checksum %.0f)\n", patternName[pattern],
+				methodName[method], N / (seconds * 1e6f), (float)cache.misses / N, sum.x + sum.y + sum.z );
+		}
+	}
+	delete[] uv;
+	delete[] lod;
+}
+
+// EOF
@@ -0,0 +1,71 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// mipmapped texture in a tiled layout: every level is stored as blocks of
+// 4x4 texels, 64 bytes each, so a bilinear footprint touches one cacheline,
+// or at most four at block edges, instead of two rows of a row-major image.
+// Texels are 0x00RRGGBB, like Surface pixels; levels are padded to a whole
+// number of blocks.
+class MipTexture
+{
+public:
+	struct Level { uint* data; int width, height, blocksX; };
+	MipTexture( const Surface* src );
+	MipTexture( const int width, const int height, uint* data );
+	~MipTexture() { if (ownTexels) FREE64( texels ); }
+	MipTexture( const MipTexture& ) = delete;
+	MipTexture& operator=( const MipTexture& ) = delete;
+	uint Fetch( const Level& l, const int x, const int y ) const
+	{
+		return l.data[(((y >> 2) * l.blocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3)];
+	}
+	// bilinear, in the nearest level; inline, as it runs for every shaded hit
+	float3 Sample( const float2& uv, const float lod ) const
+	{
+		const Level& l = level[clamp( (int)(lod + 0.5f), 0, levels - 1 )];
+		// the four texels around the sample position, wrapped; after removing the
+		// integer part of uv, the first texel is in [-1, size - 1], so no modulo.
+		// floorf is a library call without SSE4.1; integer conversion is not
+		float u = uv.x - (int)uv.x, v = uv.y - (int)uv.y;
+		if (u < 0) u += 1;
+		if (v < 0) v += 1;
+		const float fx = u * l.width - 0.5f, fy = v * l.height - 0.5f;
+		int x0 = (int)(fx + 1) - 1, y0 = (int)(fy + 1) - 1, x1 = x0 + 1, y1 = y0 + 1;
+		const float ix = (float)x0, iy = (float)y0;
+		if (x0 < 0) x0 += l.width;
+		if (y0 < 0) y0 += l.height;
+		if (x1 >= l.width) x1 -= l.width;
+		if (y1 >= l.height) y1 -= l.height;
+		// unpack the texels to floats, as (b, g, r, 0), and interpolate
+		const __m128i t = _mm_setr_epi32( Fetch( l, x0, y0 ), Fetch( l, x1, y0 ), Fetch( l, x0, y1 ), Fetch( l, x1, y1 ) );
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i lo = _mm_unpacklo_epi8( t, zero ), hi = _mm_unpackhi_epi8( t, zero );
+		const __m128 c00 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, zero ) ), c10 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, zero ) );
+		const __m128 c01 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, zero ) ), c11 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, zero ) );
+		const __m128 wx = _mm_set1_ps( fx - ix ), wy = _mm_set1_ps( fy - iy );
+		const __m128 c0 = _mm_add_ps( c00, _mm_mul_ps( _mm_sub_ps( c10, c00 ), wx ) );
+		const __m128 c1 = _mm_add_ps( c01, _mm_mul_ps( _mm_sub_ps( c11, c01 ), wx ) );
+		const __m128 c = _mm_mul_ps( _mm_add_ps( c0, _mm_mul_ps( _mm_sub_ps( c1, c0 ), wy ) ), _mm_set1_ps( 1 / 256.0f ) );
+		float f[4];
+		_mm_storeu_ps( f, c );
+		return float3( f[2], f[1], f[0] );
+	}
+	// data
+	Level level[16];
+	int levels = 0;
+	uint* texels = 0;
+	size_t bytes = 0;
+	bool ownTexels = false;
+private:
+	void Layout( int w, int h );
+};
+
+// throughput and simulated cache misses of row-major nearest lookups versus
+// tiled bilinear lookups, for coherent and incoherent access patterns
+void BenchmarkTexture( const Surface* src );
+
+} // namespace Tmpl8
+
+// EOF
@@ -0,0 +1,75 @@
+#include "precomp.h"
+#include "tonemap.h"
+
+static inline __m128 TonemapSSE( const __m128 c, const int op )
+{
+	const __m128 one4 = _mm_set1_ps( 1 ), zero4 = _mm_setzero_ps();
+	if (op == TONEMAP_REINHARD) return _mm_div_ps( c, _mm_add_ps( one4, c ) );
+	if (op == TONEMAP_ACES)
+	{
+		// (c * (2.51c + 0.03)) / (c * (2.43c + 0.59) + 0.14)
+		const __m128 n = _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( 2.51f ) ), _mm_set1_ps( 0.03f ) ) );
+		const __m128 d = _mm_add_ps( _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( 2.43f ) ), _mm_set1_ps( 0.59f ) ) ), _mm_set1_ps( 0.14f ) );
+		return _mm_max_ps( zero4, _mm_min_ps( one4, _mm_div_ps( n, d ) ) );
+	}
+	return _mm_max_ps( zero4, _mm_min_ps( one4, c ) );
+}
+
+static inline __m128 EncodeSRGB( const __m128 c )
+{
+	// three square roots approximate pow( c, 1 / 2.4 ) well enough for 8 bits;
+	// see chilliant.com/rgb2hsv.html, "sRGB approximations for HLSL"
+	const __m128 s1 = _mm_sqrt_ps( c ), s2 = _mm_sqrt_ps( s1 ), s3 = _mm_sqrt_ps( s2 );
+	const __m128 curve = _mm_sub_ps( _mm_add_ps( _mm_mul_ps( s1, _mm_set1_ps( 0.585122381f ) ),
+		_mm_mul_ps( s2, _mm_set1_ps( 0.783140355f ) ) ), _mm_mul_ps( s3, _mm_set1_ps( 0.368262736f ) ) );
+	const __m128 linear = _mm_mul_ps( c, _mm_set1_ps( 12.92f ) );
+	const __m128 useLinear = _mm_cmplt_ps( c, _mm_set1_ps( 0.0031308f ) );
+	return _mm_min_ps( _mm_set1_ps( 1 ), _mm_or_ps( _mm_and_ps( useLinear, linear ), _mm_andnot_ps( useLinear, curve ) ) );
+}
+
+static inline uint TonemapPixel( const float3& sum, const uint samples, const int op, const bool sRGB )
+{
+	// one pixel, through the same SIMD code; used for the tail
+	const __m128 c = _mm_mul_ps( _mm_setr_ps( sum.x, sum.y, sum.z, 0 ), _mm_set1_ps( 1.0f / max( 1u, samples ) ) );
+	__m128 t = TonemapSSE( c, op );
+	if (sRGB) t = EncodeSRGB( t );
+	const __m128i q = _mm_cvttps_epi32( _mm_mul_ps( t, _mm_set1_ps( 255 ) ) );
+	return (_mm_cvtsi128_si32( q ) << 16) + (_mm_cvtsi128_si32( _mm_shuffle_epi32( q, 1 ) ) << 8) + _mm_cvtsi128_si32( _mm_shuffle_epi32( q, 2 ) );
+}
+
+void Tmpl8::Tonemap( const float3* accumulator, const uint* sampleCount, uint* pixels, const int count, const int op, const bool sRGB )
+{
+	const int blocks = count / 4, chunk = 1024; // blocks of four pixels, chunks of 4096 pixels per OpenMP task
+#pragma omp parallel for schedule(static)
+	for (int first = 0; first < blocks; first += chunk)
+	{
+		const __m128 scale255 = _mm_set1_ps( 255 ), one4 = _mm_set1_ps( 1 );
+		for (int i = first, last = min( blocks, first + chunk ); i < last; i++)
+		{
+			// four float3 pixels are three loads; shuffle them to one register per channel
+			const float* src = (const float*)(accumulator + i * 4);
+			const __m128 a = _mm_loadu_ps( src ), b = _mm_loadu_ps( src + 4 ), c = _mm_loadu_ps( src + 8 );
+			const __m128 x2y2x3y3 = _mm_shuffle_ps( b, c, _MM_SHUFFLE( 2, 1, 3, 2 ) );
+			const __m128 y0z0y1z1 = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 1, 0, 2, 1 ) );
+			__m128 r = _mm_shuffle_ps( a, x2y2x3y3, _MM_SHUFFLE( 2, 0, 3, 0 ) );
+			__m128 g = _mm_shuffle_ps( y0z0y1z1, x2y2x3y3, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+			__m128 bl = _mm_shuffle_ps( y0z0y1z1, c, _MM_SHUFFLE( 3, 0, 3, 1 ) );
+			// average over the samples of each pixel
+			const __m128 n = _mm_max_ps( one4, _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*)(sampleCount + i * 4) ) ) );
+			const __m128 invN = _mm_div_ps( one4, n );
+			r = TonemapSSE( _mm_mul_ps( r, invN ), op );
+			g = TonemapSSE( _mm_mul_ps( g, invN ), op );
+			bl = TonemapSSE( _mm_mul_ps( bl, invN ), op );
+			if (sRGB) r = EncodeSRGB( r ), g = EncodeSRGB( g ), bl = EncodeSRGB( bl );
+			// quantize with truncation and pack as 0x00RRGGBB
+			const __m128i ri = _mm_cvttps_epi32( _mm_mul_ps( r, scale255 ) );
+			const __m128i gi = _mm_cvttps_epi32( _mm_mul_ps( g, scale255 ) );
+			const __m128i bi = _mm_cvttps_epi32( _mm_mul_ps( bl, scale255 ) );
+			const __m128i packed = _mm_or_si128( _mm_or_si128( _mm_slli_epi32( ri, 16 ), _mm_slli_epi32( gi, 8 ) ), bi );
+			_mm_storeu_si128( (__m128i*)(pixels + i * 4), packed );
+		}
+	}
+	for (int i = blocks * 4; i < count; i++) pixels[i] = TonemapPixel( accumulator[i], sampleCount[i], op, sRGB );
+}
+
+// EOF
@@ -0,0 +1,18 @@
+#pragma once
+
+// tonemapping operators for the final float to RGB8 conversion
+#define TONEMAP_CLAMP		0	// clip at 1
+#define TONEMAP_REINHARD	1	// c / (1 + c), per channel
+#define TONEMAP_ACES		2	// Narkowicz' fit of the ACES filmic curve
+
+namespace Tmpl8
+{
+
+// convert summed samples to packed 0x00RRGGBB pixels: divide each pixel by its
+// sample count, tonemap, optionally encode as sRGB, and quantize. Multithreaded
+// and SSE, four pixels per step; any pixel count is accepted.
+void Tonemap( const float3* accumulator, const uint* sampleCount, uint* pixels, const int count, const int op, const bool sRGB );
+
+} // namespace Tmpl8
+
+// EOF
@@ -1,6 +1,16 @@
 #include "precomp.h"
+#include <omp.h> // omp_set_num_threads, for the pipeline worker
 #include "bvh.h"
+#include "tonemap.h"
+#include "imagewriter.h"
+#include "texture.h"
+#include "hdr.h"
+#include "archive.h"
+#include "meshpack.h"
+#include "gpurender.h"
 #include "whitted.h"
+#include "cl/rng.h"
+#include "cl/skymap.h"
 
 // THIS SOURCE FILE:
 // Code for the article "How to Build a BVH", part 8: Whitted.
@@ -32,30 +42,337 @@ void WhittedApp::Init()
 	float3 camPosTeapots = float3(0, -2, -8.5f);
 	float3 camPosDragons = float3(0, -15, -150.0f);
 	float3 camPosRips = float3(0, -6, -30.0f);
+	float3 camPosGrid = float3(15, -10, -12.0f); // NUM_MESHES 256: the whole 16x16 grid in view
 
 	// SELECT RELEVANT CAMERA POSITION
 	camPos = camPosRips;
 
-	// SELECT RELEVANT MESH FILE
-	//mesh = new Mesh( "assets/teapot.obj", "assets/bricks.png" );
-	//mesh = new Mesh( "assets/dragon.obj", "assets/bricks.png" );
-	mesh = new Mesh("assets/rip.obj", "assets/bricks.png");
+	printf( "BVH kernels: %s\n", activeISA->name );
+	// SELECT RELEVANT MESH FILE in whitted.h; a current scene archive replaces the sources
+	if (!LoadArchive()) LoadMesh(), InitScene();
+	// create a floating point accumulator for the screen
+	const int pixels = scrWidth * scrHeight;
+	accumulator = new float3[pixels];
+	sampleCount = new uint[pixels];
+	lumSquared = new float[pixels];
+	prevAccumulator = new float3[pixels];
+	prevSampleCount = new uint[pixels];
+	// tiles; the last column and row are partial if the resolution is not a multiple of the tile size
+	tilesX = (scrWidth + tileSize - 1) / tileSize, tilesY = (scrHeight + tileSize - 1) / tileSize;
+	tileActive = new bool[tilesX * tilesY];
+	tileRank = new float2[tilesX * tilesY];
+	lineStart = new uint[scrHeight + 1];
+	counters.reserve( MAX_COUNTERS );
+	// ray streams and material lists for the wavefront renderer
+	for (int i = 0; i < 3; i++) stream[i].Init( pixels );
+	for (int i = 0; i < 3; i++) hitList[i] = (uint*)MALLOC64( pixels * sizeof( uint ) );
+	sortKey = (uint*)MALLOC64( pixels * sizeof( uint ) );
+	sortCount = (uint*)MALLOC64( SORT_BLOCKS * SORT_KEYS * sizeof( uint ) );
+	if (!archive) LoadSky();
+}
+
+#define SKYCACHE_MAGIC 0x4d594b53 // "SKYM"
+
+static uint EncodeRGB9E5( const float3& c )
+{
+	// shared exponent for the largest component, rounded mantissas; see
+	// EXT_texture_shared_exponent. Components are clamped to [0, 65408].
+	const float r = clamp( c.x, 0.0f, 65408.0f ), g = clamp( c.y, 0.0f, 65408.0f ), b = clamp( c.z, 0.0f, 65408.0f );
+	const float maxc = max( r, max( g, b ) );
+	if (maxc <= 0) return 0;
+	int e = max( -16, (int)floorf( log2f( maxc ) ) ) + 16;
+	float denom = exp2f( (float)(e - 24) );
+	if ((int)floorf( maxc / denom + 0.5f ) == 512) denom *= 2, e++;
+	const uint rm = (uint)floorf( r / denom + 0.5f ), gm = (uint)floorf( g / denom + 0.5f ), bm = (uint)floorf( b / denom + 0.5f );
+	return rm + (gm << 9) + (bm << 18) + ((uint)e << 27);
+}
+
+void WhittedApp::LoadSky( const bool keepSource )
+{
+	// the baked map is cached in SKY_CACHE: later launches map it instead of
+	// decoding and baking, and the OS shares its pages between all render
+	// workers on a machine. The cache is rebuilt when the source is newer. The
+	// equirectangular source is only kept for the benchmark.
+	Timer timer;
+	if (!keepSource && (!FileExists( SKY_FILE ) || !FileIsNewer( SKY_FILE, SKY_CACHE )))
+	{
+		skyCache = new MappedFile( SKY_CACHE );
+		const uint* header = (const uint*)skyCache->data;
+		if (skyCache->size == 64 + SKYMAP_SIZE * SKYMAP_SIZE * sizeof( uint ) && header[0] == SKYCACHE_MAGIC && header[1] == SKYMAP_SIZE)
+		{
+			skyMap = (uint*)(skyCache->data + 64);
+			printf( "sky: mapped %s in %.2fms\n", SKY_CACHE, timer.elapsed() * 1000 );
+			return;
+		}
+		delete skyCache, skyCache = 0;
+	}
+	skyPixels = LoadHDR( SKY_FILE, skyWidth, skyHeight, true );
+	FATALERROR_IF( !skyPixels, "could not load %s", SKY_FILE );
+	const float decodeTime = timer.elapsed();
+	skyMap = (uint*)MALLOC64( SKYMAP_SIZE * SKYMAP_SIZE * sizeof( uint ) );
+#pragma omp parallel for schedule(static)
+	for (int v = 0; v < SKYMAP_SIZE; v++) for (int u = 0; u < SKYMAP_SIZE; u++)
+	{
+		// direction through the texel center; unfolding is the same operation as folding
+		float px = (u + 0.5f) * (2.0f / SKYMAP_SIZE) - 1, pz = (v + 0.5f) * (2.0f / SKYMAP_SIZE) - 1;
+		const float py = 1 - fabsf( px ) - fabsf( pz );
+		if (py < 0)
+		{
+			const float fx = (1 - fabsf( pz )) * (px < 0 ? -1 : 1);
+			pz = (1 - fabsf( px )) * (pz < 0 ? -1 : 1), px = fx;
+		}
+		skyMap[u + v * SKYMAP_SIZE] = EncodeRGB9E5( SampleSkyEquirect( normalize( float3( px, py, pz ) ) ) );
+	}
+	printf( "sky: decoded %s in %.2fms, baked in %.2fms\n", SKY_FILE, decodeTime * 1000, (timer.elapsed() - decodeTime) * 1000 );
+	if (keepSource) return;
+	FREE64( skyPixels ), skyPixels = 0;
+	SaveSkyCache();
+}
+
+void WhittedApp::SaveSkyCache()
+{
+	// a 64-byte header keeps the map cacheline aligned in the mapping. Written
+	// under a temporary name and then moved over the cache in one step, so a
+	// worker that starts in the meantime maps either the old file or the new
+	// one, never a partial or missing one; if another worker still maps the old
+	// cache, the move fails and this copy is dropped.
+	char tmp[1024];
+	snprintf( tmp, sizeof( tmp ), "%s.%08x", SKY_CACHE, (uint)chrono::high_resolution_clock::now().time_since_epoch().count() );
+	FILE* f = fopen( tmp, "wb" );
+	if (!f) { printf( "could not write %s\n", tmp ); return; }
+	uint header[16] = { SKYCACHE_MAGIC, SKYMAP_SIZE };
+	const bool written = fwrite( header, sizeof( header ), 1, f ) == 1 && fwrite( skyMap, SKYMAP_SIZE * SKYMAP_SIZE * sizeof( uint ), 1, f ) == 1;
+	fclose( f );
+	if (!written || !MoveFileExA( tmp, SKY_CACHE, MOVEFILE_REPLACE_EXISTING )) RemoveFile( tmp );
+}
+
+bool WhittedApp::LoadArchive()
+{
+	// map SCENE_ARCHIVE, unless it is missing, made for another mesh, or older
+	// than one of its sources; then the scene is rebuilt from the sources
+	Timer timer;
+	if (!FileExists( SCENE_ARCHIVE )) return false;
+	const char* source[3] = { MESH_FILE, TEXTURE_FILE, SKY_FILE };
+	for (int i = 0; i < 3; i++) if (FileExists( source[i] ) && FileIsNewer( source[i], SCENE_ARCHIVE ))
+	{
+		printf( "%s is newer than %s; loading the sources\n", source[i], SCENE_ARCHIVE );
+		return false;
+	}
+	archive = new SceneArchive( SCENE_ARCHIVE );
+	const ArchiveHeader* header = archive->header;
+	if (!archive->valid || strcmp( header->meshFile, MESH_FILE ) || strcmp( header->textureFile, TEXTURE_FILE ) || header->instCount != NUM_MESHES)
+	{
+		printf( "%s does not match this build or scene; loading the sources\n", SCENE_ARCHIVE );
+		delete archive, archive = 0;
+		return false;
+	}
+	mesh = archive->mesh, skyMap = archive->skyMap;
+	// instances and TLAS exactly as from the sources, including the first
+	// animation step; the TLAS builds in the mapped nodes
+	InitScene();
+	printf( "scene: mapped %s (%i triangles) in %.2fms\n", SCENE_ARCHIVE, mesh->triCount, timer.elapsed() * 1000 );
+	return true;
+}
+
+void WhittedApp::LoadMesh()
+{
+	// load MESH_PACK, unless it is missing, damaged or older than MESH_FILE;
+	// then the OBJ is parsed, and the pack is written for the next launch
+	Timer timer;
+	if (FileExists( MESH_PACK ) && !(FileExists( MESH_FILE ) && FileIsNewer( MESH_FILE, MESH_PACK )) && (mesh = LoadMeshPack( MESH_PACK )))
+	{
+		const float packTime = timer.elapsed();
+		mesh->texture = new Surface( TEXTURE_FILE ), mesh->mipTexture = new MipTexture( mesh->texture );
+		printf( "mesh: loaded %s (%i triangles) in %.2fms, %.2fms with the texture\n", MESH_PACK, mesh->triCount, packTime * 1000, timer.elapsed() * 1000 );
+		return;
+	}
+	mesh = new Mesh( MESH_FILE, TEXTURE_FILE );
+	printf( "mesh: parsed %s (%i triangles) in %.2fms, with the texture\n", MESH_FILE, mesh->triCount, timer.elapsed() * 1000 );
+	if (mesh->triCount && !SaveMeshPack( MESH_PACK, *mesh, true, PACK_ZLIB )) printf( "could not write %s\n", MESH_PACK );
+}
 
+void WhittedApp::BuildArchive( const char* file )
+{
+	// whitted --archive [file]: build the scene from its sources, write the
+	// archive, then map it and check it against the structures just built
+	Timer timer;
+	mesh = new Mesh( MESH_FILE, TEXTURE_FILE );
+	InitScene();
+	LoadSky();
+	const float buildTime = timer.elapsed();
+	if (!SceneArchive::Save( file, *mesh, tlas, skyMap, MESH_FILE, TEXTURE_FILE )) { printf( "could not write %s\n", file ); return; }
+	bool ok;
+	{
+		timer.reset();
+		SceneArchive mapped( file );
+		const float mapTime = timer.elapsed();
+		printf( "scene: built from sources in %.2fms, mapped from %s (%.1fMB) in %.2fms\n",
+			buildTime * 1000, file, mapped.map.size / 1048576.0f, mapTime * 1000 );
+		ok = mapped.Verify( *mesh, tlas, skyMap );
+	} // unmapped here: a mapped file cannot be deleted
+	printf( ok ? "archive verified\n" : "archive does NOT match the rebuilt scene\n" );
+	if (!ok) RemoveFile( file );
+}
+
+void WhittedApp::InitScene()
+{
+	// instance the mesh and build the TLAS over the instances; with a mapped
+	// scene archive, the TLAS builds in the archive's node array
 	for (int i = 0; i < NUM_MESHES; i++)
-		bvhInstance[i] = BVHInstance( mesh->bvh, i );
+		bvhInstance[i] = BVHInstance( mesh->bvh, i ),
+		bvhInstance[i].isStatic = !SHOULD_MOVE;
 	tlas = TLAS( bvhInstance, NUM_MESHES );
-	// create a floating point accumulator for the screen
-	accumulator = new float3[SCRWIDTH * SCRHEIGHT];
-	// load HDR sky
-	int bpp = 0;
-	skyPixels = stbi_loadf( "assets/sky_19.hdr", &skyWidth, &skyHeight, &skyBpp, 0 );
-	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
+	if (archive) _aligned_free( tlas.tlasNode ), tlas.tlasNode = archive->tlasNode, tlas.ownNodes = false;
+	AnimateScene( tlas );
+	// bake the static instances into a single-level BVH
+	if (FLATTEN) tlas.Flatten( FLATTEN == 2 ? FLATTEN_MAXTRIS : 0xffffffff );
+}
+
+bool WhittedApp::CommandLine( int argc, char** argv )
+{
+	// options, anywhere on the line: --size <width>x<height> and --tile <pixels>;
+	// they also apply to the interactive renderer when no command is given. They
+	// are taken out of the list, so the command and its arguments follow argv[0]
+	vector<char*> args = { argv[0] };
+	for (int i = 1; i < argc; i++)
+	{
+		const bool size = strcmp( argv[i], "--size" ) == 0, tile = strcmp( argv[i], "--tile" ) == 0;
+		if ((!size && !tile) || i == argc - 1) { args.push_back( argv[i] ); continue; }
+		int w, h;
+		if (size && sscanf( argv[i + 1], "%ix%i", &w, &h ) == 2 && w > 0 && h > 0) scrWidth = w, scrHeight = h;
+		if (tile && atoi( argv[i + 1] ) > 0) tileSize = atoi( argv[i + 1] );
+		i++; // skip the value
+	}
+	argc = (int)args.size(), argv = args.data();
+	// whitted --render <frames> <spp> <file>: headless rendering, see RenderOffline
+	if (argc > 1 && strcmp( argv[1], "--render" ) == 0)
+	{
+		if (argc < 5) printf( "usage: whitted --render <frames> <spp> <file.png|.exr|.pfm> [--size WxH] [--tile N]\n" );
+		else RenderOffline( atoi( argv[2] ), atoi( argv[3] ), argv[4] );
+		return true;
+	}
+	// whitted --archive [file]: write and verify a scene archive, see BuildArchive
+	if (argc > 1 && strcmp( argv[1], "--archive" ) == 0) { BuildArchive( argc > 2 ? argv[2] : SCENE_ARCHIVE ); return true; }
+	// whitted --packbench <mesh.tri|mesh.obj>: compressed mesh loading, see BenchmarkMeshPack
+	if (argc > 1 && strcmp( argv[1], "--packbench" ) == 0)
+	{
+		if (argc < 3) printf( "usage: whitted --packbench <mesh.tri|mesh.obj>\n" ); else BenchmarkMeshPack( argv[2] );
+		return true;
+	}
+	// whitted --clbench [frames]: the OpenCL renderers against the CPU, see BenchmarkGPU
+	if (argc > 1 && strcmp( argv[1], "--clbench" ) == 0) { BenchmarkGPU( argc > 2 && atoi( argv[2] ) > 0 ? atoi( argv[2] ) : 8 ); return true; }
+	// whitted --pipebench [frames]: the frame pipeline at each depth, see BenchmarkPipeline
+	if (argc > 1 && strcmp( argv[1], "--pipebench" ) == 0) { BenchmarkPipeline( argc > 2 && atoi( argv[2] ) > 0 ? atoi( argv[2] ) : 100 ); return true; }
+	// whitted --kdbench: kD-tree nearest neighbour queries, see BenchmarkKDTree
+	if (argc > 1 && strcmp( argv[1], "--kdbench" ) == 0) { BenchmarkKDTree(); return true; }
+	// whitted --tlasbench [instances]: TLAS builders on random instances, see BenchmarkTLAS
+	if (argc > 1 && strcmp( argv[1], "--tlasbench" ) == 0) { BenchmarkTLAS( argc > 2 && atoi( argv[2] ) > 0 ? min( atoi( argv[2] ), 32000 ) : 16384 ); return true; }
+	// whitted --skybench: compare sky lookups, see BenchmarkSky
+	if (argc > 1 && strcmp( argv[1], "--skybench" ) == 0) { BenchmarkSky(); return true; }
+	// whitted --texbench [image]: compare texture layouts and filtering, see BenchmarkTexture
+	if (argc > 1 && strcmp( argv[1], "--texbench" ) == 0)
+	{
+		Surface image( argc > 2 ? argv[2] : "assets/bricks.png" );
+		BenchmarkTexture( &image );
+		return true;
+	}
+	// whitted --bvhstats <mesh.obj> [results.csv]: report the quality of the mesh BVH
+	// and of the TLAS for the demo scene, optionally appending them to a csv file
+	if (argc < 3 || strcmp( argv[1], "--bvhstats" ) != 0) return false;
+	mesh = new Mesh( argv[2], "assets/bricks.png" );
+	if (mesh->triCount == 0) { printf( "could not load %s\n", argv[2] ); return true; }
+	BVHStats blasStats = Analyze( *mesh->bvh );
+	blasStats.Print( argv[2] );
+	InitScene();
+	BVHStats tlasStats = Analyze( tlas );
+	tlasStats.Print( "TLAS" );
+	if (argc > 3) blasStats.AppendCSV( argv[3], argv[2] ), tlasStats.AppendCSV( argv[3], "TLAS" );
+	return true;
+}
+
+static bool IsFramePattern( const char* pattern )
+{
+	// the pattern becomes a printf format: it must hold exactly one integer
+	// conversion (%d, %i, %04i, ..); any other percent sign must be %%
+	int conversions = 0;
+	for (const char* p = strchr( pattern, '%' ); p; p = strchr( p, '%' ))
+	{
+		if (*++p == '%') { p++; continue; }
+		if (*p == '0') p++;
+		while (*p >= '0' && *p <= '9') p++;
+		if (*p != 'd' && *p != 'i') return false;
+		conversions++, p++;
+	}
+	return conversions == 1;
+}
+
+void WhittedApp::RenderOffline( const int frames, const int spp, const char* file )
+{
+	// whitted --render <frames> <spp> <file>: render an image sequence without a window.
+	// 'file' is a printf pattern for the frame number, e.g. out/frame%04i.exr; without
+	// one, the number goes before the extension. The accumulator is the render target:
+	// every frame gets exactly 'spp' samples per pixel, with uniform sampling.
+	if (frames < 1 || spp < 1 || !ImageWriter::IsSupported( file ))
+	{
+		printf( "usage: whitted --render <frames> <spp> <file.png|.exr|.pfm> [--size WxH] [--tile N]\n" );
+		return;
+	}
+	if (strchr( file, '%' ) && !IsFramePattern( file ))
+	{
+		printf( "%s: the frame number pattern needs exactly one %%d or %%i conversion, e.g. frame%%04i.png\n", file );
+		return;
+	}
+	char pattern[1024];
+	if (strchr( file, '%' ) || frames == 1) strncpy( pattern, file, sizeof( pattern ) - 1 ), pattern[sizeof( pattern ) - 1] = 0;
+	else snprintf( pattern, sizeof( pattern ), "%.*s%%04i%s", (int)(strrchr( file, '.' ) - file), file, strrchr( file, '.' ) );
+	screen = new Surface( scrWidth, scrHeight );
+	Init();
+	progressive = true, adaptive = false;
+	const bool floatOutput = ImageWriter::IsFloatFormat( file );
+	float3* radiance = floatOutput ? new float3[scrWidth * scrHeight] : 0;
+	ImageWriter writer;
+	Timer total;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		// samples are indexed per frame, so every frame is reproducible on its own
+		Timer frameTimer;
+		AnimateScene( tlas );
+		SetupCamera();
+		ResetAccumulator();
+		targetSpp = spp, seedFrame = frame;
+		uint64_t rays = 0;
+		do
+		{
+			ScheduleTiles();
+			if (useGPU) RenderGPU(); else if (wavefront) RenderWavefront(); else RenderRecursive();
+			rays += raysTraced;
+		} while (raysTraced > 0);
+		frameIdx++;
+		const float renderTime = frameTimer.elapsed();
+		Tonemap( accumulator, sampleCount, screen->pixels, scrWidth * scrHeight, tonemap, sRGB );
+		if (floatOutput)
+		{
+		#pragma omp parallel for schedule(static)
+			for (int i = 0; i < scrWidth * scrHeight; i++) radiance[i] = accumulator[i] * (1.0f / max( 1u, sampleCount[i] ));
+		}
+		// the writer copies the frame; saving it overlaps rendering the next one
+		char name[1024];
+		snprintf( name, sizeof( name ), pattern, frame );
+		writer.Write( name, scrWidth, scrHeight, screen->pixels, radiance );
+		printf( "frame %i: %.2fms, %.2f Mrays/s (%.2fms including queueing) -> %s\n",
+			frame, renderTime * 1000, rays / (renderTime * 1e6), frameTimer.elapsed() * 1000, name );
+	}
+	writer.Flush();
+	printf( "%i frames at %ix%i, %i spp in %.2fs; %.2fs spent writing on the I/O thread\n",
+		frames, scrWidth, scrHeight, spp, total.elapsed(), writer.writeSeconds );
+	delete[] radiance;
 }
 
-void WhittedApp::AnimateScene()
+void WhittedApp::AnimateScene( TLAS& scene )
 {
-	// animate the scene
-	static float a[16] = { 0 }, h[16] = { 5, 4, 3, 2, 1, 5, 4, 3 }, s[16] = { 0 };
+	// animate the scene; the frame pipeline alternates between two TLASes, each
+	// over its own copy of the instances, but the motion is one sequence
+	static float a[256] = { 0 }, h[256] = { 5, 4, 3, 2, 1, 5, 4, 3 }, s[256] = { 0 };
 	for (int i = 0, x = 0; x < std::sqrt(NUM_MESHES); x++) for (int y = 0; y < std::sqrt(NUM_MESHES); y++, i++)
 	{
 		mat4 R, T = mat4::Translate( (x - 1.5f) * 2.5f, 0, (y - 1.5f) * 2.5f );
@@ -66,41 +383,152 @@ void WhittedApp::AnimateScene()
 			if ((a[i] += (((i * 13) & 7) + 2) * 0.005f) > 2 * PI) a[i] -= 2 * PI;
 			if ((s[i] -= 0.01f, h[i] += s[i]) < 0) s[i] = 0.2f;
 		}
-		bvhInstance[i].SetTransform( T * R * mat4::Scale( 1.5f ) );
+		scene.blas[i].SetTransform( T * R * mat4::Scale( 1.5f ) );
 	}
 	// update the TLAS
-	tlas.BuildQuick();
+	if (CLUSTER_TLAS) scene.Build(); else scene.BuildQuick();
 }
 
-float3 WhittedApp::Trace( Ray& ray, RayCounter* counter, int rayDepth )
+float3 WhittedApp::SampleSky( const float3& D )
 {
-	tlas.Intersect( ray, counter );
-	Intersection i = ray.hit;
-	if (i.t == 1e30f)
-	{	
-		// sample sky
-		uint u = (uint)(skyWidth * atan2f( ray.D.z, ray.D.x ) * INV2PI - 0.5f);
-		uint v = (uint)(skyHeight * acosf( ray.D.y ) * INVPI - 0.5f);
-		uint skyIdx = (u + v * skyWidth) % (skyWidth * skyHeight);
-		return 0.65f * float3( skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2] );
+	return 0.65f * DecodeRGB9E5( skyMap[SkyMapIndex( D.x, D.y, D.z )] );
+}
+
+float3 WhittedApp::SampleSkyEquirect( const float3& D )
+{
+	// the source sky: two inverse trig functions and a modulo per lookup
+	const float phi = atan2f( D.z, D.x );
+	uint u = (uint)(skyWidth * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
+	uint v = (uint)(skyHeight * acosf( D.y ) * INVPI - 0.5f);
+	uint skyIdx = (u + v * skyWidth) % (skyWidth * skyHeight);
+	return float3( skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2] );
+}
+
+void WhittedApp::BenchmarkSky()
+{
+	// whitted --skybench: cost of shading a miss, for the equirectangular source
+	// and the octahedral map, with random directions (reflected rays) and with
+	// the directions of a primary ray grid (coherent)
+	LoadSky( true );
+	printf( "sky: %ix%i equirectangular, %.1fMB; octahedral %ix%i RGB9E5, %.1fMB\n",
+		skyWidth, skyHeight, skyWidth * skyHeight * 12 / 1048576.0f, SKYMAP_SIZE, SKYMAP_SIZE,
+		SKYMAP_SIZE * SKYMAP_SIZE * 4 / 1048576.0f );
+	// the decoder against stb_image, which it replaces; same values expected
+	Timer stbTimer;
+	int w, h, bpp;
+	float* reference = stbi_loadf( SKY_FILE, &w, &h, &bpp, 3 );
+	if (!reference) printf( "  stbi_loadf could not read %s\n", SKY_FILE );
+	else if (w != skyWidth || h != skyHeight) printf( "  stbi_loadf reads %s as %ix%i, LoadHDR as %ix%i\n", SKY_FILE, w, h, skyWidth, skyHeight );
+	else
+	{
+		for (int i = 0; i < w * h * 3; i++) reference[i] = sqrtf( reference[i] );
+		const float stbTime = stbTimer.elapsed();
+		uint mismatches = 0;
+		for (int i = 0; i < w * h * 3; i++) mismatches += reference[i] != skyPixels[i];
+		printf( "  stbi_loadf and sqrtf: %.2fms, %i of %i values differ from LoadHDR\n", stbTime * 1000, mismatches, w * h * 3 );
 	}
-	// calculate texture uv based on barycentrics
-	uint triIdx = i.instPrim & 0xfffff;
-	uint instIdx = i.instPrim >> 20;
+	stbi_image_free( reference );
+	Timer mapTimer;
+	MappedFile cache( SKY_CACHE );
+	volatile uint touched = 0;
+	for (size_t i = 0; i < cache.size; i += 4096) touched += cache.data[i];
+	if (cache.data) printf( "  mapping %s and touching every page: %.2fms\n", SKY_CACHE, mapTimer.elapsed() * 1000 );
+	const int N = 1 << 22;
+	float3* D = new float3[N];
+	for (int pattern = 0; pattern < 2; pattern++)
+	{
+		uint seed = 0x2545f491;
+		for (int i = 0; i < N; i++)
+		{
+			if (pattern == 0) // uniform on the sphere
+			{
+				const float z = RandomFloat( seed ) * 2 - 1, a = RandomFloat( seed ) * 2 * PI, r = sqrtf( max( 0.0f, 1 - z * z ) );
+				D[i] = float3( r * cosf( a ), r * sinf( a ), z );
+			}
+			else D[i] = normalize( float3( (i % 2048) / 1024.0f - 1, 1, (i / 2048) / 1024.0f - 1 ) );
+		}
+		float3 sum[2] = { float3( 0 ), float3( 0 ) };
+		float seconds[2];
+		double error = 0;
+		for (int method = 0; method < 2; method++)
+		{
+			Timer timer;
+			if (method == 0) for (int i = 0; i < N; i++) sum[0] += SampleSkyEquirect( D[i] );
+			else for (int i = 0; i < N; i++) sum[1] += DecodeRGB9E5( skyMap[SkyMapIndex( D[i].x, D[i].y, D[i].z )] );
+			seconds[method] = timer.elapsed();
+		}
+		for (int i = 0; i < N; i += 64)
+		{
+			const float3 a = SampleSkyEquirect( D[i] ), b = DecodeRGB9E5( skyMap[SkyMapIndex( D[i].x, D[i].y, D[i].z )] );
+			error += length( a - b ) / max( 1e-3f, length( a ) );
+		}
+		printf( "  %s: equirectangular %.1fns, octahedral %.1fns per miss; mean relative difference %.2f%% (checksums %.0f, %.0f)\n",
+			pattern == 0 ? "random" : "coherent", seconds[0] * 1e9f / N, seconds[1] * 1e9f / N,
+			100 * error / (N / 64), sum[0].x + sum[0].y + sum[0].z, sum[1].x + sum[1].y + sum[1].z );
+	}
+	delete[] D;
+}
+
+float3 WhittedApp::HitNormal( const Intersection& hit )
+{
+	// interpolate the vertex normals and bring the result to world space
+	uint triIdx = hit.instPrim & 0xfffff;
+	uint instIdx = hit.instPrim >> 20;
 	TriEx& tri = mesh->triEx[triIdx];
-	Surface* tex = mesh->texture;
-	float2 uv = i.u * tri.uv1 + i.v * tri.uv2 + (1 - (i.u + i.v)) * tri.uv0;
-	int iu = (int)(uv.x * tex->width) % tex->width;
-	int iv = (int)(uv.y * tex->height) % tex->height;
-	uint texel = tex->pixels[iu + iv * tex->width];
-	float3 albedo = RGB8toRGB32F( texel );
-	// calculate the normal for the intersection
-	float3 N = i.u * tri.N1 + i.v * tri.N2 + (1 - (i.u + i.v)) * tri.N0;
-	N = normalize( TransformVector( N, bvhInstance[instIdx].GetTransform() ) );
+	float3 N = hit.u * tri.N1 + hit.v * tri.N2 + (1 - (hit.u + hit.v)) * tri.N0;
+	return normalize( TransformVector( N, tlas.blas[instIdx].GetTransform() ) );
+}
+
+float WhittedApp::TextureLOD( const Intersection& hit, const float3& D, const float3& N, const float coneWidth )
+{
+	// ray cones: the mip level is log2 of the cone's footprint in texels, i.e. its
+	// width at the hit, stretched by the angle of incidence, over the world-space
+	// size of a texel on this triangle. See Akenine-Moller et al., "Texture Level
+	// of Detail Strategies for Real-Time Ray Tracing", Ray Tracing Gems, 2019.
+	const uint triIdx = hit.instPrim & 0xfffff;
+	const Tri& tri = mesh->tri[triIdx];
+	const TriEx& ex = mesh->triEx[triIdx];
+	mat4& M = tlas.blas[hit.instPrim >> 20].GetTransform();
+	const float worldArea = length( cross( TransformVector( tri.vertex1 - tri.vertex0, M ), TransformVector( tri.vertex2 - tri.vertex0, M ) ) );
+	const float2 e1 = ex.uv1 - ex.uv0, e2 = ex.uv2 - ex.uv0;
+	const float texelArea = fabsf( e1.x * e2.y - e1.y * e2.x ) * mesh->texture->width * mesh->texture->height;
+	if (worldArea <= 0 || texelArea <= 0) return 0;
+	return 0.5f * log2f( texelArea / worldArea ) + log2f( coneWidth / max( 1e-4f, fabsf( dot( N, D ) ) ) );
+}
+
+float3 WhittedApp::ShadeDiffuse( const Intersection& hit, const float3& I, const float3& N, const float3& D, const float coneWidth )
+{
+	// calculate texture uv based on barycentrics
+	TriEx& tri = mesh->triEx[hit.instPrim & 0xfffff];
+	float2 uv = hit.u * tri.uv1 + hit.v * tri.uv2 + (1 - (hit.u + hit.v)) * tri.uv0;
+	float3 albedo;
+	if (textureFilter) albedo = mesh->mipTexture->Sample( uv, TextureLOD( hit, D, N, coneWidth ) ); else
+	{
+		Surface* tex = mesh->texture;
+		int iu = (int)(uv.x * tex->width) % tex->width;
+		int iv = (int)(uv.y * tex->height) % tex->height;
+		uint texel = tex->pixels[iu + iv * tex->width];
+		albedo = RGB8toRGB32F( texel );
+	}
+	// calculate the diffuse reflection in the intersection point
+	float3 lightPos( 3, 10, 2 );
+	float3 lightColor( 150, 150, 120 );
+	float3 ambient( 0.2f, 0.2f, 0.4f );
+	float3 L = lightPos - I;
+	float dist = length( L );
+	L *= 1.0f / dist;
+	return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+}
+
+float3 WhittedApp::Trace( Ray& ray, RayCounter* counter, int rayDepth, float pathLength )
+{
+	tlas.Intersect( ray, counter );
+	Intersection i = ray.hit;
+	if (i.t == 1e30f) return SampleSky( ray.D );
+	float3 N = HitNormal( i );
 	float3 I = ray.O + i.t * ray.D;
 	// shading
-	bool mirror = (instIdx * 17) & 1;
-	if (mirror && HALF_MIRRORED)
+	if (IsMirror( i.instPrim >> 20 ))
 	{	
 		// calculate the specular reflection in the intersection point
 		counter->incrementBounces();
@@ -109,73 +537,615 @@ float3 WhittedApp::Trace( Ray& ray, RayCounter* counter, int rayDepth )
 		secondary.O = I + secondary.D * 0.001f;
 		secondary.hit.t = 1e30f;
 		if (rayDepth >= 10) return float3( 0 );
-		return Trace( secondary, counter, rayDepth + 1 );
-	}
-	else
-	{
-		// calculate the diffuse reflection in the intersection point
-		float3 lightPos( 3, 10, 2 );
-		float3 lightColor( 150, 150, 120 );
-		float3 ambient( 0.2f, 0.2f, 0.4f );
-		float3 L = lightPos - I;
-		float dist = length( L );
-		L *= 1.0f / dist;
-		return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+		return Trace( secondary, counter, rayDepth + 1, pathLength + i.t );
 	}
+	else return ShadeDiffuse( i, I, N, ray.D, (pathLength + i.t) * pixelSpread );
 }
 
-void WhittedApp::Tick( float deltaTime )
+void WhittedApp::RenderRecursive()
 {
-	// update the TLAS
-	AnimateScene();
 	// render the scene: multithreaded tiles
-	static float angle = 0;// angle += 0.01f;
-	mat4 M1 = mat4::RotateY( angle ), M2 = M1 * mat4::RotateX( -0.65f );
-	// setup screen plane in world space
-	float aspectRatio = (float)SCRWIDTH / SCRHEIGHT;
-	p0 = TransformPosition( float3( -aspectRatio, 1, 1.5f ), M2 );
-	p1 = TransformPosition( float3( aspectRatio, 1, 1.5f ), M2 );
-	p2 = TransformPosition( float3( -aspectRatio, -1, 1.5f ), M2 );
-	camPos = TransformPosition( camPos, M1 );
-#pragma omp parallel for schedule(dynamic)
-	for (int tile = 0; tile < (SCRWIDTH * SCRHEIGHT / 64); tile++)
+	int rays = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:rays)
+	for (int tile = 0; tile < tilesX * tilesY; tile++)
 	{
-		// render an 8x8 tile
-		int x = tile % (SCRWIDTH / 8), y = tile / (SCRWIDTH / 8);
+		// render a tile, if the scheduler selected it; edge tiles may be partial
+		if (!tileActive[tile]) continue;
+		const int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+		const int x1 = min( x0 + tileSize, scrWidth ), y1 = min( y0 + tileSize, scrHeight );
 		Ray ray;
 		ray.O = camPos;
-		RayCounter* counter = new RayCounter(ray);
+		RayCounter counter( ray ); // per tile, on the stack; a copy is kept for the statistics
 
-		// Critical section to update counters safely
+		int primaries = 0;
+		for (int y = y0; y < y1; y++) for (int x = x0; x < x1; x++)
+		{
+			// setup a primary ray
+			uint pixelAddress = x + y * scrWidth;
+			const uint sample = sampleCount[pixelAddress];
+			float3 pixelPos = ray.O + p0 +
+				(p1 - p0) * ((x + PixelRandom( pixelAddress, seedFrame, sample, 0 )) / scrWidth) +
+				(p2 - p0) * ((y + PixelRandom( pixelAddress, seedFrame, sample, 1 )) / scrHeight);
+			ray.D = normalize( pixelPos - ray.O );
+			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+			AddSample( pixelAddress, Trace( ray, &counter ) );
+			sampleCount[pixelAddress]++, primaries++;
+		}
+		rays += primaries + counter.bounces;
+		// critical section to update counters safely
 #pragma omp critical
 		{
-			if (counterIdx < 524288)
+			if (counters.size() < MAX_COUNTERS) counters.push_back( counter );
+		}
+	}
+	raysTraced = rays;
+}
+
+// RayStream implementation
+
+void RayStream::Init( const uint capacity )
+{
+	float** f[6] = { &Ox, &Oy, &Oz, &Dx, &Dy, &Dz };
+	for (int i = 0; i < 6; i++) *f[i] = (float*)MALLOC64( capacity * sizeof( float ) );
+	pathLength = (float*)MALLOC64( capacity * sizeof( float ) );
+	hit = (Intersection*)MALLOC64( capacity * sizeof( Intersection ) );
+	pixelIdx = (uint*)MALLOC64( capacity * sizeof( uint ) );
+	count = 0;
+}
+
+// wavefront renderer: instead of tracing each path to completion, every pass
+// does one kind of work for all rays at once, so BVH traversal, texturing and
+// sky lookups each keep the caches to themselves:
+// 1. intersect the full ray stream;
+// 2. compact the hits into per-material lists (miss, mirror, diffuse);
+// 3. shade the sky and diffuse lists, which terminate their paths;
+// 4. spawn the reflected rays of the mirror list as the next stream.
+// A mirror hit on the last bounce is black, as in WhittedApp::Trace.
+#define STREAM_CHUNK 256 // rays per OpenMP work item
+
+// secondary rays are sorted on a 12-bit key: direction octant, then the
+// Morton code of the origin cell in an 8x8x8 grid over the scene bounds.
+// Rays in one bucket leave the same region in roughly the same direction,
+// so consecutive rays visit mostly the same TLAS nodes and instances.
+
+static uint SortKey( const float3& O, const float3& D, const float3& bmin, const float3& scale )
+{
+	uint octant = (D.x < 0 ? 1 : 0) + (D.y < 0 ? 2 : 0) + (D.z < 0 ? 4 : 0);
+	uint cx = (uint)clamp( (int)((O.x - bmin.x) * scale.x), 0, 7 );
+	uint cy = (uint)clamp( (int)((O.y - bmin.y) * scale.y), 0, 7 );
+	uint cz = (uint)clamp( (int)((O.z - bmin.z) * scale.z), 0, 7 );
+	uint morton = 0;
+	for (int b = 0; b < 3; b++) morton |= (((cx >> b) & 1) << (3 * b)) | (((cy >> b) & 1) << (3 * b + 1)) | (((cz >> b) & 1) << (3 * b + 2));
+	return (octant << 9) + morton;
+}
+
+void WhittedApp::SortStream( RayStream*& rays, RayStream*& scratch )
+{
+	// stable counting sort of the stream into the scratch stream, which then takes its place
+	const int rayCount = (int)rays->count, blockSize = (rayCount + SORT_BLOCKS - 1) / SORT_BLOCKS;
+	const float3 bmin = tlas.tlasNode[0].aabbMin, extent = tlas.tlasNode[0].aabbMax - bmin;
+	const float3 scale( 8 / max( extent.x, 1e-6f ), 8 / max( extent.y, 1e-6f ), 8 / max( extent.z, 1e-6f ) );
+	memset( sortCount, 0, SORT_BLOCKS * SORT_KEYS * sizeof( uint ) );
+#pragma omp parallel for schedule(static)
+	for (int block = 0; block < SORT_BLOCKS; block++)
+	{
+		uint* count = sortCount + block * SORT_KEYS;
+		for (int i = block * blockSize, end = min( rayCount, i + blockSize ); i < end; i++)
+		{
+			float3 O( rays->Ox[i], rays->Oy[i], rays->Oz[i] ), D( rays->Dx[i], rays->Dy[i], rays->Dz[i] );
+			count[sortKey[i] = SortKey( O, D, bmin, scale )]++;
+		}
+	}
+	// exclusive prefix sum, key-major so that equal keys stay in stream order
+	for (uint key = 0, sum = 0; key < SORT_KEYS; key++) for (int block = 0; block < SORT_BLOCKS; block++)
+	{
+		uint& c = sortCount[block * SORT_KEYS + key];
+		uint n = c;
+		c = sum, sum += n;
+	}
+#pragma omp parallel for schedule(static)
+	for (int block = 0; block < SORT_BLOCKS; block++)
+	{
+		uint* offset = sortCount + block * SORT_KEYS;
+		for (int i = block * blockSize, end = min( rayCount, i + blockSize ); i < end; i++)
+		{
+			uint j = offset[sortKey[i]]++;
+			scratch->Ox[j] = rays->Ox[i], scratch->Oy[j] = rays->Oy[i], scratch->Oz[j] = rays->Oz[i];
+			scratch->Dx[j] = rays->Dx[i], scratch->Dy[j] = rays->Dy[i], scratch->Dz[j] = rays->Dz[i];
+			scratch->pixelIdx[j] = rays->pixelIdx[i], scratch->pathLength[j] = rays->pathLength[i];
+		}
+	}
+	scratch->count = rays->count;
+	swap( rays, scratch );
+}
+
+void WhittedApp::RenderWavefront()
+{
+	// generate primary rays in scanline order, for the pixels that need more samples;
+	// count them per line first, so each line knows where its rays start
+	RayStream* current = &stream[0], * next = &stream[1], * scratch = &stream[2];
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < scrHeight; y++)
+	{
+		const bool* tileRow = tileActive + (y / tileSize) * tilesX;
+		uint count = 0;
+		for (int tx = 0; tx < tilesX; tx++) if (tileRow[tx]) count += min( tileSize, scrWidth - tx * tileSize );
+		lineStart[y + 1] = count;
+	}
+	lineStart[0] = 0;
+	for (int y = 0; y < scrHeight; y++) lineStart[y + 1] += lineStart[y];
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < scrHeight; y++) for (int x = 0, i = lineStart[y]; x < scrWidth; x++)
+	{
+		if (!tileActive[x / tileSize + (y / tileSize) * tilesX]) continue;
+		uint pixel = x + y * scrWidth;
+		const uint sample = sampleCount[pixel];
+		float3 pixelPos = camPos + p0 +
+			(p1 - p0) * ((x + PixelRandom( pixel, seedFrame, sample, 0 )) / scrWidth) +
+			(p2 - p0) * ((y + PixelRandom( pixel, seedFrame, sample, 1 )) / scrHeight);
+		float3 D = normalize( pixelPos - camPos );
+		current->Ox[i] = camPos.x, current->Oy[i] = camPos.y, current->Oz[i] = camPos.z;
+		current->Dx[i] = D.x, current->Dy[i] = D.y, current->Dz[i] = D.z;
+		current->pathLength[i] = 0, current->pixelIdx[i++] = pixel;
+		sampleCount[pixel]++;
+	}
+	current->count = lineStart[scrHeight];
+	raysTraced = 0, sortTime = 0;
+	for (int depth = 0; current->count > 0; depth++)
+	{
+		// primary rays are coherent already; reorder the reflected ones
+		if (depth > 0 && sortSecondary)
+		{
+			Timer sortTimer;
+			SortStream( current, scratch );
+			sortTime += sortTimer.elapsed();
+		}
+		const int rayCount = (int)current->count, chunks = (rayCount + STREAM_CHUNK - 1) / STREAM_CHUNK;
+		raysTraced += rayCount;
+		// intersect the stream
+	#pragma omp parallel for schedule(dynamic)
+		for (int chunk = 0; chunk < chunks; chunk++)
+		{
+			Ray ray;
+			RayCounter counter( ray );
+			for (int i = chunk * STREAM_CHUNK, end = min( rayCount, i + STREAM_CHUNK ); i < end; i++)
 			{
-				counters[counterIdx] = counter;
-				counterIdx++;
+				ray.O = float3( current->Ox[i], current->Oy[i], current->Oz[i] );
+				ray.D = float3( current->Dx[i], current->Dy[i], current->Dz[i] );
+				ray.hit.t = 1e30f;
+				tlas.Intersect( ray, &counter );
+				current->hit[i] = ray.hit;
 			}
+		}
+		// compact by material; each chunk reserves its range with a single atomic add
+		hitCount[0] = hitCount[1] = hitCount[2] = 0;
+	#pragma omp parallel for schedule(static)
+		for (int chunk = 0; chunk < chunks; chunk++)
+		{
+			uint local[3][STREAM_CHUNK], localCount[3] = { 0, 0, 0 };
+			for (int i = chunk * STREAM_CHUNK, end = min( rayCount, i + STREAM_CHUNK ); i < end; i++)
+			{
+				const Intersection& hit = current->hit[i];
+				uint list = hit.t == 1e30f ? 0 : IsMirror( hit.instPrim >> 20 ) ? 1 : 2;
+				local[list][localCount[list]++] = i;
+			}
+			for (int list = 0; list < 3; list++) if (localCount[list])
+			{
+				uint first = InterlockedAdd( &hitCount[list], localCount[list] ) - localCount[list];
+				memcpy( hitList[list] + first, local[list], localCount[list] * sizeof( uint ) );
+			}
+		}
+		// sky
+	#pragma omp parallel for schedule(static)
+		for (int j = 0; j < (int)hitCount[0]; j++)
+		{
+			uint i = hitList[0][j];
+			AddSample( current->pixelIdx[i], SampleSky( float3( current->Dx[i], current->Dy[i], current->Dz[i] ) ) );
+		}
+		// diffuse surfaces
+	#pragma omp parallel for schedule(static)
+		for (int j = 0; j < (int)hitCount[2]; j++)
+		{
+			uint i = hitList[2][j];
+			const Intersection& hit = current->hit[i];
+			const float3 D( current->Dx[i], current->Dy[i], current->Dz[i] );
+			float3 I = float3( current->Ox[i], current->Oy[i], current->Oz[i] ) + hit.t * D;
+			const float coneWidth = (current->pathLength[i] + hit.t) * pixelSpread;
+			AddSample( current->pixelIdx[i], ShadeDiffuse( hit, I, HitNormal( hit ), D, coneWidth ) );
+		}
+		// mirrors: the reflected rays form the next stream
+	#pragma omp parallel for schedule(static)
+		for (int j = 0; j < (int)hitCount[1]; j++)
+		{
+			uint i = hitList[1][j];
+			if (depth >= 10) continue; // black
+			const Intersection& hit = current->hit[i];
+			float3 D = float3( current->Dx[i], current->Dy[i], current->Dz[i] );
+			float3 N = HitNormal( hit );
+			float3 R = D - 2 * N * dot( N, D );
+			float3 O = float3( current->Ox[i], current->Oy[i], current->Oz[i] ) + hit.t * D + R * 0.001f;
+			next->Ox[j] = O.x, next->Oy[j] = O.y, next->Oz[j] = O.z;
+			next->Dx[j] = R.x, next->Dy[j] = R.y, next->Dz[j] = R.z;
+			next->pixelIdx[j] = current->pixelIdx[i], next->pathLength[j] = current->pathLength[i] + hit.t;
+		}
+		next->count = depth >= 10 ? 0 : hitCount[1];
+		swap( current, next );
+	}
+}
+
+// OpenCL renderers, see gpurender.h
+
+void WhittedApp::RenderGPU()
+{
+	// one sample for every pixel from the OpenCL wavefront renderer, added to the
+	// accumulator; adaptive sampling and texture filtering do not apply
+	raysTraced = 0;
+	if (FLATTEN) { printf( "the OpenCL renderer needs FLATTEN 0\n" ), useGPU = false; return; }
+	if (!gpu) gpu = new GPURenderer( mesh, tlas, skyMap, scrWidth, scrHeight );
+	const uint sample = sampleCount[0]; // the same for all pixels in this mode
+	if (sample >= targetSpp) return;
+	gpu->UploadScene();
+	gpu->Render( camPos, p0, p1, p2, seedFrame, sample, 1, GPU_SHADOWS );
+	const float4* result = gpu->Result();
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < scrWidth * scrHeight; i++) AddSample( i, float3( result[i] ) ), sampleCount[i]++;
+	raysTraced = gpu->raysTraced;
+}
 
+static void CompareImages( const char* name, const float4* image, const float4* reference, const int pixels )
+{
+	// small differences are rounding: fast math on the device, and the order of
+	// operations; large ones are rays that found another hit
+	double sum = 0;
+	float maxDiff = 0;
+	int differ = 0;
+	for (int i = 0; i < pixels; i++)
+	{
+		const float3 a( image[i] ), b( reference[i] );
+		const float d = max( fabsf( a.x - b.x ), max( fabsf( a.y - b.y ), fabsf( a.z - b.z ) ) ) / max( 1.0f, max( b.x, max( b.y, b.z ) ) );
+		sum += d, maxDiff = max( maxDiff, d ), differ += d > 1 / 256.0f;
+	}
+	printf( "  %s versus CPU: mean difference %.6f, max %.4f; %i pixels (%.3f%%) differ by more than 1/256\n",
+		name, sum / pixels, maxDiff, differ, 100.0f * differ / pixels );
+}
+
+void WhittedApp::BenchmarkGPU( const int frames )
+{
+	// whitted --clbench [frames]: the OpenCL megakernel and wavefront renderers
+	// against the recursive CPU renderer, at 2 spp, with nearest texture lookups.
+	// No window is opened, so any OpenCL device will do, including CPU runtimes
+	// such as PoCL. Times are the best of 'frames' and include the read back.
+	Init();
+	if (FLATTEN) { printf( "the OpenCL renderer needs FLATTEN 0\n" ); return; }
+	SetupCamera();
+	textureFilter = false, adaptive = false;
+	const int pixels = scrWidth * scrHeight, spp = 2; // the megakernel takes two samples
+	vector<float4> reference( pixels ), image( pixels );
+	Timer timer;
+	ResetAccumulator();
+	targetSpp = spp, seedFrame = 0;
+	uint64_t rays = 0;
+	do ScheduleTiles(), RenderRecursive(), rays += raysTraced; while (raysTraced > 0);
+	const float cpuTime = timer.elapsed();
+	for (int i = 0; i < pixels; i++) reference[i] = float4( accumulator[i] * (1.0f / spp), 1 );
+	printf( "%ix%i, %i spp, %llu rays\nCPU, recursive: %.2fms, %.2f Mrays/s\n",
+		scrWidth, scrHeight, spp, (unsigned long long)rays, cpuTime * 1000, rays / (cpuTime * 1e6f) );
+	GPURenderer renderer( mesh, tlas, skyMap, scrWidth, scrHeight );
+	float best = 1e30f;
+	for (int i = 0; i < frames; i++)
+	{
+		timer.reset();
+		renderer.RenderMegakernel( camPos, p0, p1, p2, 0 );
+		renderer.ReadImage( image.data() );
+		best = min( best, timer.elapsed() );
+	}
+	printf( "OpenCL, megakernel: %.2fms, %.2f Mrays/s\n", best * 1000, rays / (best * 1e6f) );
+	CompareImages( "megakernel", image.data(), reference.data(), pixels );
+	for (int shadows = 0; shadows < 2; shadows++)
+	{
+		best = 1e30f;
+		for (int i = 0; i < frames; i++)
+		{
+			timer.reset();
+			renderer.Render( camPos, p0, p1, p2, 0, 0, spp, shadows );
+			best = min( best, timer.elapsed() );
 		}
+		// once more, waiting for every kernel, for the time per stage
+		renderer.profile = true;
+		renderer.Render( camPos, p0, p1, p2, 0, 0, spp, shadows );
+		renderer.profile = false;
+		const float* stage = renderer.stageSeconds;
+		printf( "OpenCL, wavefront%s: %.2fms, %.2f Mrays/s; generate %.2fms, extend %.2fms, shade %.2fms, connect %.2fms\n",
+			shadows ? " with shadow rays" : "", best * 1000, renderer.raysTraced / (best * 1e6f),
+			stage[0] * 1000, stage[1] * 1000, stage[2] * 1000, stage[3] * 1000 );
+		if (shadows)
+		{
+			// the CPU renderer has no shadows; against the image without them,
+			// shadow rays may only take the point light away, never add light
+			int darker = 0, brighter = 0;
+			for (int i = 0; i < pixels; i++)
+			{
+				const float3 a = float3( renderer.Result()[i] ) * (1.0f / spp), b( image[i] );
+				const float scale = 256 / max( 1.0f, max( b.x, max( b.y, b.z ) ) );
+				darker += max( b.x - a.x, max( b.y - a.y, b.z - a.z ) ) * scale > 1;
+				brighter += max( a.x - b.x, max( a.y - b.y, a.z - b.z ) ) * scale > 1;
+			}
+			printf( "  wavefront with shadow rays versus without: %i pixels (%.3f%%) in shadow, %i brighter\n",
+				darker, 100.0f * darker / pixels, brighter );
+			break;
+		}
+		for (int i = 0; i < pixels; i++) image[i] = float4( float3( renderer.Result()[i] ) * (1.0f / spp), 1 );
+		CompareImages( "wavefront", image.data(), reference.data(), pixels );
+	}
+	// scene updates: what an animated frame sends, against sending all of it
+	const uint allBytes = tlas.blasCount * 32 * sizeof( float ) + tlas.nodesUsed * sizeof( TLASNode );
+	uint64_t sent = 0;
+	timer.reset();
+	for (int i = 0; i < frames; i++) AnimateScene( tlas ), renderer.UploadScene(), sent += renderer.bytesUploaded;
+	clFinish( Kernel::GetQueue2() );
+	printf( "scene updates: %.0f of %u bytes per animated frame, %.3fms per frame including the animation\n",
+		(double)sent / frames, allBytes, timer.elapsed() * 1000 / frames );
+}
+
+// adaptive sampling: each tile's error is the standard error of its mean
+// luminance, relative to that mean. Every frame, the tiles with the largest
+// error share a fixed budget of primary rays, one sample per pixel; tiles
+// below ADAPTIVE_ERROR, or at the target sample count, are done.
+
+float WhittedApp::TileError( const int tile )
+{
+	const int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+	const int x1 = min( x0 + tileSize, scrWidth ), y1 = min( y0 + tileSize, scrHeight );
+	const uint n = sampleCount[x0 + y0 * scrWidth]; // the same for all pixels in a tile
+	if (n >= targetSpp) return 0;
+	if (n < ADAPTIVE_MINSPP) return 1e30f; // too few samples for a variance estimate
+	float variance = 0, mean = 0;
+	for (int y = y0; y < y1; y++) for (int x = x0; x < x1; x++)
+	{
+		const uint pixel = x + y * scrWidth;
+		const float m = Luminance( accumulator[pixel] ) / n;
+		variance += max( 0.0f, lumSquared[pixel] / n - m * m ) * n / (n - 1);
+		mean += m;
+	}
+	const float invPixels = 1.0f / ((x1 - x0) * (y1 - y0));
+	variance *= invPixels, mean *= invPixels;
+	return sqrtf( variance / n ) / (mean + 0.05f);
+}
 
-		for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++)
+static bool LargerError( const float2& a, const float2& b ) { return a.x > b.x; }
+
+void WhittedApp::ScheduleTiles()
+{
+	const int tiles = tilesX * tilesY;
+	if (!progressive || !adaptive)
+	{
+		// uniform: every tile gets a sample until it reaches the target
+		for (int i = 0; i < tiles; i++) tileActive[i] = sampleCount[(i % tilesX) * tileSize + (i / tilesX) * tileSize * scrWidth] < targetSpp;
+		return;
+	}
+	// rank the tiles by error; tile indices are stored as floats, exact up to 2^24
+	float2* rank = tileRank;
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < tiles; i++) rank[i] = float2( TileError( i ), (float)i );
+	sort( rank, rank + tiles, LargerError );
+	memset( tileActive, 0, tiles * sizeof( bool ) );
+	const int budget = max( 1, (int)(ADAPTIVE_BUDGET * scrWidth * scrHeight) / (tileSize * tileSize) );
+	for (int i = 0; i < min( tiles, budget ); i++)
+		if (rank[i].x > ADAPTIVE_ERROR) tileActive[(int)rank[i].y] = true;
+}
+
+void WhittedApp::ReportAdaptive()
+{
+	// error falls with the square root of the sample count, so a tile that ends at
+	// error e after n samples needs n * (e / ADAPTIVE_ERROR)^2 to reach the threshold;
+	// uniform sampling must give every tile what the worst one needs
+	const int tiles = tilesX * tilesY;
+	double used = 0;
+	uint uniform = ADAPTIVE_MINSPP;
+	for (int i = 0; i < tiles; i++)
+	{
+		const int x0 = (i % tilesX) * tileSize, y0 = (i / tilesX) * tileSize;
+		const uint n = sampleCount[x0 + y0 * scrWidth];
+		used += n * (double)(min( tileSize, scrWidth - x0 ) * min( tileSize, scrHeight - y0 ));
+		float e = TileError( i );
+		if (n >= targetSpp) uniform = targetSpp; else
 		{
-			// setup a primary ray
-			float3 pixelPos = ray.O + p0 +
-				(p1 - p0) * ((x * 8 + u + RandomFloat()) / SCRWIDTH) +
-				(p2 - p0) * ((y * 8 + v + RandomFloat()) / SCRHEIGHT);
-			ray.D = normalize( pixelPos - ray.O );
-			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-			uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
-			accumulator[pixelAddress] = Trace( ray , counter );
+			const float needed = n * (e / ADAPTIVE_ERROR) * (e / ADAPTIVE_ERROR);
+			uniform = max( uniform, min( targetSpp, (uint)ceilf( needed ) ) );
 		}
 	}
+	const double uniformRays = (double)uniform * scrWidth * scrHeight;
+	printf( "adaptive: %.2f spp on average; uniform sampling needs %i spp for the same error: %.1f%% of the rays saved\n",
+		used / ((double)scrWidth * scrHeight), uniform, 100 * (uniformRays - used) / uniformRays );
+}
+
+void WhittedApp::SetupCamera()
+{
+	static float angle = 0;// angle += 0.01f;
+	mat4 M1 = mat4::RotateY( angle ), M2 = M1 * mat4::RotateX( -0.65f );
+	// setup screen plane in world space
+	float aspectRatio = (float)scrWidth / scrHeight;
+	p0 = TransformPosition( float3( -aspectRatio, 1, 1.5f ), M2 );
+	p1 = TransformPosition( float3( aspectRatio, 1, 1.5f ), M2 );
+	p2 = TransformPosition( float3( -aspectRatio, -1, 1.5f ), M2 );
+	camPos = TransformPosition( camPos, M1 );
+	// spread angle of a pixel, for ray cone texture filtering; reflections off
+	// curved mirrors widen cones further, which this ignores
+	pixelSpread = length( p2 - p0 ) / (scrHeight * length( 0.5f * (p1 + p2) ));
+}
+
+void WhittedApp::ResetAccumulator()
+{
+	memset( accumulator, 0, scrWidth * scrHeight * sizeof( float3 ) );
+	memset( sampleCount, 0, scrWidth * scrHeight * sizeof( uint ) );
+	memset( lumSquared, 0, scrWidth * scrHeight * sizeof( float ) );
+	convertPending = false; // the last frame would otherwise carry over
+}
+
+// frame pipeline: at depth 2, a worker thread animates the next frame and
+// builds its TLAS while this one renders; at depth 3, it first converts the
+// previous frame, which is then shown a frame late. The scene of a frame is
+// in the front TLAS ('tlas'), the next one in 'backTlas'; each has its own
+// copy of the instances. Depth 3 renders into the accumulator while the worker
+// reads the last frame from 'prevAccumulator'. The worker is one persistent
+// thread, and its OpenMP loops run on that thread only, so the renderer keeps
+// all cores.
+
+void WhittedApp::ConvertFrame( const float3* frame, const uint* count, const Timer& started )
+{
 	// convert the floating point accumulator into pixels
-	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
+	Timer convertTimer;
+	Tonemap( frame, count, screen->pixels, scrWidth * scrHeight, tonemap, sRGB );
+	convertSeconds += convertTimer.elapsed();
+	latencySeconds += started.elapsed(), latencyFrames++;
+}
+
+void WhittedApp::PipelineWorker()
+{
+	omp_set_num_threads( 1 );
+	unique_lock<mutex> guard( workerLock );
+	while (1)
+	{
+		workerChanged.wait( guard, [this] { return workerBusy || workerQuit; } );
+		if (workerQuit) return;
+		guard.unlock();
+		if (workerConvert) ConvertFrame( prevAccumulator, prevSampleCount, prevStart );
+		Timer sceneTimer;
+		backStart.reset(), AnimateScene( backTlas );
+		sceneSeconds += sceneTimer.elapsed();
+		guard.lock();
+		workerBusy = false;
+		workerChanged.notify_all();
+	}
+}
+
+void WhittedApp::Shutdown()
+{
+	if (!worker.joinable()) return;
+	{
+		lock_guard<mutex> guard( workerLock );
+		workerQuit = true;
+	}
+	workerChanged.notify_all();
+	worker.join();
+}
+
+float WhittedApp::RenderFrame()
+{
+	// depth 3: the last frame goes to the worker, and rendering continues in the other buffers
+	const bool convertLate = convertPending;
+	if (convertLate) swap( accumulator, prevAccumulator ), swap( sampleCount, prevSampleCount ), prevStart = sceneStart, convertPending = false;
+	// the scene of this frame: built by the worker during the previous one, or now
+	if (backReady) swap( tlas, backTlas ), sceneStart = backStart, backReady = false; else
+	{
+		Timer sceneTimer;
+		sceneStart.reset(), AnimateScene( tlas );
+		sceneSeconds += sceneTimer.elapsed();
+	}
+	SetupCamera();
+	// progressive rendering: keep adding samples until the camera or scene changes
+	const float3 cam[4] = { camPos, p0, p1, p2 };
+	if (!progressive || SHOULD_MOVE || memcmp( cam, lastCam, sizeof( cam ) ) != 0)
+	{
+		ResetAccumulator();
+		memcpy( lastCam, cam, sizeof( cam ) );
+		convergeTimer.reset(), converged = false;
+	}
+	else if (convertLate)
+	{
+		// samples are added to the last frame's
+		memcpy( accumulator, prevAccumulator, scrWidth * scrHeight * sizeof( float3 ) );
+		memcpy( sampleCount, prevSampleCount, scrWidth * scrHeight * sizeof( uint ) );
+	}
+	targetSpp = progressive ? TARGET_SPP : 1;
+	// progressive samples depend on the sample index only, so a converged image is reproducible
+	seedFrame = progressive ? 0 : frameIdx;
+	ScheduleTiles();
+	// a frame left for the worker is converted whatever the depth is now
+	if (convertLate && pipelineDepth == 1) ConvertFrame( prevAccumulator, prevSampleCount, prevStart );
+	if (pipelineDepth > 1)
+	{
+		if (!backTlas.tlasNode)
+		{
+			// the back TLAS, over a copy of the instances; baked static instances
+			// get baked again, as Intersect uses the flattened BVH of its own TLAS
+			for (int i = 0; i < NUM_MESHES; i++) backInstance[i] = tlas.blas[i];
+			backTlas = TLAS( backInstance, NUM_MESHES );
+			if (FLATTEN) backTlas.Flatten( FLATTEN == 2 ? FLATTEN_MAXTRIS : 0xffffffff );
+		}
+		if (!worker.joinable()) worker = thread( &WhittedApp::PipelineWorker, this );
+		{
+			lock_guard<mutex> guard( workerLock );
+			workerConvert = convertLate, workerBusy = true;
+		}
+		workerChanged.notify_all();
+		backReady = true;
+	}
+	Timer renderTimer;
+	if (!converged)
+	{
+		if (useGPU) RenderGPU(); else if (wavefront) RenderWavefront(); else RenderRecursive();
+	}
+	frameIdx++;
+	const float renderTime = renderTimer.elapsed();
+	if (progressive && !converged && raysTraced == 0)
+	{
+		printf( "converged at %i spp in %.2fs\n", targetSpp, convergeTimer.elapsed() ), converged = true;
+		if (adaptive) ReportAdaptive();
+	}
+	{
+		unique_lock<mutex> guard( workerLock );
+		workerChanged.wait( guard, [this] { return !workerBusy; } );
+	}
+	// the image: converted now, or by the worker during the next frame
+	if (pipelineDepth == 3) convertPending = true; else ConvertFrame( accumulator, sampleCount, sceneStart );
+	return renderTime;
+}
+
+void WhittedApp::BenchmarkPipeline( const int frames )
+{
+	// whitted --pipebench [frames]: the interactive frame loop at each pipeline
+	// depth. Every frame animates the scene, rebuilds the TLAS and takes one
+	// sample per pixel, as with a moving scene. Latency runs from the start of
+	// a frame's animation to its pixels; throughput is frames per second.
+	screen = new Surface( scrWidth, scrHeight );
+	Init();
+	progressive = false, adaptive = false;
+	printf( "%ix%i, %i instances, %i frames per depth\n", scrWidth, scrHeight, NUM_MESHES, frames );
+	for (int depth = 1; depth <= 3; depth++)
+	{
+		pipelineDepth = depth;
+		for (int i = 0; i < 3; i++) RenderFrame(); // fill the pipeline
+		sceneSeconds = convertSeconds = latencySeconds = 0, latencyFrames = 0;
+		Timer timer;
+		double renderSeconds = 0;
+		for (int i = 0; i < frames; i++) renderSeconds += RenderFrame();
+		const float seconds = timer.elapsed();
+		// at depth 3, the loop converted the frame left by the fill frames and
+		// all but its own last one; drop that, so 'frames' frames were converted
+		convertPending = false;
+		printf( "depth %i: %.2fms per frame (%.1f fps), latency %.2fms; render %.2fms, animate and build %.3fms, convert %.2fms\n",
+			depth, seconds * 1000 / frames, frames / seconds, latencySeconds * 1000 / max( 1, latencyFrames ),
+			renderSeconds * 1000 / frames, sceneSeconds * 1000 / frames, convertSeconds * 1000 / frames );
+	}
+}
+
+void WhittedApp::Tick( float deltaTime )
+{
+	float renderTime = RenderFrame();
+	if (converged) raysTraced = 0, renderTime = 0;
+	// report throughput of the active renderer, averaged over roughly two seconds
+	const int mode = useGPU ? 3 : wavefront ? (sortSecondary ? 2 : 1) : 0;
+	if (statMode != mode) statMode = mode, statRays = statSeconds = statSortSeconds = 0, statFrames = 0, statTimer.reset();
+	if (!converged) statRays += raysTraced, statSeconds += renderTime, statSortSeconds += mode == 2 ? sortTime : 0, statFrames++;
+	if (statTimer.elapsed() >= 2 && statFrames > 0)
 	{
-		int r = min( 255, (int)(255 * accumulator[i].x) );
-		int g = min( 255, (int)(255 * accumulator[i].y) );
-		int b = min( 255, (int)(255 * accumulator[i].z) );
-		screen->pixels[i] = (r << 16) + (g << 8) + b;
+		const char* modeName[4] = { "recursive", "wavefront", "wavefront, sorted", "OpenCL wavefront" };
+		printf( "%s: %.2f Mrays/s, %.2fms per frame", modeName[mode], statRays / (statSeconds * 1e6), statSeconds * 1000 / statFrames );
+		if (mode == 2) printf( " (sorting: %.2fms)", statSortSeconds * 1000 / statFrames );
+		printf( "; pipeline depth %i, latency %.2fms\n", pipelineDepth, latencySeconds * 1000 / max( 1, latencyFrames ) );
+		statRays = statSeconds = statSortSeconds = 0, statFrames = 0, statTimer.reset();
+		latencySeconds = 0, latencyFrames = 0;
 	}
 
 	// Periodically print information about counters when certain conditions are met
@@ -197,47 +1167,47 @@ void WhittedApp::Tick( float deltaTime )
 		float totalBounces = 0;
 		float totalTraversals = 0;
 
-		uint length = sizeof(counters) / sizeof(counters[0]);
+		uint length = (uint)counters.size(); // the wavefront renderer does not register counters
 		for (int i = 0; i < length; i++)
 		{
-			//std::cout << "triangleTests: " << counters[i]->triangleTests << std::endl;
-			//std::cout << "boxTests: " << counters[i]->boxTests << std::endl;
+			//std::cout << "triangleTests: " << counters[i].triangleTests << std::endl;
+			//std::cout << "boxTests: " << counters[i].boxTests << std::endl;
 			// Triangle tests
-			if (counters[i]->triangleTests < minTriangleTests)
+			if (counters[i].triangleTests < minTriangleTests)
 			{
-				minTriangleTests = counters[i]->triangleTests;
+				minTriangleTests = counters[i].triangleTests;
 			}
-			if (counters[i]->triangleTests > maxTriangleTests)
+			if (counters[i].triangleTests > maxTriangleTests)
 			{
-				maxTriangleTests = counters[i]->triangleTests;
+				maxTriangleTests = counters[i].triangleTests;
 			}
 			// Box tests
-			if (counters[i]->boxTests < minBoxTests)
+			if (counters[i].boxTests < minBoxTests)
 			{
-				minBoxTests = counters[i]->boxTests;
+				minBoxTests = counters[i].boxTests;
 			}
-			if (counters[i]->boxTests > maxBoxTests)
+			if (counters[i].boxTests > maxBoxTests)
 			{
-				maxBoxTests = counters[i]->boxTests;
+				maxBoxTests = counters[i].boxTests;
 			}
 			// Bounces
-			if (counters[i]->bounces > maxBounces)
+			if (counters[i].bounces > maxBounces)
 			{
-				maxBounces = counters[i]->bounces;
+				maxBounces = counters[i].bounces;
 			}
 			// Traversals
-			if (counters[i]->traversals < minTraversals)
+			if (counters[i].traversals < minTraversals)
 			{
-				minTraversals = counters[i]->traversals;
+				minTraversals = counters[i].traversals;
 			}
-			if (counters[i]->traversals > maxTraversals)
+			if (counters[i].traversals > maxTraversals)
 			{
-				maxTraversals = counters[i]->traversals;
+				maxTraversals = counters[i].traversals;
 			}
-			totalTriangleTests = totalTriangleTests + counters[i]->triangleTests;
-			totalBoxTests = totalBoxTests + counters[i]->boxTests;
-			totalBounces = totalBounces + counters[i]->bounces;
-			totalTraversals = totalTraversals + counters[i]->traversals;
+			totalTriangleTests = totalTriangleTests + counters[i].triangleTests;
+			totalBoxTests = totalBoxTests + counters[i].boxTests;
+			totalBounces = totalBounces + counters[i].bounces;
+			totalTraversals = totalTraversals + counters[i].traversals;
 
 		}
 		std::cout << length << " rays fired." << std::endl;
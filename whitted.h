@@ -1,29 +1,116 @@
 #pragma once
 
-#define NUM_MESHES 9 // 4 for Dragons, 9 for Rips, 16 for Teapots
+#define NUM_MESHES 9 // 4 for Dragons, 9 for Rips, 16 for Teapots, 256 for the instancing benchmark (with camPosGrid)
 #define SHOULD_MOVE false
 #define HALF_MIRRORED true
+#define PROGRESSIVE true // accumulate samples while the view is static; press P to toggle
+#define TARGET_SPP 64 // samples per pixel after which a progressive image is done
+#define ADAPTIVE true // progressive mode: spend rays on noisy tiles first; press A to toggle
+#define ADAPTIVE_BUDGET 0.25f // primary rays per frame, relative to the pixel count
+#define ADAPTIVE_ERROR 0.01f // relative standard error at which a tile is done
+#define ADAPTIVE_MINSPP 4 // samples for every tile before variance is trusted
+#define FLATTEN 0 // 0: two-level TLAS, 1: bake static instances into one BVH, 2: hybrid, see below
+#define FLATTEN_MAXTRIS 20000 // hybrid mode only bakes static instances up to this size
+#define CLUSTER_TLAS false // build the TLAS with agglomerative clustering, from 256 instances; else top-down
+#define TILESIZE 8 // default tile size in pixels; the resolution need not be a multiple of it
+#define MAX_COUNTERS 524288 // ray counters kept for the periodic statistics
+#define WAVEFRONT false // start with the ray stream renderer; press W to toggle
+#define SORT_SECONDARY true // sort secondary ray streams for coherence; press S to toggle
+#define SORT_KEYS 4096 // direction octant (3 bits), origin cell (9 bits)
+#define SORT_BLOCKS 16 // independent ranges for the parallel counting sort
+#define TONEMAP TONEMAP_CLAMP // TONEMAP_CLAMP, TONEMAP_REINHARD or TONEMAP_ACES; press T to cycle
+#define TEXTURE_FILTER true // mipmapped, bilinear texture lookups with ray cone LOD; press F to toggle
+#define SRGB false // encode the final image as sRGB; press G to toggle
+#define PIPELINE_DEPTH 2 // 1: serial frames; 2: animate the next frame while rendering; 3: also convert the last one; press D to cycle
+#define GPU_RENDER false // render on the OpenCL wavefront path tracer; press C to toggle
+#define GPU_SHADOWS false // the OpenCL wavefront renderer traces shadow rays; off matches the CPU renderers
+#define MESH_FILE "assets/rip.obj" // or assets/teapot.obj, assets/dragon.obj; see the camera positions in Init
+#define TEXTURE_FILE "assets/bricks.png"
+#define SKY_FILE "assets/sky_19.hdr"
+#define SCENE_ARCHIVE "assets/scene.bin" // made by whitted --archive; replaces the sources when present
+#define SKY_CACHE "assets/sky_19.skymap" // the baked sky, memory-mapped on later launches
+#define MESH_PACK MESH_FILE ".mpk" // the mesh and its BVH, written on the first launch; see meshpack.h
 
 namespace Tmpl8
 {
 
+// SoA ray buffer for the wavefront renderer
+struct RayStream
+{
+	void Init( const uint capacity );
+	float* Ox = 0, * Oy = 0, * Oz = 0;
+	float* Dx = 0, * Dy = 0, * Dz = 0;
+	float* pathLength = 0;	// distance travelled before the origin, for ray cones
+	Intersection* hit = 0;	// filled by the intersection pass
+	uint* pixelIdx = 0;		// destination pixel in the accumulator
+	uint count = 0;
+};
+
 // application class
 class WhittedApp : public TheApp
 {
 public:
 	// game flow methods
 	void Init();
-	void AnimateScene();
-	float3 Trace( Ray& ray, RayCounter* counter, int rayDepth = 0 );
+	void InitScene();
+	bool LoadArchive();
+	void LoadMesh();
+	void BuildArchive( const char* file );
+	bool CommandLine( int argc, char** argv );
+	void RenderOffline( const int frames, const int spp, const char* file );
+	void AnimateScene( TLAS& scene );
+	float3 Trace( Ray& ray, RayCounter* counter, int rayDepth = 0, float pathLength = 0 );
+	void RenderRecursive();
+	void RenderWavefront();
+	void SortStream( RayStream*& rays, RayStream*& scratch );
+	void RenderGPU();
+	void BenchmarkGPU( const int frames );
+	void SetupCamera();
+	void ResetAccumulator();
+	float RenderFrame();
+	void ConvertFrame( const float3* frame, const uint* count, const Timer& started );
+	void PipelineWorker();
+	void BenchmarkPipeline( const int frames );
 	void Tick( float deltaTime );
-	void Shutdown() { /* implement if you want to do something on exit */ }
+	// shading, shared by both renderers
+	void LoadSky( const bool keepSource = false );
+	void SaveSkyCache();
+	float3 SampleSky( const float3& D );
+	float3 SampleSkyEquirect( const float3& D );
+	void BenchmarkSky();
+	float3 HitNormal( const Intersection& hit );
+	float TextureLOD( const Intersection& hit, const float3& D, const float3& N, const float coneWidth );
+	float3 ShadeDiffuse( const Intersection& hit, const float3& I, const float3& N, const float3& D, const float coneWidth );
+	bool IsMirror( const uint instIdx ) { return HALF_MIRRORED && ((instIdx * 17) & 1); }
+	// sampling
+	static float Luminance( const float3& c ) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+	void AddSample( const uint pixel, const float3& c )
+	{
+		const float l = Luminance( c );
+		accumulator[pixel] += c, lumSquared[pixel] += l * l;
+	}
+	float TileError( const int tile );
+	void ScheduleTiles();
+	void ReportAdaptive();
+	void Shutdown();
 	// input handling
 	void MouseUp( int button ) { /* implement if you want to detect mouse button presses */ }
 	void MouseDown( int button ) { /* implement if you want to detect mouse button presses */ }
 	void MouseMove( int x, int y ) { mousePos.x = x, mousePos.y = y; }
 	void MouseWheel( float y ) { /* implement if you want to handle the mouse wheel */ }
 	void KeyUp( int key ) { /* implement if you want to handle keys */ }
-	void KeyDown( int key ) { /* implement if you want to handle keys */ }
+	void KeyDown( int key )
+	{
+		if (key == GLFW_KEY_W) wavefront = !wavefront;
+		if (key == GLFW_KEY_S) sortSecondary = !sortSecondary;
+		if (key == GLFW_KEY_P) progressive = !progressive;
+		if (key == GLFW_KEY_A) adaptive = !adaptive, converged = false;
+		if (key == GLFW_KEY_T) tonemap = (tonemap + 1) % 3;
+		if (key == GLFW_KEY_G) sRGB = !sRGB;
+		if (key == GLFW_KEY_F) textureFilter = !textureFilter;
+		if (key == GLFW_KEY_C) useGPU = !useGPU, ResetAccumulator(), converged = false;
+		if (key == GLFW_KEY_D) pipelineDepth = pipelineDepth % 3 + 1;
+	}
 	// data members
 	int2 mousePos;
 	Mesh* mesh;
@@ -31,12 +118,69 @@ public:
 	TLAS tlas;
 	float3 p0, p1, p2; // virtual screen plane corners
 	float3 camPos;
-	float3* accumulator;
-	RayCounter* counters[524288] = { nullptr };
-	uint counterIdx = 0;
+	float pixelSpread; // cone angle of a primary ray
+	bool textureFilter = TEXTURE_FILTER;
+	float3* accumulator;	// sum of all samples since the last reset
+	uint* sampleCount;		// samples per pixel in the accumulator
+	float* lumSquared;		// sum of squared sample luminance, for variance estimates
+	// tiles of tileSize x tileSize pixels; the last column and row may be partial
+	int tileSize = TILESIZE, tilesX, tilesY;
+	// adaptive sampling: tiles that get a sample this frame, and tiles ranked by error
+	bool adaptive = ADAPTIVE;
+	bool* tileActive;
+	float2* tileRank;
+	// final conversion to pixels
+	int tonemap = TONEMAP;
+	bool sRGB = SRGB;
+	// progressive rendering
+	bool progressive = PROGRESSIVE, converged = false;
+	uint targetSpp = TARGET_SPP, seedFrame = 0;
+	float3 lastCam[4];		// camPos, p0, p1, p2 of the previous frame
+	Timer convergeTimer;
+	vector<RayCounter> counters; // a copy per rendered tile, up to MAX_COUNTERS
 	Timer timer;
-	float* skyPixels;
-	int skyWidth, skyHeight, skyBpp;
+	uint frameIdx = 0; // seeds the per-pixel random numbers
+	float* skyPixels;		// equirectangular source, released after baking
+	int skyWidth, skyHeight;
+	uint* skyMap;			// octahedral RGB9E5 sky, see cl/skymap.h
+	MappedFile* skyCache = 0; // owns skyMap when it was loaded from SKY_CACHE
+	SceneArchive* archive = 0; // owns mesh, skyMap and the TLAS nodes when loaded from SCENE_ARCHIVE
+	// wavefront renderer: ray streams for the current and next bounce, and
+	// per-material index lists (0: miss, 1: mirror, 2: diffuse) into the current one
+	bool wavefront = WAVEFRONT;
+	RayStream stream[3]; // third stream: destination for sorting
+	uint* hitList[3];
+	volatile LONG hitCount[3];
+	// secondary ray sorting: key per ray, and per-block counts for the parallel counting sort
+	bool sortSecondary = SORT_SECONDARY;
+	uint* sortKey;
+	uint* sortCount;
+	uint* lineStart; // first ray of each screen line in the primary stream
+	// OpenCL renderer, created on first use
+	bool useGPU = GPU_RENDER;
+	GPURenderer* gpu = 0;
+	// frame pipeline, see RenderFrame
+	int pipelineDepth = PIPELINE_DEPTH;
+	thread worker;			// persistent, started by the first pipelined frame
+	mutex workerLock;
+	condition_variable workerChanged;
+	bool workerBusy = false, workerConvert = false, workerQuit = false;
+	TLAS backTlas;			// the next frame, once 'backReady'
+	BVHInstance backInstance[256];
+	bool backReady = false;
+	float3* prevAccumulator; // depth 3: the last frame, converted while the next one renders
+	uint* prevSampleCount;
+	bool convertPending = false;
+	Timer sceneStart, backStart, prevStart; // started with the animation of each frame in flight
+	double sceneSeconds = 0, convertSeconds = 0, latencySeconds = 0;
+	int latencyFrames = 0;
+	// throughput measurement, reset when switching renderers
+	Timer statTimer;
+	double statRays = 0, statSeconds = 0, statSortSeconds = 0;
+	int statFrames = 0;
+	int statMode = -1;
+	uint64_t raysTraced = 0; // primary and secondary rays in the last frame
+	float sortTime = 0; // time spent reordering secondary rays in the last frame
 };
 
 } // namespace Tmpl8
\ No newline at end of file